@@ -0,0 +1,229 @@
+// complexity_estimator.h
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define COMPLEXITY_ESTIMATOR_SSE2 1
+#endif
+#include "luma_plane.h"
+#include "worker_pool.h"
+
+//! \brief Complexity of one frame
+struct frame_complexity
+{
+	double temporal;	//!< Mean absolute luma difference to the previous frame (0-255)
+	double spatial;		//!< Luma standard deviation (0-127.5)
+	double score;		//!< Combined, normalized to 0-1
+};
+
+//! \brief Cheap frame-complexity estimator on a 1/4 downsampled luma plane
+class complexity_estimator
+{
+	std::unique_ptr<luma_plane> mOwn;	// Null when the plane is shared
+	const luma_plane* mLuma;
+	unsigned int mSmallWidth;
+	unsigned int mSmallHeight;
+	worker_pool& mPool;
+	std::vector<unsigned char> mPrevious;
+	std::vector<uint64_t> mRowSad;
+	std::vector<uint64_t> mRowSum;
+	std::vector<uint64_t> mRowSquare;
+	bool mHasPrevious = false;
+
+	//! \brief SAD to the previous frame, sum and sum of squares of one small row, which then becomes the previous one
+	void measure_row(unsigned int y)
+	{
+		auto cur = mLuma->row(y);
+		auto prev = &mPrevious[size_t(y) * mSmallWidth];
+		uint64_t sad = 0, sum = 0, square = 0;
+		auto x = 0u;
+#ifdef COMPLEXITY_ESTIMATOR_SSE2
+		const auto zero = _mm_setzero_si128();
+		auto accSad = _mm_setzero_si128();
+		auto accSum = _mm_setzero_si128();
+		auto accSquare = _mm_setzero_si128();
+		for (; x + 16 <= mSmallWidth; x += 16)
+		{
+			auto c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + x));
+			auto p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + x));
+			accSad = _mm_add_epi64(accSad, _mm_sad_epu8(c, p));
+			accSum = _mm_add_epi64(accSum, _mm_sad_epu8(c, zero));
+			auto lo = _mm_unpacklo_epi8(c, zero);
+			auto hi = _mm_unpackhi_epi8(c, zero);
+			auto sq = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+			accSquare = _mm_add_epi64(accSquare, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero), _mm_unpackhi_epi32(sq, zero)));
+		}
+		uint64_t lanes[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), accSad);
+		sad = lanes[0] + lanes[1];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), accSum);
+		sum = lanes[0] + lanes[1];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), accSquare);
+		square = lanes[0] + lanes[1];
+#endif
+		for (; x < mSmallWidth; ++x)
+		{
+			int d = cur[x] - prev[x];
+			sad += d < 0 ? -d : d;
+			sum += cur[x];
+			square += cur[x] * cur[x];
+		}
+		mRowSad[y] = sad;
+		mRowSum[y] = sum;
+		mRowSquare[y] = square;
+		memcpy(prev, cur, mSmallWidth);
+	}
+	void init()
+	{
+		mSmallWidth = mLuma->width();
+		mSmallHeight = mLuma->height();
+		mPrevious.resize(size_t(mSmallWidth) * mSmallHeight);
+		mRowSad.resize(mSmallHeight);
+		mRowSum.resize(mSmallHeight);
+		mRowSquare.resize(mSmallHeight);
+	}
+public:
+	//! \brief Estimator that downsamples each frame itself
+	complexity_estimator(unsigned int width, unsigned int height, worker_pool& pool)
+		: mOwn(new luma_plane(width, height, pool)), mLuma(mOwn.get()), mPool(pool)
+	{
+		init();
+	}
+	//! \brief Estimator on a plane that is built for each frame before estimate(), e.g. by luma_plane_stage
+	complexity_estimator(const luma_plane& luma, worker_pool& pool)
+		: mLuma(&luma), mPool(pool)
+	{
+		init();
+	}
+
+	//! \brief Estimate a BGRA frame of 4 * width * height bytes
+	//! \note The first frame has no temporal term and is scored by spatial detail only.
+	frame_complexity estimate(const char* data)
+	{
+		if (mOwn)
+			mOwn->build(data);
+		else if (mLuma->source() != data)
+			throw std::runtime_error("Luma plane was not built for this frame.");
+		mPool.run(mSmallHeight, 8, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto y = begin; y < end; ++y)
+				measure_row(y);
+		});
+		uint64_t sad = 0, sum = 0, square = 0;
+		for (auto y = 0u; y < mSmallHeight; ++y)
+		{
+			sad += mRowSad[y];
+			sum += mRowSum[y];
+			square += mRowSquare[y];
+		}
+		auto n = double(mSmallWidth) * mSmallHeight;
+		auto mean = sum / n;
+		auto variance = square / n - mean * mean;
+
+		frame_complexity c;
+		c.temporal = mHasPrevious ? sad / n : 0.0;
+		c.spatial = variance > 0.0 ? std::sqrt(variance) : 0.0;
+		// Saturating curves: ~32 mean difference or ~64 deviation is treated as "very complex".
+		auto t = 1.0 - std::exp(-c.temporal / 16.0);
+		auto s = 1.0 - std::exp(-c.spatial / 32.0);
+		c.score = mHasPrevious ? 0.7 * t + 0.3 * s : s;
+		mHasPrevious = true;
+		return c;
+	}
+	void reset()	{ mHasPrevious = false; }
+};
+
+//! \brief Bitrate budget for bitrate_controller
+struct bitrate_budget
+{
+	unsigned int minBitrate;	//!< bps for a static frame
+	unsigned int maxBitrate;	//!< bps for a fully complex frame
+	unsigned int segmentFrames;	//!< Frames per decision
+};
+
+//! \brief Recommends a bitrate per segment from frame complexity
+class bitrate_controller
+{
+	bitrate_budget mBudget;
+	double mSum = 0.0;
+	double mPeak = 0.0;
+	unsigned int mFrames = 0;
+	unsigned int mBitrate;
+public:
+	explicit bitrate_controller(const bitrate_budget& budget)
+		: mBudget(budget), mBitrate(budget.maxBitrate)
+	{
+		if (budget.minBitrate > budget.maxBitrate || budget.segmentFrames == 0)
+			throw std::runtime_error("Invalid bitrate budget.");
+	}
+	//! \brief Default budget from resolution: 0.02 to 0.15 bits per pixel, 1 second segments
+	static bitrate_budget budget_for(unsigned int width, unsigned int height, unsigned int frameRate)
+	{
+		auto pixelRate = double(width) * height * frameRate;
+		bitrate_budget b;
+		b.minBitrate = static_cast<unsigned int>(pixelRate * 0.02);
+		b.maxBitrate = static_cast<unsigned int>(pixelRate * 0.15);
+		b.segmentFrames = frameRate;
+		return b;
+	}
+
+	//! \brief Add one frame. Returns true at the end of a segment when the bitrate changed.
+	bool add(const frame_complexity& c)
+	{
+		mSum += c.score;
+		mPeak = c.score > mPeak ? c.score : mPeak;
+		if (++mFrames < mBudget.segmentFrames)
+			return false;
+		// Lean towards the peak so short bursts inside a segment are not starved.
+		auto score = 0.75 * (mSum / mFrames) + 0.25 * mPeak;
+		auto range = double(mBudget.maxBitrate - mBudget.minBitrate);
+		auto bitrate = mBudget.minBitrate + static_cast<unsigned int>(range * score);
+		mSum = 0.0;
+		mPeak = 0.0;
+		mFrames = 0;
+		// Ignore changes under 5% to avoid reconfiguring the encoder for noise.
+		auto diff = bitrate > mBitrate ? bitrate - mBitrate : mBitrate - bitrate;
+		if (diff * 20ull < mBitrate)
+			return false;
+		mBitrate = bitrate;
+		return true;
+	}
+	unsigned int bitrate() const	{ return mBitrate; }
+};
+
+//! \brief Pipeline stage that estimates complexity and applies the recommended bitrate
+//! \note apply may be empty to only record recommendations.
+template<typename Sink>
+class complexity_stage
+{
+	Sink& mSink;
+	complexity_estimator& mEstimator;
+	bitrate_controller& mController;
+	std::function<void(unsigned int)> mApply;
+	frame_complexity mLast;
+public:
+	complexity_stage(Sink& sink, complexity_estimator& estimator, bitrate_controller& controller,
+					std::function<void(unsigned int)> apply = nullptr)
+		: mSink(sink), mEstimator(estimator), mController(controller), mApply(apply)
+	{
+		mLast.temporal = mLast.spatial = mLast.score = 0.0;
+	}
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		mLast = mEstimator.estimate(data);
+		if (mController.add(mLast) && mApply)
+			mApply(mController.bitrate());
+		mSink.write(data, duration);
+	}
+	//! \brief Complexity of the last written frame
+	const frame_complexity& last() const	{ return mLast; }
+};
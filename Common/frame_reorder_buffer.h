@@ -0,0 +1,209 @@
+// frame_reorder_buffer.h
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "writer_telemetry.h"
+
+//! \brief Multi-producer frame submission that releases frames to a single sink in sequence order
+//! \details Producers copy into the slot of (sequence % capacity) without locks. One consumer
+//!          thread calls Sink::write() in order. A missing sequence is skipped when a later
+//!          frame is already waiting, or a producer is blocked on a later sequence, and the
+//!          timeout has passed.
+template<typename Sink>
+class frame_reorder_buffer
+{
+	static const uint64_t Free = 0;
+	static const uint64_t Busy = ~0ull;
+
+	//! \brief state is Free, Busy, or sequence + 1 when the frame is ready
+	struct slot
+	{
+		std::atomic<uint64_t> state;
+		uint64_t duration;
+		std::vector<char> data;
+		char padding[64];
+	};
+
+	Sink& mSink;
+	unsigned int mFrameSize;
+	unsigned int mCapacity;
+	std::chrono::microseconds mTimeout;
+	std::unique_ptr<slot[]> mSlots;
+	std::atomic<uint64_t> mNext;
+	std::atomic<uint64_t> mEnd;		// One past the highest sequence submitted or waiting to be
+	std::atomic<uint64_t> mReleased;
+	std::atomic<uint64_t> mLate;
+	std::atomic<uint64_t> mMissing;
+	std::atomic<bool> mFinishing;
+	std::atomic<writer_telemetry*> mTelemetry;
+	std::thread mConsumer;
+
+	//! \brief Raise mEnd to sequence + 1
+	void extend(uint64_t sequence)
+	{
+		auto end = mEnd.load();
+		while (end < sequence + 1 && !mEnd.compare_exchange_weak(end, sequence + 1))
+			;
+	}
+
+	static void backoff(unsigned int& spins)
+	{
+		if (++spins < 64)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	void consume()
+	{
+		auto waitStart = std::chrono::steady_clock::now();
+		unsigned int spins = 0;
+		for (;;)
+		{
+			auto next = mNext.load();
+			auto end = mEnd.load();
+			if (next >= end && mFinishing.load())
+				break;
+			auto& s = mSlots[next % mCapacity];
+			if (s.state.load(std::memory_order_acquire) == next + 1)
+			{
+				mSink.write(s.data.data(), s.duration);
+				mNext.store(next + 1);
+				s.state.store(Free, std::memory_order_release);
+				++mReleased;
+				if (auto telemetry = mTelemetry.load(std::memory_order_acquire))
+					telemetry->set_queue_depth(end - next - 1);
+				waitStart = std::chrono::steady_clock::now();
+				spins = 0;
+				continue;
+			}
+			// Skip only when something later is waiting, so a slow but complete stream is never cut.
+			if (next + 1 < end && std::chrono::steady_clock::now() - waitStart >= mTimeout)
+			{
+				auto expected = Free;
+				if (s.state.compare_exchange_strong(expected, Busy))
+				{
+					mNext.store(next + 1);
+					s.state.store(Free, std::memory_order_release);
+					++mMissing;
+					if (auto telemetry = mTelemetry.load(std::memory_order_acquire))
+					{
+						telemetry->add_dropped();
+						telemetry->set_queue_depth(end - next - 1);
+					}
+					waitStart = std::chrono::steady_clock::now();
+					spins = 0;
+					continue;
+				}
+			}
+			backoff(spins);
+		}
+	}
+public:
+	//! \param frameSize Bytes per frame
+	//! \param capacity Number of frames that can be in flight
+	//! \param timeout How long to wait for each missing frame before skipping it
+	//! \param first Sequence of the first frame; earlier sequences are late
+	frame_reorder_buffer(Sink& sink, unsigned int frameSize, unsigned int capacity,
+						std::chrono::microseconds timeout, uint64_t first = 0)
+		: mSink(sink), mFrameSize(frameSize), mCapacity(capacity), mTimeout(timeout),
+		mNext(first), mEnd(first), mReleased(0), mLate(0), mMissing(0), mFinishing(false), mTelemetry(nullptr)
+	{
+		if (capacity == 0)
+			throw std::runtime_error("Capacity must not be zero.");
+		mSlots.reset(new slot[capacity]);
+		for (auto i = 0u; i < capacity; ++i)
+		{
+			mSlots[i].state = Free;
+			mSlots[i].duration = 0;
+			mSlots[i].data.resize(frameSize);
+		}
+		mConsumer = std::thread([this] { consume(); });
+	}
+	~frame_reorder_buffer()
+	{
+		finish();
+	}
+	frame_reorder_buffer(const frame_reorder_buffer&) = delete;
+	frame_reorder_buffer& operator=(const frame_reorder_buffer&) = delete;
+
+	//! \brief Sequence number of a timestamp on a fixed frame duration, rounded to nearest
+	static uint64_t sequence_of(uint64_t timestamp, uint64_t frameDuration)
+	{
+		return (timestamp + frameDuration / 2) / frameDuration;
+	}
+
+	//! \brief Submit a frame from any thread
+	//! \return false when the sequence was already released or skipped. The frame is dropped.
+	//! \note Blocks while the sequence is capacity or more frames ahead of the sink.
+	bool submit(uint64_t sequence, const char* data, uint64_t duration)
+	{
+		auto& s = mSlots[sequence % mCapacity];
+		unsigned int spins = 0;
+		for (;;)
+		{
+			auto next = mNext.load();
+			if (sequence < next)
+			{
+				++mLate;
+				if (auto telemetry = mTelemetry.load(std::memory_order_acquire))
+					telemetry->add_dropped();
+				return false;
+			}
+			if (sequence < next + mCapacity)
+			{
+				auto expected = Free;
+				if (s.state.compare_exchange_weak(expected, Busy))
+					break;
+			}
+			else if (spins == 0)
+			{
+				// Tell the consumer a later frame is waiting, so it can skip a hole in front of it.
+				extend(sequence);
+			}
+			backoff(spins);
+		}
+		// The consumer may have skipped this sequence between the check and the claim.
+		if (sequence < mNext.load())
+		{
+			s.state.store(Free, std::memory_order_release);
+			++mLate;
+			if (auto telemetry = mTelemetry.load(std::memory_order_acquire))
+				telemetry->add_dropped();
+			return false;
+		}
+		memcpy(s.data.data(), data, mFrameSize);
+		s.duration = duration;
+		extend(sequence);
+		s.state.store(sequence + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! \brief Count late and skipped frames as dropped and publish the queue depth (nullptr to stop)
+	void set_telemetry(writer_telemetry* telemetry)
+	{
+		mTelemetry.store(telemetry, std::memory_order_release);
+	}
+
+	//! \brief Release everything submitted so far and stop the consumer
+	//! \note All producers must have returned from submit().
+	void finish()
+	{
+		if (!mConsumer.joinable())
+			return;
+		mFinishing = true;
+		mConsumer.join();
+	}
+
+	uint64_t released() const	{ return mReleased.load(); }
+	uint64_t late() const		{ return mLate.load(); }
+	uint64_t missing() const	{ return mMissing.load(); }
+};
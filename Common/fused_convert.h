@@ -0,0 +1,392 @@
+// fused_convert.h
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FUSED_CONVERT_SSE2 1
+#endif
+#include "worker_pool.h"
+
+//! \brief Planar layout of the converted frame
+enum class yuv_layout
+{
+	nv12,	//!< Y plane, then interleaved UV at half resolution
+	i420,	//!< Y plane, U plane, V plane at half resolution
+};
+
+//! \brief Parameters of fused_converter
+struct fused_convert_desc
+{
+	unsigned int srcWidth;
+	unsigned int srcHeight;
+	unsigned int srcPitch;		//!< Bytes per source row. 0 means 4 * srcWidth.
+	unsigned int cropX;
+	unsigned int cropY;
+	unsigned int cropWidth;		//!< 0 means srcWidth - cropX
+	unsigned int cropHeight;	//!< 0 means srcHeight - cropY
+	unsigned int dstWidth;		//!< Must be even
+	unsigned int dstHeight;		//!< Must be even
+	yuv_layout layout;
+	unsigned int overlayX;		//!< Top-left of the overlay text in destination pixels
+	unsigned int overlayY;
+	unsigned int overlayScale;	//!< Pixels per font dot. 0 disables the overlay.
+	unsigned char overlayAlpha;	//!< Opacity of the white text
+};
+
+//! \brief Crop, bilinear scale, overlay and BGRA to BT.601 4:2:0 conversion in one pass
+//! \details Output is produced in bands of rows on a worker_pool. Each band reads only the
+//!          source rows it samples and writes each output byte once; the intermediate
+//!          scaled and stamped pixels are never stored.
+class fused_converter
+{
+	fused_convert_desc mDesc;
+	worker_pool& mPool;
+	std::vector<unsigned int> mX0;		// Source byte offset of the left tap
+	std::vector<unsigned int> mX1;		// Source byte offset of the right tap
+	std::vector<unsigned short> mFx;	// Right tap weight, 0-256
+	std::vector<unsigned short> mWx;	// { 256 - fx x4, fx x4 } per column for SSE2
+	std::vector<unsigned int> mY0;
+	std::vector<unsigned int> mY1;
+	std::vector<unsigned short> mFy;
+	std::vector<unsigned char> mOverlay;	// Alpha mask, overlayWidth * overlayHeight
+	unsigned int mOverlayWidth = 0;
+	unsigned int mOverlayHeight = 0;
+
+	//! \brief 3x5 font for "0123456789:"
+	static const unsigned char* glyph(char c)
+	{
+		static const unsigned char digits[11][5] =
+		{
+			{ 7, 5, 5, 5, 7 }, { 2, 6, 2, 2, 7 }, { 7, 1, 7, 4, 7 }, { 7, 1, 7, 1, 7 },
+			{ 5, 5, 7, 1, 1 }, { 7, 4, 7, 1, 7 }, { 7, 4, 7, 5, 7 }, { 7, 1, 1, 1, 1 },
+			{ 7, 5, 7, 5, 7 }, { 7, 5, 7, 1, 7 }, { 0, 2, 0, 2, 0 },
+		};
+		if (c >= '0' && c <= '9')
+			return digits[c - '0'];
+		if (c == ':')
+			return digits[10];
+		return nullptr;
+	}
+
+	static void build_taps(unsigned int dst, unsigned int src, unsigned int offset, unsigned int step,
+							std::vector<unsigned int>& t0, std::vector<unsigned int>& t1, std::vector<unsigned short>& f)
+	{
+		t0.resize(dst);
+		t1.resize(dst);
+		f.resize(dst);
+		for (auto i = 0u; i < dst; ++i)
+		{
+			// Pixel centers: (i + 0.5) * src / dst - 0.5, in 8-bit fixed point
+			long long pos = ((2ll * i + 1) * src * 256) / (2ll * dst) - 128;
+			if (pos < 0)
+				pos = 0;
+			auto i0 = static_cast<unsigned int>(pos >> 8);
+			auto i1 = i0 + 1 < src ? i0 + 1 : src - 1;
+			t0[i] = (offset + i0) * step;
+			t1[i] = (offset + i1) * step;
+			f[i] = static_cast<unsigned short>(i0 + 1 < src ? pos & 0xff : 0);
+		}
+	}
+
+	//! \brief Scaled, stamped B, G, R of one destination pixel
+	void sample(const unsigned char* r0, const unsigned char* r1, unsigned int fy,
+				unsigned int x, unsigned int y, int bgr[3]) const
+	{
+		auto x0 = mX0[x], x1 = mX1[x];
+		unsigned int fx = mFx[x];
+		for (auto c = 0; c < 3; ++c)
+		{
+			auto top = r0[x0 + c] * (256 - fx) + r0[x1 + c] * fx;
+			auto bottom = r1[x0 + c] * (256 - fx) + r1[x1 + c] * fx;
+			bgr[c] = static_cast<int>((top * (256 - fy) + bottom * fy + 32768) >> 16);
+		}
+		if (mOverlayWidth && x >= mDesc.overlayX && y >= mDesc.overlayY &&
+			x - mDesc.overlayX < mOverlayWidth && y - mDesc.overlayY < mOverlayHeight)
+		{
+			int a = mOverlay[(y - mDesc.overlayY) * mOverlayWidth + (x - mDesc.overlayX)];
+			for (auto c = 0; c < 3; ++c)
+				bgr[c] += ((255 - bgr[c]) * a + 127) / 255;
+		}
+	}
+
+#ifdef FUSED_CONVERT_SSE2
+	static __m128i load_pixel(const unsigned char* p)
+	{
+		int v;
+		memcpy(&v, p, 4);
+		return _mm_cvtsi32_si128(v);
+	}
+
+	//! \brief Scaled B, G, R, A of one destination pixel in the low four 16-bit lanes
+	__m128i sample(const unsigned char* r0, const unsigned char* r1, __m128i wy0, __m128i wy1, unsigned int x) const
+	{
+		const auto zero = _mm_setzero_si128();
+		const auto round = _mm_set1_epi16(128);
+		auto x0 = mX0[x], x1 = mX1[x];
+		// Left and right taps side by side; 255 * 256 still fits in an unsigned 16-bit lane.
+		auto top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(load_pixel(r0 + x0), load_pixel(r0 + x1)), zero);
+		auto bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(load_pixel(r1 + x0), load_pixel(r1 + x1)), zero);
+		auto v = _mm_add_epi16(_mm_mullo_epi16(top, wy0), _mm_mullo_epi16(bottom, wy1));
+		v = _mm_srli_epi16(_mm_add_epi16(v, round), 8);
+		auto h = _mm_mullo_epi16(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mWx[8 * x])));
+		h = _mm_add_epi16(h, _mm_srli_si128(h, 8));
+		return _mm_srli_epi16(_mm_add_epi16(h, round), 8);
+	}
+
+	//! \brief Blend the overlay into two pixels packed as 8 16-bit lanes
+	__m128i stamp(__m128i px, unsigned int x, unsigned int y) const
+	{
+		if (!mOverlayWidth || y < mDesc.overlayY || y - mDesc.overlayY >= mOverlayHeight)
+			return px;
+		unsigned short a[2];
+		for (auto i = 0u; i < 2; ++i)
+		{
+			auto ox = x + i - mDesc.overlayX;
+			a[i] = x + i >= mDesc.overlayX && ox < mOverlayWidth ? mOverlay[(y - mDesc.overlayY) * mOverlayWidth + ox] : 0;
+		}
+		if (!a[0] && !a[1])
+			return px;
+		auto alpha = _mm_setr_epi16(a[0], a[0], a[0], 0, a[1], a[1], a[1], 0);
+		auto inv = _mm_sub_epi16(_mm_set1_epi16(255), px);
+		auto add = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(inv, alpha), _mm_set1_epi16(255)), 8);
+		return _mm_add_epi16(px, add);
+	}
+
+	//! \brief Two destination rows and their chroma row
+	void convert_rows(const unsigned char* src, unsigned int y, unsigned char* yPlane,
+					unsigned char* uPlane, unsigned char* vPlane, unsigned int chromaStep) const
+	{
+		auto pitch = mDesc.srcPitch;
+		auto w = mDesc.dstWidth;
+		const unsigned char* top0 = src + size_t(mY0[y]) * pitch;
+		const unsigned char* top1 = src + size_t(mY1[y]) * pitch;
+		const unsigned char* bottom0 = src + size_t(mY0[y + 1]) * pitch;
+		const unsigned char* bottom1 = src + size_t(mY1[y + 1]) * pitch;
+		auto wyTop0 = _mm_set1_epi16(static_cast<short>(256 - mFy[y]));
+		auto wyTop1 = _mm_set1_epi16(static_cast<short>(mFy[y]));
+		auto wyBottom0 = _mm_set1_epi16(static_cast<short>(256 - mFy[y + 1]));
+		auto wyBottom1 = _mm_set1_epi16(static_cast<short>(mFy[y + 1]));
+		const auto coefY = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+		const auto round = _mm_set1_epi32(128);
+		auto yTop = yPlane + size_t(y) * w;
+		auto yBottom = yTop + w;
+		auto chroma = size_t(y / 2) * (chromaStep == 2 ? w : w / 2);
+		auto luma = [&](__m128i px, unsigned char* dest)
+		{
+			auto m = _mm_madd_epi16(px, coefY);
+			m = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(m, _mm_srli_epi64(m, 32)), round), 8);
+			dest[0] = static_cast<unsigned char>(_mm_cvtsi128_si32(m) + 16);
+			dest[1] = static_cast<unsigned char>(_mm_cvtsi128_si32(_mm_srli_si128(m, 8)) + 16);
+		};
+		for (auto x = 0u; x < w; x += 2)
+		{
+			auto top = _mm_unpacklo_epi64(sample(top0, top1, wyTop0, wyTop1, x), sample(top0, top1, wyTop0, wyTop1, x + 1));
+			auto bottom = _mm_unpacklo_epi64(sample(bottom0, bottom1, wyBottom0, wyBottom1, x), sample(bottom0, bottom1, wyBottom0, wyBottom1, x + 1));
+			top = stamp(top, x, y);
+			bottom = stamp(bottom, x, y + 1);
+			luma(top, yTop + x);
+			luma(bottom, yBottom + x);
+			auto sum = _mm_add_epi16(top, bottom);
+			sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+			int b = (_mm_extract_epi16(sum, 0) + 2) >> 2;
+			int g = (_mm_extract_epi16(sum, 1) + 2) >> 2;
+			int r = (_mm_extract_epi16(sum, 2) + 2) >> 2;
+			auto c = chroma + (x / 2) * chromaStep;
+			uPlane[c] = static_cast<unsigned char>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			vPlane[c] = static_cast<unsigned char>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+#else
+	//! \brief Two destination rows and their chroma row
+	void convert_rows(const unsigned char* src, unsigned int y, unsigned char* yPlane,
+					unsigned char* uPlane, unsigned char* vPlane, unsigned int chromaStep) const
+	{
+		auto pitch = mDesc.srcPitch;
+		auto w = mDesc.dstWidth;
+		const unsigned char* top0 = src + size_t(mY0[y]) * pitch;
+		const unsigned char* top1 = src + size_t(mY1[y]) * pitch;
+		const unsigned char* bottom0 = src + size_t(mY0[y + 1]) * pitch;
+		const unsigned char* bottom1 = src + size_t(mY1[y + 1]) * pitch;
+		auto yTop = yPlane + size_t(y) * w;
+		auto yBottom = yTop + w;
+		auto chroma = size_t(y / 2) * (chromaStep == 2 ? w : w / 2);
+		for (auto x = 0u; x < w; x += 2)
+		{
+			int p[4][3];
+			sample(top0, top1, mFy[y], x, y, p[0]);
+			sample(top0, top1, mFy[y], x + 1, y, p[1]);
+			sample(bottom0, bottom1, mFy[y + 1], x, y + 1, p[2]);
+			sample(bottom0, bottom1, mFy[y + 1], x + 1, y + 1, p[3]);
+			unsigned char* ys[4] = { yTop + x, yTop + x + 1, yBottom + x, yBottom + x + 1 };
+			int b = 0, g = 0, r = 0;
+			for (auto i = 0; i < 4; ++i)
+			{
+				*ys[i] = static_cast<unsigned char>(((66 * p[i][2] + 129 * p[i][1] + 25 * p[i][0] + 128) >> 8) + 16);
+				b += p[i][0];
+				g += p[i][1];
+				r += p[i][2];
+			}
+			b = (b + 2) >> 2;
+			g = (g + 2) >> 2;
+			r = (r + 2) >> 2;
+			auto c = chroma + (x / 2) * chromaStep;
+			uPlane[c] = static_cast<unsigned char>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			vPlane[c] = static_cast<unsigned char>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+#endif
+public:
+	fused_converter(const fused_convert_desc& desc, worker_pool& pool)
+		: mDesc(desc), mPool(pool)
+	{
+		if (mDesc.srcPitch == 0)
+			mDesc.srcPitch = 4 * mDesc.srcWidth;
+		if (mDesc.cropWidth == 0)
+			mDesc.cropWidth = mDesc.srcWidth - mDesc.cropX;
+		if (mDesc.cropHeight == 0)
+			mDesc.cropHeight = mDesc.srcHeight - mDesc.cropY;
+		if (mDesc.cropX + mDesc.cropWidth > mDesc.srcWidth || mDesc.cropY + mDesc.cropHeight > mDesc.srcHeight)
+			throw std::runtime_error("Crop rectangle is out of the frame.");
+		if (mDesc.dstWidth == 0 || mDesc.dstHeight == 0 || mDesc.dstWidth % 2 || mDesc.dstHeight % 2)
+			throw std::runtime_error("Destination size must be even.");
+		build_taps(mDesc.dstWidth, mDesc.cropWidth, mDesc.cropX, 4, mX0, mX1, mFx);
+		build_taps(mDesc.dstHeight, mDesc.cropHeight, mDesc.cropY, 1, mY0, mY1, mFy);
+		mWx.resize(8 * mDesc.dstWidth);
+		for (auto x = 0u; x < mDesc.dstWidth; ++x)
+		{
+			for (auto i = 0u; i < 4; ++i)
+			{
+				mWx[8 * x + i] = static_cast<unsigned short>(256 - mFx[x]);
+				mWx[8 * x + 4 + i] = mFx[x];
+			}
+		}
+	}
+
+	//! \brief Bytes of one converted frame
+	unsigned int frame_size() const	{ return mDesc.dstWidth * mDesc.dstHeight * 3 / 2; }
+
+	//! \brief Text stamped on following frames. Digits and ':' only; nullptr clears it.
+	void set_overlay(const char* text)
+	{
+		mOverlayWidth = mOverlayHeight = 0;
+		auto scale = mDesc.overlayScale;
+		if (!text || scale == 0)
+			return;
+		auto length = static_cast<unsigned int>(strlen(text));
+		auto width = (4 * length) * scale;
+		auto height = 5 * scale;
+		if (mDesc.overlayX + width > mDesc.dstWidth)
+			width = mDesc.overlayX < mDesc.dstWidth ? mDesc.dstWidth - mDesc.overlayX : 0;
+		if (mDesc.overlayY + height > mDesc.dstHeight)
+			height = mDesc.overlayY < mDesc.dstHeight ? mDesc.dstHeight - mDesc.overlayY : 0;
+		if (width == 0 || height == 0)
+			return;
+		mOverlay.assign(width * height, 0);
+		for (auto i = 0u; i < length; ++i)
+		{
+			auto g = glyph(text[i]);
+			if (!g)
+				continue;
+			for (auto y = 0u; y < height; ++y)
+			{
+				auto bits = g[y / scale];
+				for (auto dx = 0u; dx < 3 * scale; ++dx)
+				{
+					auto x = 4 * scale * i + dx;
+					if (x < width && (bits >> (2 - dx / scale)) & 1)
+						mOverlay[y * width + x] = mDesc.overlayAlpha;
+				}
+			}
+		}
+		mOverlayWidth = width;
+		mOverlayHeight = height;
+	}
+
+	//! \brief Convert one BGRA frame into frame_size() bytes at dest
+	void convert(const char* data, char* dest) const
+	{
+		auto src = reinterpret_cast<const unsigned char*>(data);
+		auto yPlane = reinterpret_cast<unsigned char*>(dest);
+		auto lumaSize = size_t(mDesc.dstWidth) * mDesc.dstHeight;
+		unsigned char* uPlane;
+		unsigned char* vPlane;
+		unsigned int chromaStep;
+		if (mDesc.layout == yuv_layout::nv12)
+		{
+			uPlane = yPlane + lumaSize;
+			vPlane = uPlane + 1;
+			chromaStep = 2;
+		}
+		else
+		{
+			uPlane = yPlane + lumaSize;
+			vPlane = uPlane + lumaSize / 4;
+			chromaStep = 1;
+		}
+		// A band of 16 rows keeps its source rows and output rows in L1/L2.
+		mPool.run(mDesc.dstHeight / 2, 8, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto pair = begin; pair < end; ++pair)
+				convert_rows(src, 2 * pair, yPlane, uPlane, vPlane, chromaStep);
+		});
+	}
+};
+
+//! \brief Pipeline stage that converts each frame and stamps a timecode or frame counter
+//! \note The sink must be created for dstWidth x dstHeight NV12/I420 input.
+template<typename Sink>
+class fused_convert_stage
+{
+	Sink& mSink;
+	fused_converter& mConverter;
+	std::vector<char> mFrame;
+	bool mTimecode;
+	unsigned int mFrameRate;
+	unsigned long long mIndex = 0;
+	unsigned long long mTime = 0;
+public:
+	//! \param timecode true stamps HH:MM:SS:FF, false stamps the frame number
+	fused_convert_stage(Sink& sink, fused_converter& converter, bool timecode, unsigned int frameRate)
+		: mSink(sink), mConverter(converter), mFrame(converter.frame_size()),
+		mTimecode(timecode), mFrameRate(frameRate)
+	{
+	}
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		char text[32];
+		if (mTimecode)
+		{
+			// Duration is in 100ns units.
+			auto seconds = mTime / 10000000;
+			auto h = static_cast<unsigned int>(seconds / 3600);
+			auto m = static_cast<unsigned int>(seconds / 60 % 60);
+			auto s = static_cast<unsigned int>(seconds % 60);
+			auto f = static_cast<unsigned int>((mTime % 10000000) * mFrameRate / 10000000);
+#ifdef _MSC_VER
+			sprintf_s(text, "%02u:%02u:%02u:%02u", h, m, s, f);
+#else
+			snprintf(text, sizeof(text), "%02u:%02u:%02u:%02u", h, m, s, f);
+#endif
+		}
+		else
+		{
+#ifdef _MSC_VER
+			sprintf_s(text, "%llu", mIndex);
+#else
+			snprintf(text, sizeof(text), "%llu", mIndex);
+#endif
+		}
+		mConverter.set_overlay(text);
+		mConverter.convert(data, mFrame.data());
+		++mIndex;
+		mTime += duration;
+		mSink.write(mFrame.data(), duration);
+	}
+};
@@ -0,0 +1,110 @@
+// luma_plane.h
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LUMA_PLANE_SSE2 1
+#endif
+#include "worker_pool.h"
+
+//! \brief 1/4 downsampled luma plane of a BGRA frame, for frame analysis
+//! \details One plane can feed several analyzers (complexity_estimator, scene_cut_detector),
+//!          so each frame is read and downsampled once; see luma_plane_stage.
+class luma_plane
+{
+	unsigned int mWidth;
+	unsigned int mHeight;
+	unsigned int mSmallWidth;
+	unsigned int mSmallHeight;
+	worker_pool& mPool;
+	std::vector<unsigned char> mData;
+	const char* mSource = nullptr;
+public:
+	luma_plane(unsigned int width, unsigned int height, worker_pool& pool)
+		: mWidth(width), mHeight(height), mSmallWidth(width / 4), mSmallHeight(height / 4), mPool(pool)
+	{
+		if (mSmallWidth == 0 || mSmallHeight == 0)
+			throw std::runtime_error("Frame is too small.");
+		mData.resize(size_t(mSmallWidth) * mSmallHeight);
+	}
+	luma_plane(const luma_plane&) = delete;
+	luma_plane& operator=(const luma_plane&) = delete;
+
+	//! \brief 4x4 box average of BT.601 luma (29, 150, 77 / 256) of BGRA rows 4y-4y+3 into one small row
+	static void downsample_row(const unsigned char* src, size_t pitch, unsigned char* dest, unsigned int smallWidth)
+	{
+		auto x = 0u;
+#ifdef LUMA_PLANE_SSE2
+		auto zero = _mm_setzero_si128();
+		auto weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+		for (; x < smallWidth; ++x)
+		{
+			auto acc = _mm_setzero_si128();
+			for (auto j = 0u; j < 4; ++j)
+			{
+				auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + j * pitch + 16 * x));
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights));
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights));
+			}
+			acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+			acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+			dest[x] = static_cast<unsigned char>((static_cast<unsigned int>(_mm_cvtsi128_si32(acc)) + 2048) >> 12);
+		}
+#endif
+		for (; x < smallWidth; ++x)
+		{
+			unsigned int sum = 0;
+			for (auto j = 0u; j < 4; ++j)
+			{
+				auto p = src + j * pitch + 16 * x;
+				for (auto i = 0u; i < 4; ++i, p += 4)
+					sum += 29 * p[0] + 150 * p[1] + 77 * p[2];
+			}
+			dest[x] = static_cast<unsigned char>((sum + 2048) >> 12);
+		}
+	}
+
+	//! \brief Downsample a BGRA frame of 4 * width * height bytes
+	void build(const char* data)
+	{
+		auto src = reinterpret_cast<const unsigned char*>(data);
+		auto pitch = size_t(4) * mWidth;
+		mPool.run(mSmallHeight, 8, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto y = begin; y < end; ++y)
+				downsample_row(src + 4 * y * pitch, pitch, &mData[size_t(y) * mSmallWidth], mSmallWidth);
+		});
+		mSource = data;
+	}
+
+	unsigned int frame_width() const	{ return mWidth; }
+	unsigned int frame_height() const	{ return mHeight; }
+	unsigned int width() const			{ return mSmallWidth; }
+	unsigned int height() const			{ return mSmallHeight; }
+	const unsigned char* row(unsigned int y) const	{ return &mData[size_t(y) * mSmallWidth]; }
+	//! \brief The frame passed to the last build(), or nullptr
+	const char* source() const			{ return mSource; }
+};
+
+//! \brief Stage that builds a shared luma_plane for the analyzers downstream of it
+template<typename Sink>
+class luma_plane_stage
+{
+	Sink& mSink;
+	luma_plane& mLuma;
+public:
+	luma_plane_stage(Sink& sink, luma_plane& luma)
+		: mSink(sink), mLuma(luma)
+	{
+	}
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		mLuma.build(data);
+		mSink.write(data, duration);
+	}
+};
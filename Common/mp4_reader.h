@@ -0,0 +1,457 @@
+// mp4_reader.h
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//! \brief Expected access pattern of a mapped_file, passed to the OS as a readahead hint
+enum class file_access
+{
+	sequential,	//!< Front to back, e.g. scanning every sample (read ahead aggressively)
+	random,		//!< Jumps between a few samples, e.g. seeking (do not read ahead)
+};
+
+//! \brief Read-only memory mapping of a whole file
+class mapped_file
+{
+	const unsigned char* mData = nullptr;
+	uint64_t mSize = 0;
+#ifdef _WIN32
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+	HANDLE mMapping = nullptr;
+#else
+	int mFd = -1;
+#endif
+
+	void release()
+	{
+#ifdef _WIN32
+		if (mData)
+			UnmapViewOfFile(mData);
+		if (mMapping)
+			CloseHandle(mMapping);
+		if (mFile != INVALID_HANDLE_VALUE)
+			CloseHandle(mFile);
+		mMapping = nullptr;
+		mFile = INVALID_HANDLE_VALUE;
+#else
+		if (mData)
+			munmap(const_cast<unsigned char*>(mData), mSize);
+		if (mFd >= 0)
+			close(mFd);
+		mFd = -1;
+#endif
+		mData = nullptr;
+	}
+	//! \brief Release what the constructor has opened so far and throw
+	void fail(const char* message)
+	{
+		release();
+		throw std::runtime_error(message);
+	}
+public:
+	explicit mapped_file(const char* path, file_access access = file_access::sequential)
+	{
+#ifdef _WIN32
+		mFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			access == file_access::random ? FILE_FLAG_RANDOM_ACCESS : FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (mFile == INVALID_HANDLE_VALUE)
+			fail("Cannot open file.");
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(mFile, &size))
+			fail("Cannot get file size.");
+		mSize = size.QuadPart;
+		if (mSize == 0)
+			return;
+		mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mMapping)
+			fail("Cannot map file.");
+		mData = static_cast<const unsigned char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		mFd = open(path, O_RDONLY);
+		if (mFd < 0)
+			fail("Cannot open file.");
+		struct stat st;
+		if (fstat(mFd, &st) != 0)
+			fail("Cannot get file size.");
+		mSize = static_cast<uint64_t>(st.st_size);
+		if (mSize == 0)
+			return;
+		auto p = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, mFd, 0);
+		mData = p == MAP_FAILED ? nullptr : static_cast<const unsigned char*>(p);
+		if (mData)
+			madvise(p, mSize, access == file_access::random ? MADV_RANDOM : MADV_SEQUENTIAL);
+#endif
+		if (!mData)
+			fail("Cannot map file.");
+	}
+	~mapped_file()
+	{
+		release();
+	}
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	const unsigned char* data() const	{ return mData; }
+	uint64_t size() const				{ return mSize; }
+};
+
+//! \brief One encoded frame, pointing into the mapped file
+struct mp4_frame
+{
+	const unsigned char* data;	//!< Length-prefixed NAL units (see mp4_reader::nal_length_size)
+	uint32_t size;
+	uint64_t decodeTime;		//!< In timescale units
+	uint64_t presentationTime;	//!< decodeTime + composition offset
+	bool keyframe;
+};
+
+//! \brief Zero-copy demuxer for the first video track of a (non-fragmented) MP4 file
+//! \details Only the moov box is parsed. stts/ctts/stss/stsz/stsc/stco/co64 are expanded
+//!          into per-sample arrays, so frame() is O(1), and time and keyframe lookups are
+//!          binary searches. Sample data is read from the mapping only when accessed.
+class mp4_reader
+{
+	struct box
+	{
+		const unsigned char* data;	// Payload
+		uint64_t size;				// Payload size
+		uint32_t type;
+	};
+
+	mapped_file mFile;
+	uint32_t mTimescale = 0;
+	uint64_t mDuration = 0;
+	uint32_t mWidth = 0;
+	uint32_t mHeight = 0;
+	uint32_t mNalLengthSize = 4;
+	const unsigned char* mAvcConfig = nullptr;
+	uint32_t mAvcConfigSize = 0;
+	std::vector<uint64_t> mOffsets;
+	std::vector<uint32_t> mSizes;
+	std::vector<uint64_t> mTimes;
+	std::vector<int32_t> mCompositionOffsets;	// Empty when there is no ctts
+	std::vector<uint32_t> mKeyframes;			// Sorted sample indices
+	std::vector<unsigned char> mKeyframeFlags;
+
+	static uint32_t fourcc(const char* s)
+	{
+		return (uint32_t(uint8_t(s[0])) << 24) | (uint32_t(uint8_t(s[1])) << 16) | (uint32_t(uint8_t(s[2])) << 8) | uint8_t(s[3]);
+	}
+	static uint32_t be32(const unsigned char* p)
+	{
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+	}
+	static uint64_t be64(const unsigned char* p)
+	{
+		return (uint64_t(be32(p)) << 32) | be32(p + 4);
+	}
+	static void require(bool condition)
+	{
+		if (!condition)
+			throw std::runtime_error("Invalid MP4.");
+	}
+
+	//! \brief Iterate boxes in [data, data + size)
+	template<typename F>
+	static void each_box(const unsigned char* data, uint64_t size, F func)
+	{
+		uint64_t offset = 0;
+		while (offset + 8 <= size)
+		{
+			auto p = data + offset;
+			uint64_t boxSize = be32(p);
+			uint64_t header = 8;
+			if (boxSize == 1)
+			{
+				require(offset + 16 <= size);
+				boxSize = be64(p + 8);
+				header = 16;
+			}
+			else if (boxSize == 0)
+			{
+				boxSize = size - offset;
+			}
+			require(boxSize >= header && boxSize <= size - offset);
+			box b = { p + header, boxSize - header, be32(p + 4) };
+			if (!func(b))
+				return;
+			offset += boxSize;
+		}
+	}
+	static bool find_box(const unsigned char* data, uint64_t size, const char* type, box& found)
+	{
+		auto t = fourcc(type);
+		bool ok = false;
+		each_box(data, size, [&](const box& b)
+		{
+			if (b.type != t)
+				return true;
+			found = b;
+			ok = true;
+			return false;
+		});
+		return ok;
+	}
+	static box child(const box& parent, const char* type)
+	{
+		box b;
+		require(find_box(parent.data, parent.size, type, b));
+		return b;
+	}
+	//! \brief Entry count of a full box table, checking that entrySize * count fits
+	static uint32_t table(const box& b, uint64_t header, uint64_t entrySize)
+	{
+		require(b.size >= header);
+		auto count = be32(b.data + header - 4);
+		require(entrySize * count <= b.size - header);
+		return count;
+	}
+
+	void parse_track(const box& trak)
+	{
+		auto mdia = child(trak, "mdia");
+		auto mdhd = child(mdia, "mdhd");
+		require(mdhd.size >= 24);
+		if (mdhd.data[0] == 1)
+		{
+			require(mdhd.size >= 36);
+			mTimescale = be32(mdhd.data + 20);
+			mDuration = be64(mdhd.data + 24);
+		}
+		else
+		{
+			mTimescale = be32(mdhd.data + 12);
+			mDuration = be32(mdhd.data + 16);
+		}
+		require(mTimescale != 0);
+		auto stbl = child(child(mdia, "minf"), "stbl");
+
+		// stsd: avc1/avc3 sample entry -> avcC
+		auto stsd = child(stbl, "stsd");
+		require(stsd.size >= 8 + 8 + 78);
+		auto entry = stsd.data + 8;
+		auto entrySize = be32(entry);
+		require(entrySize >= 8 + 78 && entrySize <= stsd.size - 8);
+		mWidth = (entry[8 + 24] << 8) | entry[8 + 25];
+		mHeight = (entry[8 + 26] << 8) | entry[8 + 27];
+		box avcC;
+		if (find_box(entry + 8 + 78, entrySize - 8 - 78, "avcC", avcC) && avcC.size >= 7)
+		{
+			mAvcConfig = avcC.data;
+			mAvcConfigSize = static_cast<uint32_t>(avcC.size);
+			mNalLengthSize = (avcC.data[4] & 3) + 1;
+		}
+
+		// stsz; count comes from the file, so it must match stts and fit the file before anything is sized by it
+		auto stsz = child(stbl, "stsz");
+		require(stsz.size >= 12);
+		auto fixedSize = be32(stsz.data + 4);
+		auto count = be32(stsz.data + 8);
+		auto stts = child(stbl, "stts");
+		auto runs = table(stts, 8, 8);
+		uint64_t total = 0;
+		for (auto i = 0u; i < runs; ++i)
+			total += be32(stts.data + 8 + 8 * i);
+		require(total == count);
+		if (fixedSize)
+			require(uint64_t(count) * fixedSize <= mFile.size());
+		else
+			require(uint64_t(count) * 4 <= stsz.size - 12);
+		mSizes.resize(count);
+		if (fixedSize)
+		{
+			std::fill(mSizes.begin(), mSizes.end(), fixedSize);
+		}
+		else
+		{
+			for (auto i = 0u; i < count; ++i)
+				mSizes[i] = be32(stsz.data + 12 + 4 * i);
+		}
+
+		// stts
+		mTimes.resize(count);
+		uint64_t time = 0;
+		uint32_t sample = 0;
+		for (auto i = 0u; i < runs; ++i)
+		{
+			auto n = be32(stts.data + 8 + 8 * i);
+			auto delta = be32(stts.data + 12 + 8 * i);
+			for (auto j = 0u; j < n; ++j, ++sample)
+			{
+				mTimes[sample] = time;
+				time += delta;
+			}
+		}
+
+		// ctts (optional)
+		box ctts;
+		if (find_box(stbl.data, stbl.size, "ctts", ctts))
+		{
+			runs = table(ctts, 8, 8);
+			mCompositionOffsets.resize(count);
+			sample = 0;
+			for (auto i = 0u; i < runs && sample < count; ++i)
+			{
+				auto n = be32(ctts.data + 8 + 8 * i);
+				auto offset = static_cast<int32_t>(be32(ctts.data + 12 + 8 * i));
+				for (auto j = 0u; j < n && sample < count; ++j, ++sample)
+					mCompositionOffsets[sample] = offset;
+			}
+		}
+
+		// stco / co64
+		std::vector<uint64_t> chunks;
+		box stco;
+		if (find_box(stbl.data, stbl.size, "stco", stco))
+		{
+			auto n = table(stco, 8, 4);
+			chunks.resize(n);
+			for (auto i = 0u; i < n; ++i)
+				chunks[i] = be32(stco.data + 8 + 4 * i);
+		}
+		else
+		{
+			auto co64 = child(stbl, "co64");
+			auto n = table(co64, 8, 8);
+			chunks.resize(n);
+			for (auto i = 0u; i < n; ++i)
+				chunks[i] = be64(co64.data + 8 + 8 * i);
+		}
+
+		// stsc: runs of chunks with the same samples per chunk
+		auto stsc = child(stbl, "stsc");
+		runs = table(stsc, 8, 12);
+		mOffsets.resize(count);
+		sample = 0;
+		for (auto i = 0u; i < runs; ++i)
+		{
+			auto first = be32(stsc.data + 8 + 12 * i);
+			auto perChunk = be32(stsc.data + 12 + 12 * i);
+			auto last = i + 1 < runs ? be32(stsc.data + 8 + 12 * (i + 1)) : static_cast<uint32_t>(chunks.size()) + 1;
+			require(first >= 1 && first <= last && last - 1 <= chunks.size());
+			for (auto c = first; c < last; ++c)
+			{
+				auto offset = chunks[c - 1];
+				for (auto j = 0u; j < perChunk && sample < count; ++j, ++sample)
+				{
+					mOffsets[sample] = offset;
+					offset += mSizes[sample];
+				}
+			}
+		}
+		require(sample == count);
+		for (auto i = 0u; i < count; ++i)
+			require(mOffsets[i] + mSizes[i] <= mFile.size());
+
+		// stss (optional; absent means every sample is a sync sample)
+		mKeyframeFlags.assign(count, 0);
+		box stss;
+		if (find_box(stbl.data, stbl.size, "stss", stss))
+		{
+			auto n = table(stss, 8, 4);
+			mKeyframes.reserve(n);
+			for (auto i = 0u; i < n; ++i)
+			{
+				auto s = be32(stss.data + 8 + 4 * i);
+				require(s >= 1 && s <= count);
+				mKeyframes.push_back(s - 1);
+				mKeyframeFlags[s - 1] = 1;
+			}
+			std::sort(mKeyframes.begin(), mKeyframes.end());
+		}
+		else
+		{
+			mKeyframes.resize(count);
+			for (auto i = 0u; i < count; ++i)
+			{
+				mKeyframes[i] = i;
+				mKeyframeFlags[i] = 1;
+			}
+		}
+	}
+public:
+	//! \param access  Readahead hint; file_access::random when only a few samples around a seek are read
+	explicit mp4_reader(const char* path, file_access access = file_access::sequential)
+		: mFile(path, access)
+	{
+		box moov;
+		require(find_box(mFile.data(), mFile.size(), "moov", moov));
+		bool found = false;
+		each_box(moov.data, moov.size, [&](const box& b)
+		{
+			if (b.type != fourcc("trak"))
+				return true;
+			box mdia, hdlr;
+			if (!find_box(b.data, b.size, "mdia", mdia) || !find_box(mdia.data, mdia.size, "hdlr", hdlr) || hdlr.size < 12)
+				return true;
+			if (be32(hdlr.data + 8) != fourcc("vide"))
+				return true;
+			parse_track(b);
+			found = true;
+			return false;
+		});
+		if (!found)
+			throw std::runtime_error("No video track.");
+	}
+
+	uint32_t sample_count() const	{ return static_cast<uint32_t>(mSizes.size()); }
+	uint32_t timescale() const		{ return mTimescale; }
+	uint64_t duration() const		{ return mDuration; }
+	uint32_t width() const			{ return mWidth; }
+	uint32_t height() const			{ return mHeight; }
+	uint32_t nal_length_size() const	{ return mNalLengthSize; }
+	uint64_t file_size() const		{ return mFile.size(); }
+	//! \brief Payload of avcC (AVCDecoderConfigurationRecord), or nullptr
+	const unsigned char* avc_config(uint32_t& size) const
+	{
+		size = mAvcConfigSize;
+		return mAvcConfig;
+	}
+	const std::vector<uint32_t>& keyframes() const	{ return mKeyframes; }
+
+	uint64_t offset(uint32_t index) const	{ return mOffsets.at(index); }
+	uint32_t size(uint32_t index) const		{ return mSizes.at(index); }
+	uint64_t decode_time(uint32_t index) const	{ return mTimes.at(index); }
+	bool keyframe(uint32_t index) const		{ return mKeyframeFlags.at(index) != 0; }
+
+	mp4_frame frame(uint32_t index) const
+	{
+		mp4_frame f;
+		f.data = mFile.data() + mOffsets.at(index);
+		f.size = mSizes[index];
+		f.decodeTime = mTimes[index];
+		f.presentationTime = mCompositionOffsets.empty() ? f.decodeTime : f.decodeTime + mCompositionOffsets[index];
+		f.keyframe = mKeyframeFlags[index] != 0;
+		return f;
+	}
+
+	//! \brief Index of the sample being decoded at time (timescale units)
+	uint32_t sample_at(uint64_t time) const
+	{
+		auto it = std::upper_bound(mTimes.begin(), mTimes.end(), time);
+		return it == mTimes.begin() ? 0 : static_cast<uint32_t>(it - mTimes.begin() - 1);
+	}
+	//! \brief Last keyframe at or before a sample; decoding from it reaches the sample
+	uint32_t keyframe_before(uint32_t index) const
+	{
+		auto it = std::upper_bound(mKeyframes.begin(), mKeyframes.end(), index);
+		return it == mKeyframes.begin() ? 0 : *(it - 1);
+	}
+	//! \brief Keyframe to start decoding from for a frame-accurate seek to time
+	uint32_t seek(uint64_t time) const
+	{
+		return keyframe_before(sample_at(time));
+	}
+};
@@ -0,0 +1,378 @@
+// preview_tap.h
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PREVIEW_TAP_SSE2 1
+#endif
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//! \brief Per-slot state; sequence is odd while the slot is being written
+struct preview_slot
+{
+	std::atomic<uint64_t> sequence;
+	uint64_t frame;			// Index of the source frame
+	uint64_t timestamp;		// 100 ns units, as passed to movie_writer::write
+	char padding[40];
+};
+
+//! \brief Layout of the shared-memory ring; the slot images follow at DataOffset
+struct preview_segment
+{
+	static const uint32_t Magic = 0x57565250;	// "PRVW"
+	static const uint32_t Version = 1;
+	static const unsigned int Slots = 3;
+	static const unsigned int DataOffset = 256;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;			// Preview size; BGRA, 4 * width bytes per row
+	uint32_t height;
+	uint32_t frameSize;		// Bytes between slot images
+	uint32_t reserved;
+	std::atomic<uint64_t> published;	// The latest image is in slot (published - 1) % Slots
+	char padding[32];
+	preview_slot slots[Slots];
+
+	unsigned char* image(unsigned int slot)
+	{
+		return reinterpret_cast<unsigned char*>(this) + DataOffset + size_t(slot) * frameSize;
+	}
+	const unsigned char* image(unsigned int slot) const
+	{
+		return reinterpret_cast<const unsigned char*>(this) + DataOffset + size_t(slot) * frameSize;
+	}
+};
+
+static_assert(sizeof(preview_segment) <= preview_segment::DataOffset, "Preview header overlaps the images.");
+
+//! \brief Named shared memory holding a preview_segment and its images
+class preview_mapping
+{
+	preview_segment* mSegment = nullptr;
+	size_t mSize = 0;
+#ifdef _WIN32
+	HANDLE mMapping = nullptr;
+#else
+	std::string mName;
+	bool mOwner = false;
+#endif
+public:
+	//! \param size Bytes to create, or 0 to open an existing segment read-only
+	preview_mapping(const char* name, size_t size)
+	{
+		auto create = size != 0;
+#ifdef _WIN32
+		if (create)
+			mMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), name);
+		else
+			mMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+		if (!mMapping)
+			throw std::runtime_error("Cannot open preview segment.");
+		mSegment = static_cast<preview_segment*>(MapViewOfFile(mMapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size));
+		if (mSegment && !create)
+		{
+			MEMORY_BASIC_INFORMATION info;
+			VirtualQuery(mSegment, &info, sizeof(info));
+			size = info.RegionSize;
+		}
+		mSize = size;
+#else
+		mName = std::string("/") + name;
+		auto fd = shm_open(mName.c_str(), create ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Cannot open preview segment.");
+		struct stat st;
+		if (create ? ftruncate(fd, static_cast<off_t>(size)) != 0 : fstat(fd, &st) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("Cannot size preview segment.");
+		}
+		mSize = create ? size : static_cast<size_t>(st.st_size);
+		auto p = mSize < sizeof(preview_segment) ? MAP_FAILED :
+			mmap(nullptr, mSize, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		mSegment = p == MAP_FAILED ? nullptr : static_cast<preview_segment*>(p);
+		mOwner = create;
+#endif
+		if (!mSegment)
+			throw std::runtime_error("Cannot map preview segment.");
+		if (!create && (mSegment->magic != preview_segment::Magic || mSegment->version != preview_segment::Version ||
+			preview_segment::DataOffset + size_t(preview_segment::Slots) * mSegment->frameSize > mSize))
+			throw std::runtime_error("Preview segment version mismatch.");
+	}
+	~preview_mapping()
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(mSegment);
+		CloseHandle(mMapping);
+#else
+		munmap(mSegment, mSize);
+		if (mOwner)
+			shm_unlink(mName.c_str());
+#endif
+	}
+	preview_mapping(const preview_mapping&) = delete;
+	preview_mapping& operator=(const preview_mapping&) = delete;
+
+	preview_segment* get() const	{ return mSegment; }
+};
+
+//! \brief Capture side: box-downscales frames straight into the next slot of the ring
+//! \details The source frame is the buffer already passed to movie_writer::write, so the
+//!          preview costs no extra readback. Each slot is guarded by a sequence counter
+//!          (a seqlock), so publishing never waits for a viewer.
+class preview_publisher
+{
+	preview_mapping mMapping;
+	unsigned int mSourceWidth;
+	unsigned int mFactor;
+	std::vector<uint16_t> mColumn;	// Vertical sums of one block row
+	uint64_t mPublished = 0;
+
+	static size_t segment_size(unsigned int width, unsigned int height, unsigned int factor)
+	{
+		auto frameSize = (size_t(4) * (width / factor) * (height / factor) + 63) & ~size_t(63);
+		return preview_segment::DataOffset + preview_segment::Slots * frameSize;
+	}
+
+	void downscale(const unsigned char* src, unsigned char* dest, unsigned int width, unsigned int height)
+	{
+		auto pitch = size_t(4) * mSourceWidth;
+		auto count = size_t(4) * width * mFactor;
+		auto area = mFactor * mFactor;
+		for (auto y = 0u; y < height; ++y)
+		{
+			// Sum the block's rows first; factor <= 16 keeps the sums within 16 bits.
+			auto column = mColumn.data();
+			for (auto j = 0u; j < mFactor; ++j)
+			{
+				auto row = src + (size_t(y) * mFactor + j) * pitch;
+				size_t i = 0;
+#ifdef PREVIEW_TAP_SSE2
+				auto zero = _mm_setzero_si128();
+				for (; i + 16 <= count; i += 16)
+				{
+					auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+					auto lo = _mm_unpacklo_epi8(v, zero);
+					auto hi = _mm_unpackhi_epi8(v, zero);
+					auto c0 = reinterpret_cast<__m128i*>(column + i);
+					auto c1 = reinterpret_cast<__m128i*>(column + i + 8);
+					if (j)
+					{
+						lo = _mm_add_epi16(lo, _mm_loadu_si128(c0));
+						hi = _mm_add_epi16(hi, _mm_loadu_si128(c1));
+					}
+					_mm_storeu_si128(c0, lo);
+					_mm_storeu_si128(c1, hi);
+				}
+#endif
+				for (; i < count; ++i)
+					column[i] = static_cast<uint16_t>((j ? column[i] : 0) + row[i]);
+			}
+			auto d = dest + size_t(4) * width * y;
+			auto x = 0u;
+#ifdef PREVIEW_TAP_SSE2
+			if (mFactor > 1)
+			{
+				// Rounded sum / area: a 16-bit reciprocal rounded down gives the quotient or one
+				// less (sums stay below 65536), and the remainder tells which.
+				auto bias = _mm_set1_epi16(static_cast<short>(area / 2));
+				auto scale = _mm_set1_epi16(static_cast<short>(65536 / area));
+				auto divisor = _mm_set1_epi16(static_cast<short>(area));
+				auto limit = _mm_set1_epi16(static_cast<short>(area - 1));
+				for (; x + 2 <= width; x += 2)
+				{
+					auto p = column + size_t(4) * x * mFactor;
+					auto s0 = _mm_setzero_si128();
+					auto s1 = _mm_setzero_si128();
+					for (auto i = 0u; i < mFactor; ++i)
+					{
+						s0 = _mm_add_epi16(s0, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 4 * i)));
+						s1 = _mm_add_epi16(s1, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 4 * (mFactor + i))));
+					}
+					auto n = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), bias);
+					auto q = _mm_mulhi_epu16(n, scale);
+					auto remainder = _mm_sub_epi16(n, _mm_mullo_epi16(q, divisor));
+					q = _mm_sub_epi16(q, _mm_cmpgt_epi16(remainder, limit));
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(d + 4 * x), _mm_packus_epi16(q, q));
+				}
+			}
+#endif
+			for (; x < width; ++x)
+			{
+				unsigned int sum[4] = { 0, 0, 0, 0 };
+				auto p = column + size_t(4) * x * mFactor;
+				for (auto i = 0u; i < mFactor; ++i, p += 4)
+				{
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+					sum[3] += p[3];
+				}
+				for (auto c = 0u; c < 4; ++c)
+					d[4 * x + c] = static_cast<unsigned char>((sum[c] + area / 2) / area);
+			}
+		}
+	}
+public:
+	//! \param width, height Source frame size
+	//! \param factor Preview is 1/factor of the source in each direction (1-16)
+	preview_publisher(const char* name, unsigned int width, unsigned int height, unsigned int factor = 4)
+		: mMapping(name, segment_size(width, height, factor ? factor : 1)), mSourceWidth(width), mFactor(factor)
+	{
+		if (factor == 0 || factor > 16 || width / factor == 0 || height / factor == 0)
+			throw std::runtime_error("Invalid preview scale.");
+		auto segment = mMapping.get();
+		memset(static_cast<void*>(segment), 0, preview_segment::DataOffset);
+		segment->width = width / factor;
+		segment->height = height / factor;
+		segment->frameSize = static_cast<uint32_t>((segment_size(width, height, factor) - preview_segment::DataOffset) / preview_segment::Slots);
+		segment->version = preview_segment::Version;
+		std::atomic_thread_fence(std::memory_order_release);
+		segment->magic = preview_segment::Magic;
+		mColumn.resize(size_t(4) * segment->width * factor);
+	}
+
+	unsigned int width() const	{ return mMapping.get()->width; }
+	unsigned int height() const	{ return mMapping.get()->height; }
+
+	//! \brief Downscale a BGRA frame into the ring and make it the latest
+	void publish(const char* data, uint64_t frame, uint64_t timestamp)
+	{
+		auto segment = mMapping.get();
+		auto index = static_cast<unsigned int>(mPublished % preview_segment::Slots);
+		auto& slot = segment->slots[index];
+		auto sequence = slot.sequence.load(std::memory_order_relaxed);
+		slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		downscale(reinterpret_cast<const unsigned char*>(data), segment->image(index), segment->width, segment->height);
+		slot.frame = frame;
+		slot.timestamp = timestamp;
+		slot.sequence.store(sequence + 2, std::memory_order_release);
+		segment->published.store(++mPublished, std::memory_order_release);
+	}
+};
+
+//! \brief A preview image in the shared ring; valid until preview_reader::valid() says otherwise
+struct preview_view
+{
+	const unsigned char* data;
+	unsigned int width;
+	unsigned int height;
+	uint64_t frame;
+	uint64_t timestamp;
+	uint64_t published;		// Images published up to and including this one
+	unsigned int slot;
+	uint64_t sequence;
+};
+
+//! \brief Viewer side; maps the ring read-only and never writes to it
+//! \details With three slots the capture side has to publish twice more before it reuses
+//!          the slot a viewer is reading, so a viewer that keeps up rarely has to retry.
+class preview_reader
+{
+	preview_mapping mMapping;
+public:
+	explicit preview_reader(const char* name)
+		: mMapping(name, 0)
+	{
+	}
+
+	uint64_t published() const	{ return mMapping.get()->published.load(std::memory_order_acquire); }
+
+	//! \brief Point at the latest image without copying it
+	//! \return false when nothing has been published yet, or the capture side stopped mid-write
+	bool acquire(preview_view& view) const
+	{
+		auto segment = mMapping.get();
+		for (auto attempt = 0; attempt < 64; ++attempt)
+		{
+			auto published = segment->published.load(std::memory_order_acquire);
+			if (published == 0)
+				return false;
+			auto index = static_cast<unsigned int>((published - 1) % preview_segment::Slots);
+			auto& slot = segment->slots[index];
+			auto sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence & 1)
+				continue;	// Lapped while looking; the next load sees a newer image
+			view.data = segment->image(index);
+			view.width = segment->width;
+			view.height = segment->height;
+			view.frame = slot.frame;
+			view.timestamp = slot.timestamp;
+			view.published = published;
+			view.slot = index;
+			view.sequence = sequence;
+			if (valid(view))
+				return true;
+		}
+		return false;
+	}
+
+	//! \brief true when the image of an acquired view has not been overwritten since acquire()
+	//! \note Check after using the pixels; a false result means they may be torn.
+	bool valid(const preview_view& view) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return mMapping.get()->slots[view.slot].sequence.load(std::memory_order_relaxed) == view.sequence;
+	}
+
+	//! \brief Copy the latest image, retrying while the capture side overwrites it mid-copy
+	//! \return false when nothing is published, or no copy was consistent within attempts tries
+	bool read(std::vector<unsigned char>& dest, preview_view& view, unsigned int attempts = 16) const
+	{
+		for (auto attempt = 0u; attempt < attempts; ++attempt)
+		{
+			if (!acquire(view))
+				return false;
+			dest.resize(size_t(4) * view.width * view.height);
+			memcpy(dest.data(), view.data, dest.size());
+			if (valid(view))
+			{
+				view.data = dest.data();
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+//! \brief Stage that publishes every interval-th frame to a preview_publisher before passing it on
+template<typename Sink>
+class preview_tap_stage
+{
+	Sink& mSink;
+	preview_publisher& mPublisher;
+	unsigned int mInterval;
+	uint64_t mFrame = 0;
+	uint64_t mTime = 0;
+public:
+	preview_tap_stage(Sink& sink, preview_publisher& publisher, unsigned int interval)
+		: mSink(sink), mPublisher(publisher), mInterval(interval ? interval : 1)
+	{
+	}
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		if (mFrame % mInterval == 0)
+			mPublisher.publish(data, mFrame, mTime);
+		mSink.write(data, duration);
+		++mFrame;
+		mTime += duration;
+	}
+};
@@ -0,0 +1,323 @@
+// quality_metric.h
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define QUALITY_METRIC_SSE2 1
+#endif
+#include "worker_pool.h"
+
+//! \brief Quality of one frame against its reference
+struct quality_result
+{
+	double psnr;	//!< dB over B, G and R. 100 means identical.
+	double ssim;	//!< Mean SSIM of 8x8 luma windows (step 4)
+};
+
+//! \brief Per-frame PSNR/SSIM meter for BGRA (MFVideoFormat_RGB32) frames
+class quality_meter
+{
+	unsigned int mWidth;
+	unsigned int mHeight;
+	worker_pool& mPool;
+	std::vector<unsigned char> mLumaA;
+	std::vector<unsigned char> mLumaB;
+	std::vector<uint64_t> mRowError;
+	std::vector<double> mRowSsim;
+	std::vector<quality_result> mResults;
+	FILE* mLog = nullptr;
+
+	static unsigned char luma(const unsigned char* p)
+	{
+		return static_cast<unsigned char>((29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8);
+	}
+
+	//! \brief Squared error of B, G, R and luma of both rows in one read
+	static uint64_t scan_row(const unsigned char* a, const unsigned char* b,
+							unsigned char* lumaA, unsigned char* lumaB, unsigned int width)
+	{
+		uint64_t error = 0;
+		auto x = 0u;
+#ifdef QUALITY_METRIC_SSE2
+		const auto zero = _mm_setzero_si128();
+		const auto mask = _mm_set1_epi32(0x00ffffff);
+		const auto coef = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+		const auto round = _mm_set1_epi32(128);
+		auto toLuma = [&](__m128i px) -> __m128i
+		{
+			auto lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coef);
+			auto hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coef);
+			// [bg0, ra0, bg1, ra1] -> [y0, -, y1, -]
+			lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+			hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+			auto y = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+			return _mm_srli_epi32(_mm_add_epi32(y, round), 8);
+		};
+		auto acc = _mm_setzero_si128();
+		for (; x + 4 <= width; x += 4)
+		{
+			auto pa = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + 4 * x)), mask);
+			auto pb = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + 4 * x)), mask);
+			auto dlo = _mm_sub_epi16(_mm_unpacklo_epi8(pa, zero), _mm_unpacklo_epi8(pb, zero));
+			auto dhi = _mm_sub_epi16(_mm_unpackhi_epi8(pa, zero), _mm_unpackhi_epi8(pb, zero));
+			acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(dlo, dlo), _mm_madd_epi16(dhi, dhi)));
+			auto ya = toLuma(pa);
+			auto yb = toLuma(pb);
+			ya = _mm_packs_epi32(ya, ya);
+			yb = _mm_packs_epi32(yb, yb);
+			auto la = _mm_cvtsi128_si32(_mm_packus_epi16(ya, ya));
+			auto lb = _mm_cvtsi128_si32(_mm_packus_epi16(yb, yb));
+			memcpy(lumaA + x, &la, 4);
+			memcpy(lumaB + x, &lb, 4);
+			// Each lane gets at most 4 * 65025 per step, so flush well before int32 overflow.
+			if ((x & 0x3ff) == 0x3fc)
+			{
+				uint32_t lanes[4];
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+				error += uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+				acc = _mm_setzero_si128();
+			}
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+		error += uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#endif
+		for (; x < width; ++x)
+		{
+			for (auto c = 0; c < 3; ++c)
+			{
+				int d = a[4 * x + c] - b[4 * x + c];
+				error += d * d;
+			}
+			lumaA[x] = luma(a + 4 * x);
+			lumaB[x] = luma(b + 4 * x);
+		}
+		return error;
+	}
+
+	//! \brief Sums of every 4x4 luma block in block row j: { sum a, sum b, sum a^2 + b^2, sum ab } per block
+	void block_row(unsigned int j, uint32_t* sums) const
+	{
+		auto blocks = mWidth / 4;
+		auto stride = size_t(mWidth);
+		auto a = &mLumaA[4 * j * stride];
+		auto b = &mLumaB[4 * j * stride];
+		auto i = 0u;
+#ifdef QUALITY_METRIC_SSE2
+		// Two blocks per step; madd leaves pair sums in 32-bit lanes, two lanes per block.
+		const auto zero = _mm_setzero_si128();
+		const auto one = _mm_set1_epi16(1);
+		for (; i + 2 <= blocks; i += 2)
+		{
+			auto s1 = _mm_setzero_si128();
+			auto s2 = _mm_setzero_si128();
+			auto ss = _mm_setzero_si128();
+			auto s12 = _mm_setzero_si128();
+			for (auto y = 0u; y < 4; ++y)
+			{
+				auto va = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + y * stride + 4 * i)), zero);
+				auto vb = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + y * stride + 4 * i)), zero);
+				s1 = _mm_add_epi32(s1, _mm_madd_epi16(va, one));
+				s2 = _mm_add_epi32(s2, _mm_madd_epi16(vb, one));
+				ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb)));
+				s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+			}
+			// [p0, p1, p2, p3] -> [block 0, -, block 1, -]
+			s1 = _mm_add_epi32(s1, _mm_srli_epi64(s1, 32));
+			s2 = _mm_add_epi32(s2, _mm_srli_epi64(s2, 32));
+			ss = _mm_add_epi32(ss, _mm_srli_epi64(ss, 32));
+			s12 = _mm_add_epi32(s12, _mm_srli_epi64(s12, 32));
+			// Transpose to { s1, s2, ss, s12 } of block 0, then of block 1
+			auto lo = _mm_unpacklo_epi32(s1, s2);	// s1_0, s2_0, -, -
+			auto hi = _mm_unpacklo_epi32(ss, s12);	// ss_0, s12_0, -, -
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(sums + 4 * i), _mm_unpacklo_epi64(lo, hi));
+			lo = _mm_unpackhi_epi32(s1, s2);		// s1_1, s2_1, -, -
+			hi = _mm_unpackhi_epi32(ss, s12);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(sums + 4 * i + 4), _mm_unpacklo_epi64(lo, hi));
+		}
+#endif
+		for (; i < blocks; ++i)
+		{
+			uint32_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+			for (auto y = 0u; y < 4; ++y)
+			{
+				for (auto x = 0u; x < 4; ++x)
+				{
+					uint32_t va = a[y * stride + 4 * i + x];
+					uint32_t vb = b[y * stride + 4 * i + x];
+					s1 += va;
+					s2 += vb;
+					ss += va * va + vb * vb;
+					s12 += va * vb;
+				}
+			}
+			sums[4 * i] = s1;
+			sums[4 * i + 1] = s2;
+			sums[4 * i + 2] = ss;
+			sums[4 * i + 3] = s12;
+		}
+	}
+
+	static double window_ssim(const uint32_t* s)
+	{
+		const double n = 64.0;
+		const double c1 = (0.01 * 255) * (0.01 * 255);
+		const double c2 = (0.03 * 255) * (0.03 * 255);
+		double ma = s[0] / n, mb = s[1] / n;
+		double var = s[2] / n - ma * ma - mb * mb;
+		double cov = s[3] / n - ma * mb;
+		return ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (var + c2));
+	}
+
+	//! \brief SSIM sum over a window row from the block sums of its top and bottom block rows
+	double ssim_row(const uint32_t* top, const uint32_t* bottom) const
+	{
+		auto blocks = mWidth / 4;
+		double sum = 0.0;
+		for (auto i = 0u; i + 1 < blocks; ++i)
+		{
+			uint32_t s[4];
+			for (auto k = 0; k < 4; ++k)
+				s[k] = top[4 * i + k] + top[4 * i + 4 + k] + bottom[4 * i + k] + bottom[4 * i + 4 + k];
+			sum += window_ssim(s);
+		}
+		return sum;
+	}
+public:
+	//! \param logPath Per-frame CSV output. nullptr disables logging.
+	quality_meter(unsigned int width, unsigned int height, worker_pool& pool, const char* logPath = nullptr)
+		: mWidth(width), mHeight(height), mPool(pool),
+		mLumaA(width * height), mLumaB(width * height), mRowError(height)
+	{
+		if (width < 8 || height < 8)
+			throw std::runtime_error("Frame is too small.");
+		mRowSsim.resize(height / 4 - 1);
+		if (logPath)
+		{
+#ifdef _MSC_VER
+			if (fopen_s(&mLog, logPath, "w") != 0)
+				mLog = nullptr;
+#else
+			mLog = fopen(logPath, "w");
+#endif
+			if (!mLog)
+				throw std::runtime_error("Cannot open quality log.");
+			fprintf(mLog, "frame,psnr,ssim\n");
+		}
+	}
+	~quality_meter()
+	{
+		if (mLog)
+			fclose(mLog);
+	}
+	quality_meter(const quality_meter&) = delete;
+	quality_meter& operator=(const quality_meter&) = delete;
+
+	//! \brief Compare a frame with its reference. Both are 4 * width * height bytes.
+	quality_result measure(const char* source, const char* reference)
+	{
+		auto a = reinterpret_cast<const unsigned char*>(source);
+		auto b = reinterpret_cast<const unsigned char*>(reference);
+		mPool.run(mHeight, 16, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto y = begin; y < end; ++y)
+			{
+				auto offset = size_t(y) * mWidth;
+				mRowError[y] = scan_row(a + 4 * offset, b + 4 * offset, &mLumaA[offset], &mLumaB[offset], mWidth);
+			}
+		});
+		auto windowRows = static_cast<unsigned int>(mRowSsim.size());
+		mPool.run(windowRows, 4, [&](unsigned int begin, unsigned int end)
+		{
+			// Window row j spans block rows j and j + 1, so each block row is summed once
+			// and reused as the top of the next window row.
+			std::vector<uint32_t> top(mWidth), bottom(mWidth);
+			block_row(begin, top.data());
+			for (auto j = begin; j < end; ++j)
+			{
+				block_row(j + 1, bottom.data());
+				mRowSsim[j] = ssim_row(top.data(), bottom.data());
+				top.swap(bottom);
+			}
+		});
+
+		uint64_t error = 0;
+		for (auto e : mRowError)
+			error += e;
+		double ssim = 0.0;
+		for (auto s : mRowSsim)
+			ssim += s;
+
+		quality_result r;
+		auto mse = double(error) / (3.0 * mWidth * mHeight);
+		r.psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 100.0;
+		if (r.psnr > 100.0)
+			r.psnr = 100.0;
+		r.ssim = ssim / (double(mWidth / 4 - 1) * windowRows);
+		if (mLog)
+			fprintf(mLog, "%u,%.4f,%.6f\n", static_cast<unsigned int>(mResults.size()), r.psnr, r.ssim);
+		mResults.push_back(r);
+		return r;
+	}
+
+	const std::vector<quality_result>& results() const	{ return mResults; }
+
+	//! \brief Write average/minimum of all measured frames
+	void summary(FILE* out) const
+	{
+		if (mResults.empty())
+			return;
+		double psnr = 0.0, ssim = 0.0, minPsnr = 1e9, minSsim = 1e9;
+		for (auto& r : mResults)
+		{
+			psnr += r.psnr;
+			ssim += r.ssim;
+			minPsnr = r.psnr < minPsnr ? r.psnr : minPsnr;
+			minSsim = r.ssim < minSsim ? r.ssim : minSsim;
+		}
+		auto n = double(mResults.size());
+		fprintf(out, "frames %u, psnr avg %.4f min %.4f, ssim avg %.6f min %.6f\n",
+			static_cast<unsigned int>(mResults.size()), psnr / n, minPsnr, ssim / n, minSsim);
+	}
+	void finalize()
+	{
+		if (mLog)
+		{
+			summary(mLog);
+			fclose(mLog);
+			mLog = nullptr;
+		}
+	}
+};
+
+//! \brief Pipeline stage that measures each frame, then passes it to the next write()
+//! \note The reference callback returns nullptr when no reference is available for the frame.
+template<typename Sink>
+class quality_stage
+{
+	Sink& mSink;
+	quality_meter& mMeter;
+	std::function<const char*(uint64_t)> mReference;
+	uint64_t mFrame = 0;
+public:
+	quality_stage(Sink& sink, quality_meter& meter, std::function<const char*(uint64_t)> reference)
+		: mSink(sink), mMeter(meter), mReference(reference)
+	{
+	}
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		auto ref = mReference(mFrame++);
+		if (ref)
+			mMeter.measure(data, ref);
+		mSink.write(data, duration);
+	}
+};
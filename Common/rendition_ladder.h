@@ -0,0 +1,260 @@
+// rendition_ladder.h
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define RENDITION_LADDER_SSE2 1
+#endif
+#include "fused_convert.h"
+#include "worker_pool.h"
+
+//! \brief One output of a rendition_ladder
+struct rendition
+{
+	unsigned int width;		//!< Must be even
+	unsigned int height;	//!< Must be even
+	std::function<void(const char*, uint64_t)> sink;	//!< Receives NV12 frames, e.g. movie_writer::write
+};
+
+//! \brief Feeds several outputs of decreasing resolution from one BGRA capture
+//! \details Each frame is downscaled into a BGRA pyramid where every level is made from
+//!          the level above it, so the full-resolution frame is read once. Each level is
+//!          converted to NV12 once, and the outputs are written in parallel.
+//!          The outputs run on the ladder's own threads, so a sink may use the pool given
+//!          to the constructor (e.g. for its own conversion) without re-entering it.
+class rendition_ladder
+{
+	struct tap
+	{
+		unsigned int x0;	// Channel offsets into the source row
+		unsigned int x1;
+		unsigned int fx;	// 7-bit weight of x1
+	};
+	struct level
+	{
+		unsigned int width;
+		unsigned int height;
+		std::vector<char> bgra;		// Empty when the converter reads the level above directly
+		std::vector<char> nv12;
+		std::vector<tap> taps;		// Horizontal taps from the level above
+		std::unique_ptr<fused_converter> converter;
+		std::function<void(const char*, uint64_t)> sink;
+
+		// VS2013 generates no implicit move, and the unique_ptr member makes copying ill-formed.
+		level() {}
+		level(level&& other)
+			: width(other.width), height(other.height), bgra(std::move(other.bgra)), nv12(std::move(other.nv12)),
+			taps(std::move(other.taps)), converter(std::move(other.converter)), sink(std::move(other.sink))
+		{
+		}
+		level& operator=(level&& other)
+		{
+			width = other.width;
+			height = other.height;
+			bgra = std::move(other.bgra);
+			nv12 = std::move(other.nv12);
+			taps = std::move(other.taps);
+			converter = std::move(other.converter);
+			sink = std::move(other.sink);
+			return *this;
+		}
+	};
+
+	unsigned int mWidth;
+	unsigned int mHeight;
+	worker_pool& mPool;
+	std::unique_ptr<worker_pool> mFanout;	// One thread per output besides the caller
+	std::vector<level> mLevels;
+
+	//! \brief 2:1 box filter of two source rows into one row
+	static void halve_row(const unsigned char* r0, const unsigned char* r1, unsigned char* dest, unsigned int width)
+	{
+		auto x = 0u;
+#ifdef RENDITION_LADDER_SSE2
+		for (; x + 4 <= width; x += 4)
+		{
+			auto a = _mm_avg_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + 8 * x)),
+								_mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + 8 * x)));
+			auto b = _mm_avg_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + 8 * x + 16)),
+								_mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + 8 * x + 16)));
+			// Even pixels of a and b, then odd pixels, averaged
+			auto even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+			auto odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4 * x), _mm_avg_epu8(even, odd));
+		}
+#endif
+		for (; x < width; ++x)
+		{
+			for (auto c = 0u; c < 4; ++c)
+				dest[4 * x + c] = static_cast<unsigned char>((r0[8 * x + c] + r0[8 * x + 4 + c] + r1[8 * x + c] + r1[8 * x + 4 + c] + 2) >> 2);
+		}
+	}
+
+	//! \brief Downscale BGRA src into level l; exact halves use a box filter, other ratios bilinear
+	void downscale(const unsigned char* src, unsigned int sw, unsigned int sh, level& l)
+	{
+		auto dest = reinterpret_cast<unsigned char*>(l.bgra.data());
+		auto dw = l.width;
+		auto dh = l.height;
+		if (sw == 2 * dw && sh == 2 * dh)
+		{
+			mPool.run(dh, 16, [&](unsigned int begin, unsigned int end)
+			{
+				for (auto y = begin; y < end; ++y)
+					halve_row(src + size_t(8) * sw * y, src + size_t(4) * sw * (2 * y + 1), dest + size_t(4) * dw * y, dw);
+			});
+			return;
+		}
+		auto& taps = l.taps;
+		mPool.run(dh, 16, [&](unsigned int begin, unsigned int end)
+		{
+			// Vertical blend of one source row, 7-bit weights so the sums fit in int16
+			std::vector<short> row(size_t(4) * sw + 8);
+			for (auto y = begin; y < end; ++y)
+			{
+				// Same pixel-center mapping as fused_converter
+				long long py = ((2ll * y + 1) * sh * 256) / (2ll * dh) - 128;
+				py = py < 0 ? 0 : py;
+				auto y0 = static_cast<unsigned int>(py >> 8);
+				auto y1 = y0 + 1 < sh ? y0 + 1 : sh - 1;
+				int fy = y0 + 1 < sh ? (py & 0xff) >> 1 : 0;
+				auto r0 = src + size_t(4) * sw * y0;
+				auto r1 = src + size_t(4) * sw * y1;
+				size_t i = 0;
+#ifdef RENDITION_LADDER_SSE2
+				auto zero = _mm_setzero_si128();
+				auto w0 = _mm_set1_epi16(static_cast<short>(128 - fy));
+				auto w1 = _mm_set1_epi16(static_cast<short>(fy));
+				for (; i + 8 <= size_t(4) * sw; i += 8)
+				{
+					auto a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(r0 + i)), zero);
+					auto b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(r1 + i)), zero);
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(&row[i]),
+						_mm_add_epi16(_mm_mullo_epi16(a, w0), _mm_mullo_epi16(b, w1)));
+				}
+#endif
+				for (; i < size_t(4) * sw; ++i)
+					row[i] = static_cast<short>(r0[i] * (128 - fy) + r1[i] * fy);
+				auto d = dest + size_t(4) * dw * y;
+				auto x = 0u;
+#ifdef RENDITION_LADDER_SSE2
+				auto round = _mm_set1_epi32(1 << 13);
+				for (; x + 2 <= dw; x += 2)
+				{
+					// Interleave the two taps of each channel and weight them with one madd
+					auto& t0 = taps[x];
+					auto& t1 = taps[x + 1];
+					auto p0 = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&row[t0.x0])),
+												_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&row[t0.x1])));
+					auto p1 = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&row[t1.x0])),
+												_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&row[t1.x1])));
+					auto s0 = _mm_madd_epi16(p0, _mm_set1_epi32(static_cast<int>((t0.fx << 16) | (128 - t0.fx))));
+					auto s1 = _mm_madd_epi16(p1, _mm_set1_epi32(static_cast<int>((t1.fx << 16) | (128 - t1.fx))));
+					s0 = _mm_srai_epi32(_mm_add_epi32(s0, round), 14);
+					s1 = _mm_srai_epi32(_mm_add_epi32(s1, round), 14);
+					auto packed = _mm_packus_epi16(_mm_packs_epi32(s0, s1), zero);
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(d + 4 * x), packed);
+				}
+#endif
+				for (; x < dw; ++x)
+				{
+					auto a = &row[taps[x].x0];
+					auto b = &row[taps[x].x1];
+					int fx = taps[x].fx;
+					for (auto c = 0u; c < 4; ++c)
+						d[4 * x + c] = static_cast<unsigned char>((a[c] * (128 - fx) + b[c] * fx + (1 << 13)) >> 14);
+				}
+			}
+		});
+	}
+public:
+	//! \param renditions Outputs; sorted internally from largest to smallest
+	rendition_ladder(unsigned int width, unsigned int height, std::vector<rendition> renditions, worker_pool& pool)
+		: mWidth(width), mHeight(height), mPool(pool)
+	{
+		std::sort(renditions.begin(), renditions.end(), [](const rendition& a, const rendition& b)
+		{
+			return uint64_t(a.width) * a.height > uint64_t(b.width) * b.height;
+		});
+		unsigned int aboveWidth = width, aboveHeight = height;
+		for (size_t i = 0; i < renditions.size(); ++i)
+		{
+			auto& r = renditions[i];
+			if (r.width > aboveWidth || r.height > aboveHeight)
+				throw std::runtime_error("Rendition is larger than the level above it.");
+			level l;
+			l.width = r.width;
+			l.height = r.height;
+			// The smallest level feeds nothing, so the converter scales it straight from the level above.
+			auto scaled = i + 1 < renditions.size() && (r.width != aboveWidth || r.height != aboveHeight);
+			if (scaled)
+			{
+				l.bgra.resize(size_t(4) * r.width * r.height);
+				for (auto x = 0u; x < r.width; ++x)
+				{
+					long long px = ((2ll * x + 1) * aboveWidth * 256) / (2ll * r.width) - 128;
+					px = px < 0 ? 0 : px;
+					auto x0 = static_cast<unsigned int>(px >> 8);
+					auto x1 = x0 + 1 < aboveWidth ? x0 + 1 : aboveWidth - 1;
+					unsigned int fx = x0 + 1 < aboveWidth ? (px & 0xff) >> 1 : 0;
+					l.taps.push_back({ 4 * x0, 4 * x1, fx });
+				}
+			}
+			fused_convert_desc desc = {};
+			desc.srcWidth = scaled ? r.width : aboveWidth;
+			desc.srcHeight = scaled ? r.height : aboveHeight;
+			desc.dstWidth = r.width;
+			desc.dstHeight = r.height;
+			desc.layout = yuv_layout::nv12;
+			l.converter.reset(new fused_converter(desc, pool));
+			l.nv12.resize(l.converter->frame_size());
+			l.sink = r.sink;
+			mLevels.push_back(std::move(l));
+			aboveWidth = r.width;
+			aboveHeight = r.height;
+		}
+		if (mLevels.size() > 1)
+			mFanout.reset(new worker_pool(static_cast<unsigned int>(mLevels.size()) - 1));
+	}
+
+	//! \brief Build the pyramid, convert each level and write all outputs
+	void write(const char* data, uint64_t duration)
+	{
+		auto above = reinterpret_cast<const unsigned char*>(data);
+		unsigned int aboveWidth = mWidth, aboveHeight = mHeight;
+		for (auto& l : mLevels)
+		{
+			if (l.bgra.empty())
+			{
+				l.converter->convert(reinterpret_cast<const char*>(above), l.nv12.data());
+			}
+			else
+			{
+				downscale(above, aboveWidth, aboveHeight, l);
+				l.converter->convert(l.bgra.data(), l.nv12.data());
+				above = reinterpret_cast<const unsigned char*>(l.bgra.data());
+			}
+			aboveWidth = l.width;
+			aboveHeight = l.height;
+		}
+		// Encoders are independent, so each output gets its own thread.
+		if (!mFanout)
+		{
+			for (auto& l : mLevels)
+				l.sink(l.nv12.data(), duration);
+			return;
+		}
+		mFanout->run(static_cast<unsigned int>(mLevels.size()), 1, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto i = begin; i < end; ++i)
+				mLevels[i].sink(mLevels[i].nv12.data(), duration);
+		});
+	}
+};
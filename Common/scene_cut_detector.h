@@ -0,0 +1,239 @@
+// scene_cut_detector.h
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SCENE_CUT_DETECTOR_SSE2 1
+#endif
+#include "luma_plane.h"
+#include "worker_pool.h"
+
+//! \brief Measurements of one frame against the previous one
+struct scene_cut_result
+{
+	double histogram;	//!< Luma histogram difference (0-1)
+	double sad;			//!< Mean absolute luma difference (0-255)
+	bool cut;
+};
+
+//! \brief Detects hard cuts on a 1/4 downsampled luma plane
+//! \details A cut needs both a large histogram change and a SAD well above the recent
+//!          average, so fast motion within a scene (high SAD, similar histogram) and
+//!          fades (similar frame to frame) do not fire.
+class scene_cut_detector
+{
+	static const unsigned int Bins = 64;
+
+	std::unique_ptr<luma_plane> mOwn;	// Null when the plane is shared
+	const luma_plane* mLuma;
+	unsigned int mSmallWidth;
+	unsigned int mSmallHeight;
+	worker_pool& mPool;
+	double mHistogramThreshold;
+	double mSadRatio;
+	unsigned int mMinDistance;
+	std::vector<unsigned char> mPrevious;
+	std::vector<uint32_t> mRowHistogram;
+	std::vector<uint32_t> mPreviousHistogram;
+	std::vector<uint64_t> mRowSad;
+	bool mHasPrevious = false;
+	double mAverageSad = 0.0;
+	unsigned int mSinceCut = 0;
+
+	//! \brief Histogram of one small row and its SAD to the previous frame, which it then replaces
+	void measure_row(unsigned int y)
+	{
+		auto cur = mLuma->row(y);
+		auto prev = &mPrevious[size_t(y) * mSmallWidth];
+		auto histogram = &mRowHistogram[size_t(y) * Bins];
+		for (auto b = 0u; b < Bins; ++b)
+			histogram[b] = 0;
+		for (auto x = 0u; x < mSmallWidth; ++x)
+			++histogram[cur[x] >> 2];
+		uint64_t sad = 0;
+		auto x = 0u;
+#ifdef SCENE_CUT_DETECTOR_SSE2
+		for (; x + 16 <= mSmallWidth; x += 16)
+		{
+			auto s = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + x)),
+								_mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + x)));
+			sad += static_cast<unsigned int>(_mm_cvtsi128_si32(s)) + static_cast<unsigned int>(_mm_extract_epi16(s, 4));
+		}
+#endif
+		for (; x < mSmallWidth; ++x)
+			sad += cur[x] > prev[x] ? cur[x] - prev[x] : prev[x] - cur[x];
+		mRowSad[y] = sad;
+		memcpy(prev, cur, mSmallWidth);
+	}
+	void init()
+	{
+		mSmallWidth = mLuma->width();
+		mSmallHeight = mLuma->height();
+		mPrevious.resize(size_t(mSmallWidth) * mSmallHeight);
+		mRowHistogram.resize(size_t(mSmallHeight) * Bins);
+		mPreviousHistogram.resize(Bins);
+		mRowSad.resize(mSmallHeight);
+	}
+public:
+	//! \brief Detector that downsamples each frame itself
+	//! \param histogramThreshold Histogram difference (0-1) a cut must exceed
+	//! \param sadRatio How many times the recent average SAD a cut must exceed
+	//! \param minDistance Frames after a cut during which no other cut is reported
+	scene_cut_detector(unsigned int width, unsigned int height, worker_pool& pool,
+						double histogramThreshold = 0.2, double sadRatio = 3.0, unsigned int minDistance = 10)
+		: mOwn(new luma_plane(width, height, pool)), mLuma(mOwn.get()), mPool(pool),
+		mHistogramThreshold(histogramThreshold), mSadRatio(sadRatio), mMinDistance(minDistance)
+	{
+		init();
+	}
+	//! \brief Detector on a plane that is built for each frame before detect(), e.g. by luma_plane_stage
+	scene_cut_detector(const luma_plane& luma, worker_pool& pool,
+						double histogramThreshold = 0.2, double sadRatio = 3.0, unsigned int minDistance = 10)
+		: mLuma(&luma), mPool(pool),
+		mHistogramThreshold(histogramThreshold), mSadRatio(sadRatio), mMinDistance(minDistance)
+	{
+		init();
+	}
+
+	//! \brief Measure a BGRA frame of 4 * width * height bytes
+	scene_cut_result detect(const char* data)
+	{
+		if (mOwn)
+			mOwn->build(data);
+		else if (mLuma->source() != data)
+			throw std::runtime_error("Luma plane was not built for this frame.");
+		mPool.run(mSmallHeight, 8, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto y = begin; y < end; ++y)
+				measure_row(y);
+		});
+		std::vector<uint32_t> histogram(Bins, 0);
+		uint64_t sad = 0;
+		for (auto y = 0u; y < mSmallHeight; ++y)
+		{
+			for (auto b = 0u; b < Bins; ++b)
+				histogram[b] += mRowHistogram[size_t(y) * Bins + b];
+			sad += mRowSad[y];
+		}
+		auto pixels = double(mPrevious.size());
+		scene_cut_result result = { 0.0, 0.0, false };
+		if (mHasPrevious)
+		{
+			uint64_t difference = 0;
+			for (auto b = 0u; b < Bins; ++b)
+				difference += histogram[b] > mPreviousHistogram[b] ? histogram[b] - mPreviousHistogram[b] : mPreviousHistogram[b] - histogram[b];
+			result.histogram = difference / (2.0 * pixels);
+			result.sad = sad / pixels;
+			++mSinceCut;
+			// A floor keeps noise in static content from counting as a large ratio. A cap keeps
+			// cuts out of heavy motion detectable; the histogram still rules out the motion itself.
+			const double maxSadLimit = 40.0;
+			auto sadLimit = mSadRatio * (mAverageSad > 2.0 ? mAverageSad : 2.0);
+			sadLimit = sadLimit < maxSadLimit ? sadLimit : maxSadLimit;
+			result.cut = result.histogram > mHistogramThreshold && result.sad > sadLimit && mSinceCut >= mMinDistance;
+			if (result.cut)
+				mSinceCut = 0;
+			else
+				mAverageSad += (result.sad - mAverageSad) * 0.1;
+		}
+		else
+		{
+			mSinceCut = mMinDistance;
+		}
+		mHasPrevious = true;
+		mPreviousHistogram.swap(histogram);
+		return result;
+	}
+
+	void reset()
+	{
+		mHasPrevious = false;
+		mAverageSad = 0.0;
+	}
+};
+
+//! \brief Stage that forces a keyframe at each detected cut and writes a chapter list
+//! \details Chapters use the OGM text format (CHAPTER01=00:00:00.000 / CHAPTER01NAME=...),
+//!          which MP4Box and mkvmerge can import. Each line is flushed when it is written.
+template<typename Sink>
+class scene_cut_stage
+{
+	Sink& mSink;
+	scene_cut_detector& mDetector;
+	std::function<void()> mForceKeyframe;
+	FILE* mChapters = nullptr;
+	uint64_t mTime = 0;
+	unsigned int mChapterCount = 0;
+	std::vector<uint64_t> mCuts;
+	scene_cut_result mLast;
+
+	void add_chapter(uint64_t time)
+	{
+		++mChapterCount;
+		if (!mChapters)
+			return;
+		auto ms = (time + 5000) / 10000;
+		fprintf(mChapters, "CHAPTER%02u=%02u:%02u:%02u.%03u\nCHAPTER%02uNAME=Scene %u\n", mChapterCount,
+			static_cast<unsigned int>(ms / 3600000), static_cast<unsigned int>(ms / 60000 % 60),
+			static_cast<unsigned int>(ms / 1000 % 60), static_cast<unsigned int>(ms % 1000),
+			mChapterCount, mChapterCount);
+		fflush(mChapters);
+	}
+public:
+	//! \param forceKeyframe Called before the first frame of a new scene is written, e.g. movie_writer::force_keyframe
+	//! \param chapterPath Chapter list output. nullptr disables it.
+	scene_cut_stage(Sink& sink, scene_cut_detector& detector, std::function<void()> forceKeyframe,
+					const char* chapterPath = nullptr)
+		: mSink(sink), mDetector(detector), mForceKeyframe(forceKeyframe)
+	{
+		mLast.histogram = mLast.sad = 0.0;
+		mLast.cut = false;
+		if (chapterPath)
+		{
+#ifdef _MSC_VER
+			if (fopen_s(&mChapters, chapterPath, "w") != 0)
+				mChapters = nullptr;
+#else
+			mChapters = fopen(chapterPath, "w");
+#endif
+			if (!mChapters)
+				throw std::runtime_error("Cannot open chapter file.");
+		}
+		add_chapter(0);
+	}
+	~scene_cut_stage()
+	{
+		if (mChapters)
+			fclose(mChapters);
+	}
+	scene_cut_stage(const scene_cut_stage&) = delete;
+	scene_cut_stage& operator=(const scene_cut_stage&) = delete;
+
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		mLast = mDetector.detect(data);
+		if (mLast.cut)
+		{
+			mCuts.push_back(mTime);
+			add_chapter(mTime);
+			if (mForceKeyframe)
+				mForceKeyframe();
+		}
+		mSink.write(data, duration);
+		mTime += duration;
+	}
+
+	//! \brief Timestamps of the cuts in 100 ns units
+	const std::vector<uint64_t>& cuts() const	{ return mCuts; }
+	//! \brief Measurements of the last written frame
+	const scene_cut_result& last() const		{ return mLast; }
+};
@@ -0,0 +1,651 @@
+// spill_file.h
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SPILL_FILE_SSE2 1
+#endif
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "worker_pool.h"
+
+//! \brief First page of a spill file
+struct spill_header
+{
+	static const uint32_t Magic = 0x4c495053;	// "SPIL"
+	static const uint32_t Version = 1;
+	static const unsigned int Alignment = 4096;	// Every frame starts on a page
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t frameSize;
+	uint32_t keyInterval;		// 0 when frames are stored raw
+	uint64_t indexOffset;
+	uint64_t indexCapacity;
+	uint64_t dataOffset;
+	uint64_t closed;			// Set by a clean close; the index is valid either way
+};
+
+//! \brief Index entry, written after the frame data
+//! \details check covers the other fields, so a torn entry ends the index instead of
+//!          pointing at garbage. checksum covers the stored bytes of the frame.
+struct spill_entry
+{
+	static const uint32_t Compressed = 1;
+	static const uint32_t Key = 2;
+
+	uint64_t offset;
+	uint64_t timestamp;
+	uint64_t duration;
+	uint64_t checksum;
+	uint32_t size;
+	uint32_t sequence;
+	uint32_t flags;
+	uint32_t check;
+
+	uint32_t compute_check() const
+	{
+		// FNV-1a over everything before check
+		auto p = reinterpret_cast<const unsigned char*>(this);
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < offsetof(spill_entry, check); ++i)
+			h = (h ^ p[i]) * 16777619u;
+		return h;
+	}
+};
+
+//! \brief Sum of little-endian 64-bit words; the tail is zero padded
+//! \details Order independent, so regions that start on 8-byte boundaries can be summed separately.
+inline uint64_t spill_sum(const unsigned char* data, size_t size)
+{
+	uint64_t sum = 0;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, data + i, 8);
+		sum += w;
+	}
+	if (i < size)
+	{
+		uint64_t w = 0;
+		memcpy(&w, data + i, size - i);
+		sum += w;
+	}
+	return sum;
+}
+
+//! \brief Checksum stored in spill_entry; zeroed pages do not match unless the frame was empty
+inline uint64_t spill_checksum(uint64_t sum, uint32_t size)
+{
+	return sum + size * 0x9e3779b97f4a7c15ull;
+}
+
+//! \brief Read-write mapping of a preallocated file, or a read-only mapping of an existing one
+class spill_mapping
+{
+	unsigned char* mData = nullptr;
+	uint64_t mSize = 0;
+#ifdef _WIN32
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+	HANDLE mMapping = nullptr;
+#else
+	int mFd = -1;
+#endif
+
+	//! \brief Release whatever the constructor got so far and throw
+	void fail(const char* message)
+	{
+		close(0);
+		throw std::runtime_error(message);
+	}
+public:
+	//! \param size Bytes to preallocate and map writable, or 0 to map an existing file read-only
+	spill_mapping(const char* path, uint64_t size)
+	{
+		auto create = size != 0;
+#ifdef _WIN32
+		mFile = CreateFileA(path, create ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, nullptr,
+							create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (mFile == INVALID_HANDLE_VALUE)
+			fail("Cannot open spill file.");
+		LARGE_INTEGER length;
+		if (create)
+		{
+			length.QuadPart = static_cast<LONGLONG>(size);
+			if (!SetFilePointerEx(mFile, length, nullptr, FILE_BEGIN) || !SetEndOfFile(mFile))
+				fail("Cannot preallocate spill file.");
+		}
+		else if (!GetFileSizeEx(mFile, &length))
+		{
+			fail("Cannot get file size.");
+		}
+		mSize = static_cast<uint64_t>(length.QuadPart);
+		if (mSize == 0)
+			fail("Spill file is empty.");
+		mMapping = CreateFileMappingA(mFile, nullptr, create ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+		if (!mMapping)
+			fail("Cannot map spill file.");
+		mData = static_cast<unsigned char*>(MapViewOfFile(mMapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+#else
+		mFd = create ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+		if (mFd < 0)
+			fail("Cannot open spill file.");
+		if (create)
+		{
+			// Allocate the blocks now so appends never wait on the allocator; fall back to a sparse file.
+			if (posix_fallocate(mFd, 0, static_cast<off_t>(size)) != 0 && ftruncate(mFd, static_cast<off_t>(size)) != 0)
+				fail("Cannot preallocate spill file.");
+			mSize = size;
+		}
+		else
+		{
+			struct stat st;
+			if (fstat(mFd, &st) != 0)
+				fail("Cannot get file size.");
+			mSize = static_cast<uint64_t>(st.st_size);
+			if (mSize == 0)
+				fail("Spill file is empty.");
+		}
+		auto p = mmap(nullptr, mSize, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, mFd, 0);
+		mData = p == MAP_FAILED ? nullptr : static_cast<unsigned char*>(p);
+		if (mData)
+			madvise(p, mSize, MADV_SEQUENTIAL);
+#endif
+		if (!mData)
+			fail("Cannot map spill file.");
+	}
+	~spill_mapping()
+	{
+		close(0);
+	}
+	spill_mapping(const spill_mapping&) = delete;
+	spill_mapping& operator=(const spill_mapping&) = delete;
+
+	unsigned char* data() const	{ return mData; }
+	uint64_t size() const		{ return mSize; }
+
+	//! \brief Start writing back a range without waiting for it
+	void write_back(uint64_t offset, uint64_t length)
+	{
+#ifdef __linux__
+		sync_file_range(mFd, static_cast<off64_t>(offset), static_cast<off64_t>(length), SYNC_FILE_RANGE_WRITE);
+#else
+		(void)offset;
+		(void)length;
+#endif
+	}
+
+	//! \brief Write a range to the disk and wait for it
+	void flush(uint64_t offset, uint64_t length)
+	{
+		auto begin = offset & ~uint64_t(spill_header::Alignment - 1);
+#ifdef _WIN32
+		FlushViewOfFile(mData + begin, static_cast<SIZE_T>(offset + length - begin));
+		FlushFileBuffers(mFile);
+#else
+		msync(mData + begin, static_cast<size_t>(offset + length - begin), MS_SYNC);
+#endif
+	}
+
+	//! \brief Unmap and, when truncate is not 0, cut the file to that many bytes
+	void close(uint64_t truncate)
+	{
+#ifdef _WIN32
+		if (mData)
+			UnmapViewOfFile(mData);
+		if (mMapping)
+			CloseHandle(mMapping);
+		if (mFile != INVALID_HANDLE_VALUE)
+		{
+			if (truncate)
+			{
+				LARGE_INTEGER length;
+				length.QuadPart = static_cast<LONGLONG>(truncate);
+				SetFilePointerEx(mFile, length, nullptr, FILE_BEGIN);
+				SetEndOfFile(mFile);
+			}
+			CloseHandle(mFile);
+		}
+		mMapping = nullptr;
+		mFile = INVALID_HANDLE_VALUE;
+#else
+		if (mData)
+			munmap(mData, mSize);
+		if (mFd >= 0)
+		{
+			if (truncate)
+			{
+				// A failed trim only wastes space; the index bounds the data.
+				auto result = ftruncate(mFd, static_cast<off_t>(truncate));
+				(void)result;
+			}
+			::close(mFd);
+		}
+		mFd = -1;
+#endif
+		mData = nullptr;
+	}
+};
+
+//! \brief Capture phase: appends frames to a preallocated, memory-mapped spill file
+//! \details Frames start on page boundaries and raw frames are copied with non-temporal
+//!          stores, so the file is written in large aligned sequential runs. With a
+//!          worker_pool, each frame is XORed with the previous one and the zero runs are
+//!          removed, one tile per thread. An index entry is written after each frame, so
+//!          after a crash the file can still be drained up to the last complete frame.
+class spill_writer
+{
+	static const uint64_t WriteBackBytes = 64ull * 1024 * 1024;
+
+	spill_mapping mMapping;
+	spill_header* mHeader;
+	spill_entry* mIndex;
+	worker_pool* mPool;
+	unsigned int mFrameSize;
+	unsigned int mKeyInterval;
+	unsigned int mTiles;
+	uint64_t mDataOffset;
+	uint64_t mEnd;				// End of the last frame
+	uint64_t mWrittenBack;		// Data before this offset has been handed to write_back
+	uint64_t mSynced;			// Frames covered by the last sync()
+	uint64_t mCount;
+	uint64_t mTime;
+	std::vector<uint32_t> mPrevious;
+	std::vector<std::vector<uint32_t>> mTileData;
+	std::vector<uint64_t> mTileSums;
+
+	static uint64_t align(uint64_t v)
+	{
+		return (v + spill_header::Alignment - 1) & ~uint64_t(spill_header::Alignment - 1);
+	}
+
+	//! \brief Copy with streaming stores and return spill_sum of the bytes
+	static uint64_t copy_raw(const char* src, unsigned char* dest, size_t size)
+	{
+		size_t i = 0;
+		uint64_t sum = 0;
+#ifdef SPILL_FILE_SSE2
+		// dest is page aligned
+		auto acc = _mm_setzero_si128();
+		for (; i + 16 <= size; i += 16)
+		{
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			acc = _mm_add_epi64(acc, v);
+			_mm_stream_si128(reinterpret_cast<__m128i*>(dest + i), v);
+		}
+		_mm_sfence();
+		uint64_t lanes[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+		sum = lanes[0] + lanes[1];
+#endif
+		memcpy(dest + i, src + i, size - i);
+		return sum + spill_sum(dest + i, size - i);
+	}
+
+	//! \brief Encode words [begin, end) of the XOR delta as (zero run, literal count, literals...)
+	void encode_tile(const uint32_t* cur, unsigned int begin, unsigned int end, bool key, std::vector<uint32_t>& out)
+	{
+		out.clear();
+		auto prev = mPrevious.data();
+		auto delta = [&](unsigned int i) { return key ? cur[i] : cur[i] ^ prev[i]; };
+		auto i = begin;
+		while (i < end)
+		{
+			auto zeroStart = i;
+			while (i < end && delta(i) == 0)
+				++i;
+			auto literalStart = i;
+			// A literal run ends at two zero words in a row; single zeros are cheaper inline.
+			while (i < end && (delta(i) != 0 || (i + 1 < end && delta(i + 1) != 0)))
+				++i;
+			out.push_back(literalStart - zeroStart);
+			out.push_back(i - literalStart);
+			for (auto j = literalStart; j < i; ++j)
+				out.push_back(delta(j));
+		}
+		memcpy(prev + begin, cur + begin, size_t(4) * (end - begin));
+	}
+
+	//! \brief Tile-parallel compression into the mapping at dest
+	//! \return Stored size, or 0 when the compressed frame would not be smaller than the raw one
+	uint32_t compress(const char* data, unsigned char* dest, bool key, uint64_t& sum)
+	{
+		// Words are read in place when the frame is 4-byte aligned, as captured frames are.
+		std::vector<uint32_t> copy;
+		auto cur = reinterpret_cast<const uint32_t*>(data);
+		if (reinterpret_cast<uintptr_t>(data) & 3)
+		{
+			copy.resize(mFrameSize / 4);
+			memcpy(copy.data(), data, copy.size() * 4);
+			cur = copy.data();
+		}
+		auto words = mFrameSize / 4;
+		mPool->run(mTiles, 1, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto t = begin; t < end; ++t)
+				encode_tile(cur, static_cast<unsigned int>(uint64_t(words) * t / mTiles),
+							static_cast<unsigned int>(uint64_t(words) * (t + 1) / mTiles), key, mTileData[t]);
+		});
+		// Layout: tile count, tile sizes in words, tail byte count, padding to 8 bytes,
+		// then each tile padded to 8 bytes and the tail bytes, so every region starts on a
+		// spill_sum word boundary and can be summed on its own.
+		auto headerWords = (mTiles + 2 + 1) & ~1u;
+		uint64_t size = size_t(4) * headerWords;
+		std::vector<uint64_t> offsets(mTiles);
+		for (auto t = 0u; t < mTiles; ++t)
+		{
+			offsets[t] = size;
+			size += (size_t(4) * mTileData[t].size() + 7) & ~size_t(7);
+		}
+		auto tailBytes = mFrameSize & 3;
+		auto tailOffset = size;
+		size += tailBytes;
+		if (size >= mFrameSize)
+			return 0;
+		auto header = reinterpret_cast<uint32_t*>(dest);
+		header[0] = mTiles;
+		for (auto t = 0u; t < mTiles; ++t)
+			header[1 + t] = static_cast<uint32_t>(mTileData[t].size());
+		header[1 + mTiles] = tailBytes;
+		for (auto i = mTiles + 2; i < headerWords; ++i)
+			header[i] = 0;
+		mPool->run(mTiles, 1, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto t = begin; t < end; ++t)
+			{
+				auto bytes = size_t(4) * mTileData[t].size();
+				memcpy(dest + offsets[t], mTileData[t].data(), bytes);
+				if (bytes & 7)
+					memset(dest + offsets[t] + bytes, 0, 4);
+				mTileSums[t] = spill_sum(dest + offsets[t], bytes);
+			}
+		});
+		memcpy(dest + tailOffset, data + (mFrameSize & ~3u), tailBytes);
+		sum = spill_sum(dest, size_t(4) * headerWords) + spill_sum(dest + tailOffset, tailBytes);
+		for (auto t = 0u; t < mTiles; ++t)
+			sum += mTileSums[t];
+		return static_cast<uint32_t>(size);
+	}
+public:
+	//! \brief Capacity that holds frameCount frames even when all of them are stored raw
+	//! \details Covers the header page, the index (whose size follows from the capacity)
+	//!          and each frame padded to a page.
+	static uint64_t required_capacity(uint64_t frameCount, unsigned int frameSize)
+	{
+		auto data = frameCount * align(frameSize);
+		uint64_t capacity = 4 * spill_header::Alignment;
+		for (;;)
+		{
+			auto index = align(spill_header::Alignment + capacity / spill_header::Alignment * sizeof(spill_entry));
+			if (index + data <= capacity)
+				return capacity;
+			capacity = index + data;
+		}
+	}
+
+	//! \param frameSize Bytes per frame
+	//! \param capacity Bytes to preallocate, e.g. required_capacity(); write() fails once they are used up
+	//! \param pool Compress frames on this pool, or nullptr to store them raw
+	//! \param keyInterval Frames between frames that do not depend on the previous one
+	spill_writer(const char* path, unsigned int frameSize, uint64_t capacity,
+				worker_pool* pool = nullptr, unsigned int keyInterval = 30)
+		: mMapping(path, capacity), mPool(pool), mFrameSize(frameSize),
+		mKeyInterval(pool ? (keyInterval ? keyInterval : 1) : 0), mTiles(pool ? pool->size() : 0),
+		mWrittenBack(0), mSynced(0), mCount(0), mTime(0)
+	{
+		if (frameSize == 0)
+			throw std::runtime_error("Frame size must not be zero.");
+		if (capacity < 4 * spill_header::Alignment)
+			throw std::runtime_error("Spill file capacity is too small.");
+		mHeader = reinterpret_cast<spill_header*>(mMapping.data());
+		mHeader->version = spill_header::Version;
+		mHeader->frameSize = frameSize;
+		mHeader->keyInterval = mKeyInterval;
+		mHeader->indexOffset = spill_header::Alignment;
+		// Every frame takes at least one page, which bounds the number of entries.
+		mHeader->indexCapacity = capacity / spill_header::Alignment;
+		mHeader->dataOffset = align(mHeader->indexOffset + mHeader->indexCapacity * sizeof(spill_entry));
+		mHeader->closed = 0;
+		mHeader->magic = spill_header::Magic;
+		if (mHeader->dataOffset >= capacity)
+			throw std::runtime_error("Spill file capacity is too small.");
+		mIndex = reinterpret_cast<spill_entry*>(mMapping.data() + mHeader->indexOffset);
+		mDataOffset = mEnd = mHeader->dataOffset;
+		if (mPool)
+		{
+			if (mTiles == 0)
+				mTiles = 1;
+			mPrevious.resize(frameSize / 4);
+			mTileData.resize(mTiles);
+			mTileSums.resize(mTiles);
+		}
+		mMapping.flush(0, mHeader->indexOffset);
+	}
+	~spill_writer()
+	{
+		close();
+	}
+	spill_writer(const spill_writer&) = delete;
+	spill_writer& operator=(const spill_writer&) = delete;
+
+	//! \brief Append a frame
+	//! \return false when the file is full; the frame is not stored
+	bool write(const char* data, uint64_t duration)
+	{
+		if (!mMapping.data())
+			return false;
+		auto offset = align(mEnd);
+		if (mCount >= mHeader->indexCapacity || offset + mFrameSize > mMapping.size())
+			return false;
+		auto dest = mMapping.data() + offset;
+		spill_entry entry = {};
+		entry.offset = offset;
+		entry.timestamp = mTime;
+		entry.duration = duration;
+		entry.sequence = static_cast<uint32_t>(mCount);
+		uint64_t sum = 0;
+		uint32_t size = 0;
+		if (mPool)
+		{
+			auto key = mCount % mKeyInterval == 0;
+			size = compress(data, dest, key, sum);
+			entry.flags = key ? spill_entry::Key : 0;
+			if (size)
+				entry.flags |= spill_entry::Compressed;
+		}
+		if (!size)
+		{
+			sum = copy_raw(data, dest, mFrameSize);
+			size = mFrameSize;
+		}
+		entry.size = size;
+		entry.checksum = spill_checksum(sum, size);
+		entry.check = entry.compute_check();
+		mIndex[mCount] = entry;
+		mEnd = offset + size;
+		mTime += duration;
+		++mCount;
+		// Keep the dirty page cache bounded without stalling the caller.
+		if (mEnd - mWrittenBack >= WriteBackBytes)
+		{
+			auto begin = mWrittenBack ? mWrittenBack : mDataOffset;
+			mMapping.write_back(begin, mEnd - begin);
+			mWrittenBack = mEnd & ~uint64_t(spill_header::Alignment - 1);
+		}
+		return true;
+	}
+
+	//! \brief Make every frame written so far durable: the data first, then its index entries
+	void sync()
+	{
+		if (!mMapping.data() || mSynced == mCount)
+			return;
+		auto begin = mSynced ? mIndex[mSynced].offset : mDataOffset;
+		mMapping.flush(begin, mEnd - begin);
+		mMapping.flush(mHeader->indexOffset + mSynced * sizeof(spill_entry), (mCount - mSynced) * sizeof(spill_entry));
+		mSynced = mCount;
+	}
+
+	//! \brief Sync, mark the file closed and trim the unused preallocation
+	void close()
+	{
+		if (!mMapping.data())
+			return;
+		sync();
+		mHeader->closed = 1;
+		mMapping.flush(0, sizeof(spill_header));
+		mMapping.close(align(mEnd));
+	}
+
+	uint64_t count() const			{ return mCount; }
+	uint64_t bytes_stored() const	{ return mEnd - mDataOffset; }
+};
+
+//! \brief Drain phase: reads a spill file back, including one that was not closed
+class spill_reader
+{
+	spill_mapping mMapping;
+	const spill_header* mHeader;
+	const spill_entry* mIndex;
+	uint64_t mCount;
+	std::vector<uint32_t> mFrame;	// Last decoded frame, for delta frames
+	uint64_t mDecoded;				// Index of mFrame + 1, or 0
+
+	bool valid(uint64_t i) const
+	{
+		auto& e = mIndex[i];
+		return e.check == e.compute_check() && e.sequence == i && e.offset >= mHeader->dataOffset &&
+			e.offset + e.size <= mMapping.size() && (e.size == mHeader->frameSize || (e.flags & spill_entry::Compressed));
+	}
+
+	bool decode(uint64_t i)
+	{
+		auto& e = mIndex[i];
+		auto src = mMapping.data() + e.offset;
+		if (spill_checksum(spill_sum(src, e.size), e.size) != e.checksum)
+			return false;
+		auto frame = reinterpret_cast<unsigned char*>(mFrame.data());
+		if (!(e.flags & spill_entry::Compressed))
+		{
+			memcpy(frame, src, e.size);
+			return true;
+		}
+		auto header = reinterpret_cast<const uint32_t*>(src);
+		auto words = mHeader->frameSize / 4;
+		auto tailBytes = mHeader->frameSize & 3;
+		if (e.size < 8)
+			return false;
+		// Every word of the frame belongs to some tile, so a frame with words has at least one.
+		auto tiles = header[0];
+		if ((tiles == 0 && words != 0) || size_t(4) * (uint64_t(tiles) + 2) > e.size || header[1 + tiles] != tailBytes)
+			return false;
+		auto key = (e.flags & spill_entry::Key) != 0;
+		size_t pos = size_t(4) * ((tiles + 2 + 1) & ~1u);
+		uint32_t w = 0;
+		for (auto t = 0u; t < tiles; ++t)
+		{
+			auto tileWords = header[1 + t];
+			if (pos + size_t(4) * tileWords > e.size)
+				return false;
+			auto p = reinterpret_cast<const uint32_t*>(src + pos);
+			auto tileEnd = static_cast<uint32_t>(uint64_t(words) * (t + 1) / tiles);
+			for (uint32_t j = 0; j + 2 <= tileWords;)
+			{
+				auto zeros = p[j];
+				auto literals = p[j + 1];
+				j += 2;
+				if (w + zeros + literals > tileEnd || j + literals > tileWords)
+					return false;
+				if (key)
+					memset(&mFrame[w], 0, size_t(4) * zeros);
+				w += zeros;
+				for (auto k = 0u; k < literals; ++k, ++w)
+					mFrame[w] = key ? p[j + k] : mFrame[w] ^ p[j + k];
+				j += literals;
+			}
+			if (w != tileEnd)
+				return false;
+			pos += (size_t(4) * tileWords + 7) & ~size_t(7);
+		}
+		if (w != words || pos + tailBytes > e.size)
+			return false;
+		memcpy(frame + size_t(4) * words, src + pos, tailBytes);
+		return true;
+	}
+public:
+	explicit spill_reader(const char* path)
+		: mMapping(path, 0), mCount(0), mDecoded(0)
+	{
+		mHeader = reinterpret_cast<const spill_header*>(mMapping.data());
+		if (mMapping.size() < sizeof(spill_header) || mHeader->magic != spill_header::Magic ||
+			mHeader->version != spill_header::Version)
+			throw std::runtime_error("Not a spill file.");
+		if (mHeader->indexOffset + mHeader->indexCapacity * sizeof(spill_entry) > mMapping.size())
+			throw std::runtime_error("Spill file index is truncated.");
+		mIndex = reinterpret_cast<const spill_entry*>(mMapping.data() + mHeader->indexOffset);
+		while (mCount < mHeader->indexCapacity && valid(mCount))
+			++mCount;
+		mFrame.resize((mHeader->frameSize + 3) / 4);
+	}
+
+	unsigned int frame_size() const			{ return mHeader->frameSize; }
+	uint64_t count() const					{ return mCount; }
+	bool closed() const						{ return mHeader->closed != 0; }
+	uint64_t timestamp(uint64_t i) const	{ return mIndex[i].timestamp; }
+	uint64_t duration(uint64_t i) const		{ return mIndex[i].duration; }
+
+	//! \brief Decode frame i; sequential reads decode each frame once
+	//! \return nullptr when the frame or one it depends on is damaged
+	const char* frame(uint64_t i)
+	{
+		if (i >= mCount)
+			return nullptr;
+		if (mDecoded != i + 1)
+		{
+			// Delta frames need every frame since the last key frame.
+			auto start = i;
+			if (mHeader->keyInterval)
+			{
+				start -= i % mHeader->keyInterval;
+				if (mDecoded > start && mDecoded <= i)
+					start = mDecoded;
+			}
+			mDecoded = 0;
+			for (auto j = start; j <= i; ++j)
+			{
+				if (!decode(j))
+					return nullptr;
+			}
+			mDecoded = i + 1;
+		}
+		return reinterpret_cast<const char*>(mFrame.data());
+	}
+
+	//! \brief Feed every intact frame to Sink::write(const char*, uint64_t), e.g. a movie_writer
+	//! \return Number of frames written; stops at the first damaged frame
+	template<typename Sink>
+	uint64_t drain(Sink& sink)
+	{
+		for (uint64_t i = 0; i < mCount; ++i)
+		{
+			auto data = frame(i);
+			if (!data)
+				return i;
+			sink.write(data, mIndex[i].duration);
+		}
+		return mCount;
+	}
+};
@@ -0,0 +1,272 @@
+// temporal_accumulator.h
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define TEMPORAL_ACCUMULATOR_SSE2 1
+#endif
+#include "worker_pool.h"
+#include "writer_telemetry.h"
+
+//! \brief Deterministic time source for offline rendering
+//! \details Times are computed from integer counters, so the same sub-frame always gets the
+//!          same time, no matter how long rendering took or how many frames came before.
+class fixed_timestep_clock
+{
+	unsigned int mFrameRate;
+	unsigned int mSubframes;
+	uint64_t mIndex = 0;
+public:
+	//! \param frameRate Output frames per second
+	//! \param subframes Rendered sub-frames per output frame
+	fixed_timestep_clock(unsigned int frameRate, unsigned int subframes = 1)
+		: mFrameRate(frameRate), mSubframes(subframes)
+	{
+		if (frameRate == 0 || subframes == 0)
+			throw std::runtime_error("Frame rate and sub-frames must not be zero.");
+	}
+
+	//! \brief Seconds at the current sub-frame
+	double time() const
+	{
+		return static_cast<double>(mIndex) / (static_cast<double>(mFrameRate) * mSubframes);
+	}
+	void advance()	{ ++mIndex; }
+	void reset()	{ mIndex = 0; }
+
+	uint64_t subframe() const	{ return mIndex; }
+	uint64_t frame() const		{ return mIndex / mSubframes; }
+	//! \brief Duration of sub-frame i in 100 ns units; the sum over a second is exactly 10,000,000
+	uint64_t subframe_duration(uint64_t i) const
+	{
+		auto rate = uint64_t(mFrameRate) * mSubframes;
+		return (i + 1) * 10000000 / rate - i * 10000000 / rate;
+	}
+	//! \brief Duration of the current sub-frame in 100 ns units
+	uint64_t subframe_duration() const	{ return subframe_duration(mIndex); }
+};
+
+//! \brief Averages consecutive BGRA sub-frames into one motion-blurred frame
+//! \details Weights are scaled to integers that sum to 256, so the weighted sum of 8-bit
+//!          samples fits a 16-bit accumulator. Accumulation and the final normalize-and-pack
+//!          are SSE2, row-parallel on the worker pool. Sub-frames with zero weight (e.g. a
+//!          closed shutter) are not read, so the caller can skip rendering them; see needed().
+class temporal_accumulator
+{
+	unsigned int mWidth;
+	unsigned int mHeight;
+	worker_pool& mPool;
+	std::vector<uint16_t> mWeights;
+	std::vector<uint16_t> mSum;
+	std::vector<char> mFrame;
+	unsigned int mSubframe = 0;
+	bool mEmpty = true;
+
+	//! \brief Round weights to integers summing to 256, largest remainder first
+	//! \details Throws rather than silently drop a sub-frame whose weight would round to 0,
+	//!          which is always the case for some of them beyond 256 sub-frames.
+	static std::vector<uint16_t> quantize(const std::vector<double>& weights)
+	{
+		if (weights.size() > 256)
+			throw std::runtime_error("At most 256 sub-frames per frame.");
+		double total = 0.0;
+		for (auto w : weights)
+		{
+			if (w < 0.0)
+				throw std::runtime_error("Shutter weights must not be negative.");
+			total += w;
+		}
+		if (weights.empty() || total <= 0.0)
+			throw std::runtime_error("Shutter weights must not all be zero.");
+		std::vector<uint16_t> result(weights.size());
+		std::vector<double> remainder(weights.size());
+		unsigned int sum = 0;
+		for (size_t i = 0; i < weights.size(); ++i)
+		{
+			auto scaled = weights[i] * 256.0 / total;
+			result[i] = static_cast<uint16_t>(std::floor(scaled));
+			remainder[i] = scaled - result[i];
+			sum += result[i];
+		}
+		while (sum < 256)
+		{
+			size_t best = 0;
+			for (size_t i = 1; i < weights.size(); ++i)
+			{
+				if (remainder[i] > remainder[best])
+					best = i;
+			}
+			++result[best];
+			remainder[best] = -1.0;
+			++sum;
+		}
+		for (size_t i = 0; i < weights.size(); ++i)
+		{
+			if (weights[i] > 0.0 && result[i] == 0)
+				throw std::runtime_error("Shutter weight is too small against the others.");
+		}
+		return result;
+	}
+
+	void accumulate_rows(const unsigned char* src, unsigned int begin, unsigned int end, uint16_t weight, bool first)
+	{
+		auto count = size_t(4) * mWidth * (end - begin);
+		auto s = src + size_t(4) * mWidth * begin;
+		auto acc = &mSum[size_t(4) * mWidth * begin];
+		size_t i = 0;
+#ifdef TEMPORAL_ACCUMULATOR_SSE2
+		auto zero = _mm_setzero_si128();
+		auto w = _mm_set1_epi16(static_cast<short>(weight));
+		for (; i + 16 <= count; i += 16)
+		{
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+			auto lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w);
+			auto hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w);
+			auto a0 = reinterpret_cast<__m128i*>(acc + i);
+			auto a1 = reinterpret_cast<__m128i*>(acc + i + 8);
+			if (!first)
+			{
+				lo = _mm_add_epi16(lo, _mm_loadu_si128(a0));
+				hi = _mm_add_epi16(hi, _mm_loadu_si128(a1));
+			}
+			_mm_storeu_si128(a0, lo);
+			_mm_storeu_si128(a1, hi);
+		}
+#endif
+		for (; i < count; ++i)
+			acc[i] = static_cast<uint16_t>((first ? 0 : acc[i]) + s[i] * weight);
+	}
+
+	void pack_rows(unsigned char* dest, unsigned int begin, unsigned int end)
+	{
+		auto count = size_t(4) * mWidth * (end - begin);
+		auto acc = &mSum[size_t(4) * mWidth * begin];
+		auto d = dest + size_t(4) * mWidth * begin;
+		size_t i = 0;
+#ifdef TEMPORAL_ACCUMULATOR_SSE2
+		// Sums are at most 255 * 256, so adding the rounding bias cannot overflow.
+		auto round = _mm_set1_epi16(128);
+		for (; i + 16 <= count; i += 16)
+		{
+			auto lo = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i)), round), 8);
+			auto hi = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i + 8)), round), 8);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), _mm_packus_epi16(lo, hi));
+		}
+#endif
+		for (; i < count; ++i)
+			d[i] = static_cast<unsigned char>((acc[i] + 128) >> 8);
+	}
+public:
+	//! \param weights Relative weight of each sub-frame; its size is the number of sub-frames per frame
+	temporal_accumulator(unsigned int width, unsigned int height, const std::vector<double>& weights, worker_pool& pool)
+		: mWidth(width), mHeight(height), mPool(pool), mWeights(quantize(weights)),
+		mSum(size_t(4) * width * height), mFrame(size_t(4) * width * height)
+	{
+	}
+
+	//! \brief Equal weights over every sub-frame (360 degree shutter)
+	static std::vector<double> box(unsigned int subframes)
+	{
+		return std::vector<double>(subframes, 1.0);
+	}
+	//! \brief Sub-frames whose centers fall in the open part of the shutter get weight 1
+	//! \param angle Shutter angle in degrees; 180 blurs over the first half of each frame interval
+	static std::vector<double> shutter(unsigned int subframes, double angle)
+	{
+		std::vector<double> weights(subframes, 0.0);
+		for (auto i = 0u; i < subframes; ++i)
+		{
+			if ((i + 0.5) / subframes * 360.0 <= angle)
+				weights[i] = 1.0;
+		}
+		// Even a very narrow shutter captures the first sub-frame.
+		if (subframes)
+			weights[0] = 1.0;
+		return weights;
+	}
+
+	unsigned int subframes() const	{ return static_cast<unsigned int>(mWeights.size()); }
+	//! \brief Number of sub-frames per frame with a non-zero weight
+	unsigned int weighted_subframes() const
+	{
+		unsigned int count = 0;
+		for (auto w : mWeights)
+			count += w != 0;
+		return count;
+	}
+	//! \brief Whether the next add() reads its data; if not, the sub-frame need not be rendered
+	bool needed() const	{ return mWeights[mSubframe] != 0; }
+
+	//! \brief Add one sub-frame
+	//! \param data The sub-frame, or nullptr when needed() is false
+	//! \return The averaged frame after the last sub-frame of a frame, otherwise nullptr
+	const char* add(const char* data)
+	{
+		auto weight = mWeights[mSubframe];
+		if (weight)
+		{
+			if (!data)
+				throw std::runtime_error("Sub-frame with a non-zero weight is missing.");
+			auto src = reinterpret_cast<const unsigned char*>(data);
+			auto first = mEmpty;
+			mPool.run(mHeight, 16, [&](unsigned int begin, unsigned int end)
+			{
+				accumulate_rows(src, begin, end, weight, first);
+			});
+			mEmpty = false;
+		}
+		if (++mSubframe < mWeights.size())
+			return nullptr;
+		auto dest = reinterpret_cast<unsigned char*>(mFrame.data());
+		mPool.run(mHeight, 16, [&](unsigned int begin, unsigned int end)
+		{
+			pack_rows(dest, begin, end);
+		});
+		mSubframe = 0;
+		mEmpty = true;
+		return mFrame.data();
+	}
+};
+
+//! \brief Stage that writes one averaged frame per temporal_accumulator::subframes() sub-frames
+//! \details The duration of the output frame is the sum of its sub-frame durations.
+//!          write() takes nullptr for sub-frames that needed() reports as unused.
+template<typename Sink>
+class temporal_accumulation_stage
+{
+	Sink& mSink;
+	temporal_accumulator& mAccumulator;
+	uint64_t mDuration = 0;
+	writer_telemetry* mTelemetry = nullptr;
+public:
+	temporal_accumulation_stage(Sink& sink, temporal_accumulator& accumulator)
+		: mSink(sink), mAccumulator(accumulator)
+	{
+	}
+	//! \brief Count the weighted sub-frames folded into each output frame beyond the first as merged (nullptr to stop)
+	void set_telemetry(writer_telemetry* telemetry)
+	{
+		mTelemetry = telemetry;
+	}
+	//! \brief Whether the next write() reads its data
+	bool needed() const	{ return mAccumulator.needed(); }
+
+	template<typename Duration>
+	void write(const char* data, Duration duration)
+	{
+		mDuration += duration;
+		if (auto frame = mAccumulator.add(data))
+		{
+			if (mTelemetry)
+				mTelemetry->add_merged(mAccumulator.weighted_subframes() - 1);
+			mSink.write(frame, mDuration);
+			mDuration = 0;
+		}
+	}
+};
@@ -0,0 +1,137 @@
+// worker_pool.h
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// thread_local for the re-entry check; VS2013 only has __declspec(thread).
+#ifdef _MSC_VER
+#define WORKER_POOL_TLS __declspec(thread)
+#else
+#define WORKER_POOL_TLS thread_local
+#endif
+
+//! \brief Persistent worker threads for row-parallel frame kernels
+//! \note run() is serialized; the calling thread also takes part in the work.
+//!       A task must not call run() on the pool that is running it, because the nested
+//!       call would wait for workers that are waiting for the task.
+class worker_pool
+{
+	using task_type = std::function<void(unsigned int, unsigned int)>;
+
+	std::vector<std::thread> mThreads;
+	std::mutex mRunMutex;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mDone;
+	const task_type* mTask = nullptr;
+	unsigned int mCount = 0;
+	unsigned int mGrain = 1;
+	std::atomic<unsigned int> mNext;
+	unsigned int mPending = 0;
+	unsigned long long mGeneration = 0;
+	bool mQuit = false;
+
+	//! \brief The pool whose task the current thread is running, for the re-entry check
+	static const worker_pool*& current()
+	{
+		static WORKER_POOL_TLS const worker_pool* pool = nullptr;
+		return pool;
+	}
+	void drain()
+	{
+		auto outer = current();
+		current() = this;
+		for (;;)
+		{
+			auto begin = mNext.fetch_add(mGrain);
+			if (begin >= mCount)
+				break;
+			auto end = begin + mGrain < mCount ? begin + mGrain : mCount;
+			(*mTask)(begin, end);
+		}
+		current() = outer;
+	}
+	void loop()
+	{
+		unsigned long long generation = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mWake.wait(lock, [&] { return mQuit || mGeneration != generation; });
+				if (mQuit)
+					return;
+				generation = mGeneration;
+			}
+			drain();
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (--mPending == 0)
+				mDone.notify_one();
+		}
+	}
+public:
+	//! \param threads Number of extra threads. 0 means hardware concurrency - 1.
+	explicit worker_pool(unsigned int threads = 0)
+		: mNext(0)
+	{
+		if (threads == 0)
+		{
+			auto hw = std::thread::hardware_concurrency();
+			threads = hw > 1 ? hw - 1 : 0;
+		}
+		for (auto i = 0u; i < threads; ++i)
+			mThreads.emplace_back([this] { loop(); });
+	}
+	~worker_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mQuit = true;
+		}
+		mWake.notify_all();
+		for (auto& t : mThreads)
+			t.join();
+	}
+	worker_pool(const worker_pool&) = delete;
+	worker_pool& operator=(const worker_pool&) = delete;
+
+	//! \brief Number of threads including the caller
+	unsigned int size() const	{ return static_cast<unsigned int>(mThreads.size()) + 1; }
+
+	//! \brief Call func(begin, end) over [0, count) in chunks of grain, and wait for all of them
+	void run(unsigned int count, unsigned int grain, const task_type& func)
+	{
+		if (count == 0)
+			return;
+		if (grain == 0)
+			grain = 1;
+		if (mThreads.empty() || count <= grain)
+		{
+			func(0, count);
+			return;
+		}
+		assert(current() != this && "worker_pool::run called from one of its own tasks");
+		std::lock_guard<std::mutex> runLock(mRunMutex);
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mTask = &func;
+			mCount = count;
+			mGrain = grain;
+			mNext = 0;
+			mPending = static_cast<unsigned int>(mThreads.size());
+			++mGeneration;
+		}
+		mWake.notify_all();
+		drain();
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDone.wait(lock, [&] { return mPending == 0; });
+		mTask = nullptr;
+	}
+};
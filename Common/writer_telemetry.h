@@ -0,0 +1,383 @@
+// writer_telemetry.h
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#ifdef _WIN32
+#include <Windows.h>
+#include <intrin.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// VS2013 has no thread_local; __declspec(thread) needs constant initializers.
+#ifdef _MSC_VER
+#define WRITER_TELEMETRY_TLS __declspec(thread)
+#else
+#define WRITER_TELEMETRY_TLS thread_local
+#endif
+
+//! \brief Log-linear latency histogram in nanoseconds (8 sub-buckets per power of two, ~12% precision)
+struct telemetry_histogram
+{
+	static const unsigned int SubBits = 3;
+	static const unsigned int Buckets = (41 - SubBits) << SubBits;	// Up to 2^40 ns (~18 min)
+
+	std::atomic<uint64_t> counts[Buckets];
+
+	static unsigned int bucket_of(uint64_t ns)
+	{
+		if (ns < (1u << SubBits))
+			return static_cast<unsigned int>(ns);
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long msb;
+		_BitScanReverse64(&msb, ns);
+#elif defined(__GNUC__)
+		auto msb = 63u - static_cast<unsigned int>(__builtin_clzll(ns));
+#else
+		auto msb = 63u;
+		while (!(ns >> msb))
+			--msb;
+#endif
+		auto shift = msb - SubBits;
+		auto index = ((shift + 1) << SubBits) + static_cast<unsigned int>((ns >> shift) & ((1u << SubBits) - 1));
+		return index < Buckets ? index : Buckets - 1;
+	}
+	//! \brief Lower bound of a bucket in nanoseconds
+	static uint64_t value_of(unsigned int bucket)
+	{
+		if (bucket < (1u << SubBits))
+			return bucket;
+		auto shift = (bucket >> SubBits) - 1;
+		return (uint64_t((1u << SubBits) | (bucket & ((1u << SubBits) - 1)))) << shift;
+	}
+};
+
+//! \brief Counters of one producer thread. Only the owner writes, so no locked instructions are needed.
+struct telemetry_slot
+{
+	std::atomic<uint32_t> used;
+	char padding0[60];
+	std::atomic<uint64_t> submitted;
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> merged;
+	std::atomic<uint64_t> bytesIn;
+	char padding1[24];
+	telemetry_histogram writeLatency;
+	telemetry_histogram sinkLatency;
+};
+
+//! \brief Layout of the shared-memory segment
+struct telemetry_segment
+{
+	static const uint32_t Magic = 0x4d4c4554;	// "TELM"
+	static const uint32_t Version = 1;
+	static const unsigned int MaxSlots = 16;
+	static const unsigned int OverflowSlot = MaxSlots - 1;	//!< Shared by threads that find no free slot
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slotCount;
+	uint32_t ownerPid;		// Process that created the segment
+	std::atomic<uint64_t> startTime;	// steady clock ns
+	std::atomic<uint64_t> queueDepth;	// Gauge, set by the stage that owns the queue
+	std::atomic<uint64_t> bytesOut;		// Gauge, bytes processed by the sink
+	char padding[24];
+	telemetry_slot slots[MaxSlots];
+};
+
+//! \brief Named shared memory holding a telemetry_segment
+class telemetry_mapping
+{
+	telemetry_segment* mSegment = nullptr;
+#ifdef _WIN32
+	HANDLE mMapping = nullptr;
+#else
+	std::string mName;
+	bool mOwner = false;
+#endif
+public:
+	//! \param create true for the recorder, false for an external monitor (read-only)
+	//! \note Creating fails while another recorder owns the name, so two publishers never share one segment.
+	telemetry_mapping(const char* name, bool create)
+	{
+		auto size = sizeof(telemetry_segment);
+#ifdef _WIN32
+		if (create)
+		{
+			mMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), name);
+			if (mMapping && GetLastError() == ERROR_ALREADY_EXISTS)
+			{
+				CloseHandle(mMapping);
+				throw std::runtime_error("Telemetry segment is in use.");
+			}
+		}
+		else
+		{
+			mMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+		}
+		if (!mMapping)
+			throw std::runtime_error("Cannot open telemetry segment.");
+		mSegment = static_cast<telemetry_segment*>(MapViewOfFile(mMapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size));
+#else
+		mName = std::string("/") + name;
+		auto fd = shm_open(mName.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDONLY, 0644);
+		if (fd < 0 && create && errno == EEXIST)
+		{
+			// Named shared memory outlives a crashed recorder; take the segment over only if its owner is gone.
+			fd = shm_open(mName.c_str(), O_RDWR, 0644);
+			if (fd >= 0 && !stale(fd))
+			{
+				close(fd);
+				throw std::runtime_error("Telemetry segment is in use.");
+			}
+		}
+		if (fd < 0)
+			throw std::runtime_error("Cannot open telemetry segment.");
+		if (create && ftruncate(fd, size) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("Cannot size telemetry segment.");
+		}
+		auto p = mmap(nullptr, size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		mSegment = p == MAP_FAILED ? nullptr : static_cast<telemetry_segment*>(p);
+		mOwner = create;
+#endif
+		if (!mSegment)
+			throw std::runtime_error("Cannot map telemetry segment.");
+		if (create)
+		{
+			memset(static_cast<void*>(mSegment), 0, size);
+#ifdef _WIN32
+			mSegment->ownerPid = GetCurrentProcessId();
+#else
+			mSegment->ownerPid = static_cast<uint32_t>(getpid());
+#endif
+			mSegment->slotCount = telemetry_segment::MaxSlots;
+			mSegment->version = telemetry_segment::Version;
+			mSegment->startTime = now();
+			std::atomic_thread_fence(std::memory_order_release);
+			mSegment->magic = telemetry_segment::Magic;
+		}
+		else if (mSegment->magic != telemetry_segment::Magic || mSegment->version != telemetry_segment::Version)
+		{
+			throw std::runtime_error("Telemetry segment version mismatch.");
+		}
+	}
+	~telemetry_mapping()
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(mSegment);
+		CloseHandle(mMapping);
+#else
+		munmap(mSegment, sizeof(telemetry_segment));
+		if (mOwner)
+			shm_unlink(mName.c_str());
+#endif
+	}
+	telemetry_mapping(const telemetry_mapping&) = delete;
+	telemetry_mapping& operator=(const telemetry_mapping&) = delete;
+
+#ifndef _WIN32
+	//! \brief Whether an existing segment was left behind by a recorder process that no longer runs
+	static bool stale(int fd)
+	{
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(telemetry_segment)))
+			return false;	// Still being created
+		auto p = mmap(nullptr, sizeof(telemetry_segment), PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			return false;
+		auto segment = static_cast<const telemetry_segment*>(p);
+		auto pid = static_cast<pid_t>(segment->ownerPid);
+		auto gone = segment->magic == telemetry_segment::Magic && pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH;
+		munmap(p, sizeof(telemetry_segment));
+		return gone;
+	}
+#endif
+
+	telemetry_segment* get() const	{ return mSegment; }
+
+	static uint64_t now()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+};
+
+//! \brief Publisher side of writer telemetry
+//! \details Each thread claims a slot on first use and bumps plain relaxed counters in it.
+//!          The monitor sums slots on its own schedule; the hot path never waits for it.
+//!          Slots are not released when a thread exits; once they run out, further threads
+//!          share the overflow slot with locked adds, so recording never fails.
+class writer_telemetry
+{
+	telemetry_mapping mMapping;
+	uint64_t mId;
+	std::atomic<uint64_t> mOwners[telemetry_segment::MaxSlots];	// Thread token of each claimed slot
+
+	//! \brief Add n to a counter of slot s; only the overflow slot has several writers
+	void bump(const telemetry_slot& s, std::atomic<uint64_t>& counter, uint64_t n)
+	{
+		if (&s == &mMapping.get()->slots[telemetry_segment::OverflowSlot])
+			counter.fetch_add(n, std::memory_order_relaxed);
+		else
+			counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	//! \brief Nonzero id of the calling thread, unique for the process lifetime
+	static uint64_t thread_token()
+	{
+		static std::atomic<uint64_t> threads(0);
+		static WRITER_TELEMETRY_TLS uint64_t token = 0;
+		if (!token)
+			token = ++threads;
+		return token;
+	}
+	//! \brief This thread's slot in this instance, claiming one on first use
+	telemetry_slot* find_or_claim(uint64_t token)
+	{
+		auto segment = mMapping.get();
+		for (auto i = 0u; i < telemetry_segment::OverflowSlot; ++i)
+		{
+			if (mOwners[i].load(std::memory_order_relaxed) == token)
+				return &segment->slots[i];
+		}
+		for (auto i = 0u; i < telemetry_segment::OverflowSlot; ++i)
+		{
+			uint32_t expected = 0;
+			if (segment->slots[i].used.compare_exchange_strong(expected, 1))
+			{
+				mOwners[i].store(token, std::memory_order_relaxed);
+				return &segment->slots[i];
+			}
+		}
+		return &segment->slots[telemetry_segment::OverflowSlot];
+	}
+	telemetry_slot& slot()
+	{
+		// One-entry cache per thread for the instance it used last; a thread switching
+		// between instances finds its earlier slot again in find_or_claim().
+		static WRITER_TELEMETRY_TLS uint64_t owner = 0;
+		static WRITER_TELEMETRY_TLS telemetry_slot* cached = nullptr;
+		if (owner != mId)
+		{
+			cached = find_or_claim(thread_token());
+			owner = mId;
+		}
+		return *cached;
+	}
+	void add(std::atomic<uint64_t> telemetry_slot::* counter, uint64_t n)
+	{
+		auto& s = slot();
+		bump(s, s.*counter, n);
+	}
+	void record(telemetry_histogram telemetry_slot::* histogram, uint64_t ns)
+	{
+		auto& s = slot();
+		bump(s, (s.*histogram).counts[telemetry_histogram::bucket_of(ns)], 1);
+	}
+public:
+	//! \param name  Shared memory name; throws if another writer_telemetry already publishes under it
+	explicit writer_telemetry(const char* name = "GraphicsRecordTelemetry")
+		: mMapping(name, true)
+	{
+		static std::atomic<uint64_t> instances(0);
+		mId = ++instances;
+		for (auto& owner : mOwners)
+			owner.store(0, std::memory_order_relaxed);
+		mMapping.get()->slots[telemetry_segment::OverflowSlot].used.store(1, std::memory_order_release);
+	}
+
+	static uint64_t now()	{ return telemetry_mapping::now(); }
+
+	void add_submitted(uint64_t n = 1)	{ add(&telemetry_slot::submitted, n); }
+	void add_written(uint64_t n = 1)	{ add(&telemetry_slot::written, n); }
+	void add_dropped(uint64_t n = 1)	{ add(&telemetry_slot::dropped, n); }
+	void add_merged(uint64_t n = 1)		{ add(&telemetry_slot::merged, n); }
+	void add_bytes(uint64_t n)			{ add(&telemetry_slot::bytesIn, n); }
+	void record_write(uint64_t ns)		{ record(&telemetry_slot::writeLatency, ns); }
+	void record_sink(uint64_t ns)		{ record(&telemetry_slot::sinkLatency, ns); }
+	void set_queue_depth(uint64_t depth)	{ mMapping.get()->queueDepth.store(depth, std::memory_order_relaxed); }
+	void set_bytes_out(uint64_t bytes)		{ mMapping.get()->bytesOut.store(bytes, std::memory_order_relaxed); }
+};
+
+//! \brief Aggregated view of all slots
+struct telemetry_snapshot
+{
+	uint64_t time;			//!< ns since the segment was created
+	uint64_t submitted;
+	uint64_t written;
+	uint64_t dropped;
+	uint64_t merged;
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t queueDepth;
+	uint64_t writeLatency[telemetry_histogram::Buckets];
+	uint64_t sinkLatency[telemetry_histogram::Buckets];
+
+	//! \brief Approximate percentile (0-100) of a merged histogram in nanoseconds
+	static uint64_t percentile(const uint64_t* counts, double p)
+	{
+		uint64_t total = 0;
+		for (auto i = 0u; i < telemetry_histogram::Buckets; ++i)
+			total += counts[i];
+		if (total == 0)
+			return 0;
+		auto target = static_cast<uint64_t>(total * p / 100.0);
+		uint64_t seen = 0;
+		for (auto i = 0u; i < telemetry_histogram::Buckets; ++i)
+		{
+			seen += counts[i];
+			if (seen > target)
+				return telemetry_histogram::value_of(i);
+		}
+		return telemetry_histogram::value_of(telemetry_histogram::Buckets - 1);
+	}
+};
+
+//! \brief Monitor side; maps the segment read-only
+class telemetry_reader
+{
+	telemetry_mapping mMapping;
+public:
+	explicit telemetry_reader(const char* name = "GraphicsRecordTelemetry")
+		: mMapping(name, false)
+	{
+	}
+	void read(telemetry_snapshot& s) const
+	{
+		auto segment = mMapping.get();
+		memset(&s, 0, sizeof(s));
+		s.time = telemetry_mapping::now() - segment->startTime.load(std::memory_order_relaxed);
+		s.queueDepth = segment->queueDepth.load(std::memory_order_relaxed);
+		s.bytesOut = segment->bytesOut.load(std::memory_order_relaxed);
+		for (auto i = 0u; i < telemetry_segment::MaxSlots; ++i)
+		{
+			auto& slot = segment->slots[i];
+			if (!slot.used.load(std::memory_order_acquire))
+				continue;
+			s.submitted += slot.submitted.load(std::memory_order_relaxed);
+			s.written += slot.written.load(std::memory_order_relaxed);
+			s.dropped += slot.dropped.load(std::memory_order_relaxed);
+			s.merged += slot.merged.load(std::memory_order_relaxed);
+			s.bytesIn += slot.bytesIn.load(std::memory_order_relaxed);
+			for (auto b = 0u; b < telemetry_histogram::Buckets; ++b)
+			{
+				s.writeLatency[b] += slot.writeLatency.counts[b].load(std::memory_order_relaxed);
+				s.sinkLatency[b] += slot.sinkLatency.counts[b].load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
@@ -0,0 +1,64 @@
+﻿// CommonTest.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include "check.h"
+
+using namespace std;
+
+vector<test_case>& test_cases()
+{
+	static vector<test_case> cases;
+	return cases;
+}
+
+//! \brief Run checks of Common (or benchmarks with -bench), optionally only the named ones
+int main(int argc, char**argv)
+{
+	auto benchmark = false;
+	vector<const char*> names;
+	for (auto i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-bench") == 0)
+			benchmark = true;
+		else if (strcmp(argv[i], "-list") == 0)
+		{
+			for (auto& t : test_cases())
+				printf("%s%s\n", t.name, t.benchmark ? " (-bench)" : "");
+			return 0;
+		}
+		else
+			names.push_back(argv[i]);
+	}
+	auto run = 0u, failed = 0u;
+	for (auto& t : test_cases())
+	{
+		auto selected = names.empty() ? t.benchmark == benchmark : false;
+		for (auto name : names)
+			selected = selected || strcmp(name, t.name) == 0;
+		if (!selected)
+			continue;
+		++run;
+		auto start = chrono::steady_clock::now();
+		try {
+			t.func();
+			auto ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			printf("ok     %s (%.0f ms)\n", t.name, ms);
+		}
+		catch (exception& e) {
+			++failed;
+			printf("FAILED %s: %s\n", t.name, e.what());
+		}
+		fflush(stdout);
+	}
+	if (run == 0)
+	{
+		fprintf(stderr, "usage: CommonTest [-bench] [-list] [name...]\n");
+		return 1;
+	}
+	printf("%u of %u passed\n", run - failed, run);
+	return failed ? 1 : 0;
+}
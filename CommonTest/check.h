@@ -0,0 +1,147 @@
+// check.h
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//! \brief Thrown by CHECK with the failed expression and its location
+class check_failure : public std::runtime_error
+{
+public:
+	check_failure(const char* expr, const char* file, int line)
+		: std::runtime_error(std::string(file) + "(" + std::to_string(line) + "): " + expr)
+	{
+	}
+};
+
+#define CHECK(expr) ((expr) ? (void)0 : throw check_failure(#expr, __FILE__, __LINE__))
+
+//! \brief One registered check or benchmark
+struct test_case
+{
+	const char* name;
+	bool benchmark;
+	void (*func)();
+};
+
+std::vector<test_case>& test_cases();
+
+struct test_registration
+{
+	test_registration(const char* name, bool benchmark, void (*func)())
+	{
+		test_case t = { name, benchmark, func };
+		test_cases().push_back(t);
+	}
+};
+
+//! \brief Define a check that runs by default
+#define TEST_CASE(name) \
+	static void name(); \
+	static test_registration name##_registration(#name, false, name); \
+	static void name()
+
+//! \brief Define a benchmark that runs with -bench; it prints its measurements
+#define BENCHMARK(name) \
+	static void name(); \
+	static test_registration name##_registration(#name, true, name); \
+	static void name()
+
+//! \brief Milliseconds per call of func, best of repeat runs of count calls
+template<typename Func>
+double measure_ms(unsigned int count, unsigned int repeat, Func func)
+{
+	using clock_type = std::chrono::steady_clock;
+	double best = 0.0;
+	for (auto r = 0u; r < repeat; ++r)
+	{
+		auto start = clock_type::now();
+		for (auto i = 0u; i < count; ++i)
+			func();
+		auto ms = std::chrono::duration<double, std::milli>(clock_type::now() - start).count() / count;
+		if (r == 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+//! \brief Deterministic pseudo-random numbers for synthetic frames
+class test_random
+{
+	uint32_t mState;
+public:
+	explicit test_random(uint32_t seed = 1) : mState(seed ? seed : 1) {}
+	uint32_t next()
+	{
+		mState ^= mState << 13;
+		mState ^= mState >> 17;
+		mState ^= mState << 5;
+		return mState;
+	}
+	unsigned char byte()	{ return static_cast<unsigned char>(next() >> 24); }
+};
+
+//! \brief Synthetic BGRA frames with known content
+namespace synthetic
+{
+	inline void fill(std::vector<char>& frame, unsigned char b, unsigned char g, unsigned char r)
+	{
+		for (size_t i = 0; i + 3 < frame.size(); i += 4)
+		{
+			frame[i] = static_cast<char>(b);
+			frame[i + 1] = static_cast<char>(g);
+			frame[i + 2] = static_cast<char>(r);
+			frame[i + 3] = static_cast<char>(255);
+		}
+	}
+	//! \brief Gray noise; amplitude 0-255 around mid gray
+	inline void noise(std::vector<char>& frame, test_random& random, unsigned int amplitude)
+	{
+		for (size_t i = 0; i + 3 < frame.size(); i += 4)
+		{
+			auto v = static_cast<unsigned char>(128 - amplitude / 2 + random.next() % (amplitude + 1));
+			frame[i] = frame[i + 1] = frame[i + 2] = static_cast<char>(v);
+			frame[i + 3] = static_cast<char>(255);
+		}
+	}
+	//! \brief Random gray blocks of block x block pixels, so the detail survives downsampling
+	inline void blocks(std::vector<char>& frame, unsigned int width, unsigned int height,
+						unsigned int block, test_random& random)
+	{
+		std::vector<unsigned char> values((width + block - 1) / block);
+		for (auto y = 0u; y < height; ++y)
+		{
+			if (y % block == 0)
+			{
+				for (auto& v : values)
+					v = random.byte();
+			}
+			for (auto x = 0u; x < width; ++x)
+			{
+				auto p = &frame[(size_t(y) * width + x) * 4];
+				p[0] = p[1] = p[2] = static_cast<char>(values[x / block]);
+				p[3] = static_cast<char>(255);
+			}
+		}
+	}
+	//! \brief Diagonal stripes of the given period, shifted right by offset pixels
+	inline void stripes(std::vector<char>& frame, unsigned int width, unsigned int height,
+						unsigned int period, unsigned int offset, unsigned char dark, unsigned char light)
+	{
+		for (auto y = 0u; y < height; ++y)
+		{
+			for (auto x = 0u; x < width; ++x)
+			{
+				auto v = ((x + y + period * 1000 - offset) / (period / 2)) % 2 ? light : dark;
+				auto p = &frame[(size_t(y) * width + x) * 4];
+				p[0] = p[1] = p[2] = static_cast<char>(v);
+				p[3] = static_cast<char>(255);
+			}
+		}
+	}
+}
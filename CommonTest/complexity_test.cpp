@@ -0,0 +1,97 @@
+﻿// complexity_test.cpp
+
+#include "check.h"
+#include "../Common/complexity_estimator.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int Width = 320, Height = 240, Frames = 30;
+
+	//! \brief Mean complexity over a sequence; generate(frame, i) fills frame i
+	template<typename Generate>
+	frame_complexity average(worker_pool& pool, Generate generate, unsigned int& bitrate)
+	{
+		complexity_estimator estimator(Width, Height, pool);
+		bitrate_controller controller(bitrate_controller::budget_for(Width, Height, Frames));
+		vector<char> frame(size_t(4) * Width * Height);
+		frame_complexity sum = { 0.0, 0.0, 0.0 };
+		for (auto i = 0u; i < Frames; ++i)
+		{
+			generate(frame, i);
+			auto c = estimator.estimate(frame.data());
+			CHECK(c.temporal >= 0.0 && c.temporal <= 255.0);
+			CHECK(c.spatial >= 0.0 && c.spatial <= 127.5);
+			CHECK(c.score >= 0.0 && c.score <= 1.0);
+			// The first frame has no temporal term.
+			CHECK(i > 0 || c.temporal == 0.0);
+			if (i > 0)
+			{
+				sum.temporal += c.temporal;
+				sum.spatial += c.spatial;
+				sum.score += c.score;
+			}
+			controller.add(c);
+		}
+		sum.temporal /= Frames - 1;
+		sum.spatial /= Frames - 1;
+		sum.score /= Frames - 1;
+		bitrate = controller.bitrate();
+		return sum;
+	}
+}
+
+//! \brief Flat < static detail < slow pan < fast pan < fresh noise every frame, and bitrates follow
+TEST_CASE(complexity_ordering)
+{
+	worker_pool pool;
+	auto budget = bitrate_controller::budget_for(Width, Height, Frames);
+	test_random random;
+	vector<char> still(size_t(4) * Width * Height);
+	synthetic::blocks(still, Width, Height, 8, random);
+
+	unsigned int flatRate, stillRate, slowRate, fastRate, noiseRate;
+	auto flat = average(pool, [](vector<char>& f, unsigned int) { synthetic::fill(f, 90, 90, 90); }, flatRate);
+	auto detail = average(pool, [&](vector<char>& f, unsigned int) { f = still; }, stillRate);
+	auto slow = average(pool, [](vector<char>& f, unsigned int i) { synthetic::stripes(f, Width, Height, 64, i, 40, 200); }, slowRate);
+	auto fast = average(pool, [](vector<char>& f, unsigned int i) { synthetic::stripes(f, Width, Height, 64, 12 * i, 40, 200); }, fastRate);
+	auto noise = average(pool, [&](vector<char>& f, unsigned int) { synthetic::blocks(f, Width, Height, 8, random); }, noiseRate);
+
+	printf("  %-8s temporal spatial score bitrate\n", "");
+	printf("  %-8s %8.2f %7.2f %5.3f %7u\n", "flat", flat.temporal, flat.spatial, flat.score, flatRate);
+	printf("  %-8s %8.2f %7.2f %5.3f %7u\n", "still", detail.temporal, detail.spatial, detail.score, stillRate);
+	printf("  %-8s %8.2f %7.2f %5.3f %7u\n", "slow pan", slow.temporal, slow.spatial, slow.score, slowRate);
+	printf("  %-8s %8.2f %7.2f %5.3f %7u\n", "fast pan", fast.temporal, fast.spatial, fast.score, fastRate);
+	printf("  %-8s %8.2f %7.2f %5.3f %7u\n", "noise", noise.temporal, noise.spatial, noise.score, noiseRate);
+
+	// Flat content has neither term.
+	CHECK(flat.temporal == 0.0 && flat.spatial == 0.0 && flat.score == 0.0);
+	// Static detail has only the spatial term.
+	CHECK(detail.temporal == 0.0 && detail.spatial > 10.0);
+	// Motion raises the temporal term with speed; the stripes' spatial term does not change.
+	CHECK(slow.temporal > 0.0 && fast.temporal > 2.0 * slow.temporal);
+	CHECK(fast.spatial > 0.9 * slow.spatial && fast.spatial < 1.1 * slow.spatial);
+	CHECK(flat.score < detail.score && detail.score < slow.score && slow.score < fast.score && fast.score < noise.score);
+	CHECK(noise.score > 0.8);
+
+	CHECK(flatRate == budget.minBitrate);
+	CHECK(flatRate <= stillRate && stillRate <= slowRate && slowRate <= fastRate && fastRate <= noiseRate);
+	CHECK(noiseRate <= budget.maxBitrate && noiseRate > budget.minBitrate + (budget.maxBitrate - budget.minBitrate) * 8 / 10);
+}
+
+//! \brief Results do not depend on the number of worker threads
+TEST_CASE(complexity_threads)
+{
+	worker_pool single(1), wide(4);
+	complexity_estimator a(Width, Height, single), b(Width, Height, wide);
+	test_random random;
+	vector<char> frame(size_t(4) * Width * Height);
+	for (auto i = 0u; i < 5; ++i)
+	{
+		synthetic::noise(frame, random, 200);
+		auto ca = a.estimate(frame.data());
+		auto cb = b.estimate(frame.data());
+		CHECK(ca.temporal == cb.temporal && ca.spatial == cb.spatial && ca.score == cb.score);
+	}
+}
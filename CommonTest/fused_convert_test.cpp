@@ -0,0 +1,244 @@
+﻿// fused_convert_test.cpp
+
+#include <cstdlib>
+#include "check.h"
+#include "../Common/fused_convert.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int SrcWidth = 1920, SrcHeight = 1080;
+	const unsigned int CropX = 96, CropY = 60, CropWidth = 1600, CropHeight = 900;
+	const unsigned int DstWidth = 1280, DstHeight = 720;
+	const unsigned int OverlayX = 16, OverlayY = 16, OverlayScale = 4;
+	const unsigned char OverlayAlpha = 200;
+	const char* Text = "12:34:56:07";
+
+	fused_convert_desc fused_desc()
+	{
+		fused_convert_desc d = { SrcWidth, SrcHeight, 0, CropX, CropY, CropWidth, CropHeight, DstWidth, DstHeight,
+								yuv_layout::nv12, OverlayX, OverlayY, OverlayScale, OverlayAlpha };
+		return d;
+	}
+
+	//! \brief The same work as one pass per step, each storing a full intermediate frame
+	//! \details Crop, scale and overlay are plain row-parallel loops; the last step is a
+	//!          fused_converter without crop, scale or overlay, so only the data flow differs.
+	class separate_passes
+	{
+		worker_pool& mPool;
+		vector<unsigned char> mCropped;
+		vector<unsigned char> mScaled;
+		vector<unsigned int> mX0, mX1, mY0, mY1;
+		vector<unsigned int> mFx, mFy;
+		vector<unsigned char> mMask;
+		unsigned int mMaskWidth;
+		unsigned int mMaskHeight;
+		fused_converter mConvert;
+
+		static fused_convert_desc convert_desc()
+		{
+			fused_convert_desc d = { DstWidth, DstHeight, 0, 0, 0, 0, 0, DstWidth, DstHeight,
+									yuv_layout::nv12, 0, 0, 0, 0 };
+			return d;
+		}
+		//! \brief Same pixel centers as fused_converter
+		static void taps(unsigned int dst, unsigned int src, vector<unsigned int>& t0,
+						vector<unsigned int>& t1, vector<unsigned int>& f)
+		{
+			for (auto i = 0u; i < dst; ++i)
+			{
+				long long pos = ((2ll * i + 1) * src * 256) / (2ll * dst) - 128;
+				if (pos < 0)
+					pos = 0;
+				auto i0 = static_cast<unsigned int>(pos >> 8);
+				t0.push_back(i0);
+				t1.push_back(i0 + 1 < src ? i0 + 1 : src - 1);
+				f.push_back(i0 + 1 < src ? static_cast<unsigned int>(pos & 0xff) : 0);
+			}
+		}
+		//! \brief Alpha mask of text in the 3x5 font, 4 dots per character
+		void build_mask(const char* text)
+		{
+			static const unsigned char digits[11][5] =
+			{
+				{ 7, 5, 5, 5, 7 }, { 2, 6, 2, 2, 7 }, { 7, 1, 7, 4, 7 }, { 7, 1, 7, 1, 7 },
+				{ 5, 5, 7, 1, 1 }, { 7, 4, 7, 1, 7 }, { 7, 4, 7, 5, 7 }, { 7, 1, 1, 1, 1 },
+				{ 7, 5, 7, 5, 7 }, { 7, 5, 7, 1, 7 }, { 0, 2, 0, 2, 0 },
+			};
+			auto length = static_cast<unsigned int>(strlen(text));
+			mMaskWidth = 4 * length * OverlayScale;
+			mMaskHeight = 5 * OverlayScale;
+			mMask.assign(mMaskWidth * mMaskHeight, 0);
+			for (auto i = 0u; i < length; ++i)
+			{
+				auto g = digits[text[i] == ':' ? 10 : text[i] - '0'];
+				for (auto y = 0u; y < mMaskHeight; ++y)
+				{
+					for (auto dx = 0u; dx < 3 * OverlayScale; ++dx)
+					{
+						if ((g[y / OverlayScale] >> (2 - dx / OverlayScale)) & 1)
+							mMask[y * mMaskWidth + 4 * OverlayScale * i + dx] = OverlayAlpha;
+					}
+				}
+			}
+		}
+	public:
+		explicit separate_passes(worker_pool& pool)
+			: mPool(pool), mCropped(size_t(4) * CropWidth * CropHeight), mScaled(size_t(4) * DstWidth * DstHeight),
+			mConvert(convert_desc(), pool)
+		{
+			taps(DstWidth, CropWidth, mX0, mX1, mFx);
+			taps(DstHeight, CropHeight, mY0, mY1, mFy);
+			build_mask(Text);
+		}
+		void convert(const char* data, char* dest)
+		{
+			auto src = reinterpret_cast<const unsigned char*>(data);
+			mPool.run(CropHeight, 16, [&](unsigned int begin, unsigned int end)
+			{
+				for (auto y = begin; y < end; ++y)
+					memcpy(&mCropped[size_t(4) * CropWidth * y], src + (size_t(SrcWidth) * (CropY + y) + CropX) * 4, 4 * CropWidth);
+			});
+			mPool.run(DstHeight, 16, [&](unsigned int begin, unsigned int end)
+			{
+				for (auto y = begin; y < end; ++y)
+				{
+					auto r0 = &mCropped[size_t(4) * CropWidth * mY0[y]];
+					auto r1 = &mCropped[size_t(4) * CropWidth * mY1[y]];
+					auto d = &mScaled[size_t(4) * DstWidth * y];
+					for (auto x = 0u; x < DstWidth; ++x, d += 4)
+					{
+						auto x0 = 4 * mX0[x], x1 = 4 * mX1[x];
+						for (auto c = 0u; c < 4; ++c)
+						{
+							auto top = r0[x0 + c] * (256 - mFx[x]) + r0[x1 + c] * mFx[x];
+							auto bottom = r1[x0 + c] * (256 - mFx[x]) + r1[x1 + c] * mFx[x];
+							d[c] = static_cast<unsigned char>((top * (256 - mFy[y]) + bottom * mFy[y] + 32768) >> 16);
+						}
+					}
+				}
+			});
+			mPool.run(mMaskHeight, 4, [&](unsigned int begin, unsigned int end)
+			{
+				for (auto y = begin; y < end; ++y)
+				{
+					auto d = &mScaled[(size_t(DstWidth) * (OverlayY + y) + OverlayX) * 4];
+					for (auto x = 0u; x < mMaskWidth; ++x, d += 4)
+					{
+						int a = mMask[y * mMaskWidth + x];
+						for (auto c = 0u; c < 3; ++c)
+							d[c] = static_cast<unsigned char>(d[c] + ((255 - d[c]) * a + 127) / 255);
+					}
+				}
+			});
+			mConvert.convert(reinterpret_cast<const char*>(mScaled.data()), dest);
+		}
+	};
+
+	void make_source(vector<char>& frame)
+	{
+		// Smooth gradients plus a little noise, so scaling and chroma both have something to do.
+		test_random random;
+		for (auto y = 0u; y < SrcHeight; ++y)
+		{
+			for (auto x = 0u; x < SrcWidth; ++x)
+			{
+				auto p = &frame[(size_t(y) * SrcWidth + x) * 4];
+				p[0] = static_cast<char>((x / 8 + random.byte() / 16) & 0xff);
+				p[1] = static_cast<char>((y / 4 + random.byte() / 16) & 0xff);
+				p[2] = static_cast<char>(((x + y) / 12) & 0xff);
+				p[3] = static_cast<char>(255);
+			}
+		}
+	}
+}
+
+//! \brief The fused pass matches crop, scale, overlay and convert run one after another
+TEST_CASE(fused_convert_matches_passes)
+{
+	worker_pool pool;
+	vector<char> source(size_t(4) * SrcWidth * SrcHeight);
+	make_source(source);
+	fused_converter fused(fused_desc(), pool);
+	fused.set_overlay(Text);
+	separate_passes passes(pool);
+	vector<char> a(fused.frame_size()), b(fused.frame_size());
+	fused.convert(source.data(), a.data());
+	passes.convert(source.data(), b.data());
+	auto maxDiff = 0, overlayDiff = 0;
+	uint64_t sumDiff = 0;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		auto d = abs(static_cast<unsigned char>(a[i]) - static_cast<unsigned char>(b[i]));
+		maxDiff = d > maxDiff ? d : maxDiff;
+		sumDiff += d;
+	}
+	// The stamped area really is brighter than its surroundings.
+	for (auto x = 0u; x < 3 * OverlayScale; ++x)
+	{
+		auto d = static_cast<unsigned char>(a[size_t(DstWidth) * OverlayY + OverlayX + x]) -
+			static_cast<unsigned char>(a[size_t(DstWidth) * (OverlayY + 5 * OverlayScale + 4) + OverlayX + x]);
+		overlayDiff = d > overlayDiff ? d : overlayDiff;
+	}
+	printf("  max difference %d, mean %.4f\n", maxDiff, double(sumDiff) / a.size());
+	// The passes round to 8 bits between steps; the fused kernel does not.
+	CHECK(maxDiff <= 2);
+	CHECK(double(sumDiff) / a.size() < 0.5);
+	CHECK(overlayDiff > 60);
+}
+
+//! \brief fused_convert_stage stamps the timecode and passes frame_size() bytes on
+TEST_CASE(fused_convert_stage_timecode)
+{
+	struct capture_sink
+	{
+		vector<char> last;
+		unsigned int count = 0;
+		void write(const char* data, uint64_t)
+		{
+			last.assign(data, data + DstWidth * DstHeight * 3 / 2);
+			++count;
+		}
+	} sink;
+	worker_pool pool;
+	vector<char> source(size_t(4) * SrcWidth * SrcHeight);
+	synthetic::fill(source, 0, 0, 0);
+	fused_converter converter(fused_desc(), pool);
+	fused_convert_stage<capture_sink> stage(sink, converter, true, 25);
+	for (auto i = 0u; i < 26; ++i)
+		stage.write(source.data(), 400000ull);
+	CHECK(sink.count == 26);
+	// The 26th frame at 25 fps is 00:00:01:00; the digit '1' lights the middle column of the 8th character.
+	auto luma = [&](unsigned int x, unsigned int y) { return static_cast<unsigned char>(sink.last[size_t(DstWidth) * y + x]); };
+	auto column = OverlayX + 4 * OverlayScale * 7 + OverlayScale + 1;
+	auto black = luma(DstWidth - 1, DstHeight - 1);
+	CHECK(black == 16);
+	CHECK(luma(column, OverlayY + 2 * OverlayScale) > 150);
+	// '0' has a hole in the middle of the 10th character.
+	CHECK(luma(OverlayX + 4 * OverlayScale * 9 + OverlayScale + 1, OverlayY + 2 * OverlayScale) == black);
+}
+
+//! \brief Time per 1080p frame and bytes moved: fused pass vs. separate passes
+BENCHMARK(fused_convert_bench)
+{
+	worker_pool pool;
+	vector<char> source(size_t(4) * SrcWidth * SrcHeight);
+	make_source(source);
+	fused_converter fused(fused_desc(), pool);
+	fused.set_overlay(Text);
+	separate_passes passes(pool);
+	vector<char> dest(fused.frame_size());
+	auto fusedMs = measure_ms(20, 5, [&] { fused.convert(source.data(), dest.data()); });
+	auto separateMs = measure_ms(20, 5, [&] { passes.convert(source.data(), dest.data()); });
+	// Bytes read plus written per frame, ignoring caches
+	auto crop = 4.0 * CropWidth * CropHeight, scaled = 4.0 * DstWidth * DstHeight, yuv = 1.5 * DstWidth * DstHeight;
+	auto overlay = 2.0 * 4 * (4 * strlen(Text) * OverlayScale) * (5 * OverlayScale);
+	auto fusedMB = (crop + yuv) / 1e6;
+	auto separateMB = (2 * crop + crop + scaled + overlay + scaled + yuv) / 1e6;
+	printf("  %u threads, %ux%u crop %ux%u -> %ux%u NV12 with overlay\n", pool.size(), SrcWidth, SrcHeight,
+		CropWidth, CropHeight, DstWidth, DstHeight);
+	printf("  fused     %6.2f ms/frame  %5.1f MB/frame\n", fusedMs, fusedMB);
+	printf("  separate  %6.2f ms/frame  %5.1f MB/frame\n", separateMs, separateMB);
+}
@@ -0,0 +1,146 @@
+﻿// mp4_test.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <chrono>
+#include <cstdio>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "check.h"
+#include "../Common/mp4_reader.h"
+
+using namespace std;
+
+namespace
+{
+	const char* Mp4Path = "CommonTest_mp4.tmp";
+
+	string be32(uint32_t v)
+	{
+		string s(4, '\0');
+		for (auto i = 0; i < 4; ++i)
+			s[i] = static_cast<char>(v >> (24 - 8 * i));
+		return s;
+	}
+	string box(const char* type, const string& payload)
+	{
+		return be32(static_cast<uint32_t>(8 + payload.size())) + type + payload;
+	}
+	string full_box(const char* type, const string& payload)
+	{
+		return box(type, be32(0) + payload);
+	}
+
+	//! \brief mdat with samples of sampleSize bytes in one chunk, then a moov with one video track
+	//! \param sizeCount, fixedSize  stsz sample count and fixed size (0 lists each size)
+	//! \param timeCount  stts sample count (one run of 1000 ticks)
+	void write_mp4(uint32_t sizeCount, uint32_t fixedSize, uint32_t timeCount, uint32_t samples = 3, uint32_t sampleSize = 10)
+	{
+		auto mdat = box("mdat", string(size_t(sampleSize) * samples, 'x'));
+		string entry(78, '\0');
+		entry[24] = 640 >> 8;
+		entry[25] = 640 & 255;
+		entry[26] = 360 >> 8;
+		entry[27] = 360 & 255;
+		string sizes;
+		if (!fixedSize)
+		{
+			for (auto i = 0u; i < sizeCount; ++i)
+				sizes += be32(sampleSize);
+		}
+		auto stbl = box("stbl",
+			full_box("stsd", be32(1) + box("avc1", entry)) +
+			full_box("stsz", be32(fixedSize) + be32(sizeCount) + sizes) +
+			full_box("stts", be32(1) + be32(timeCount) + be32(1000)) +
+			full_box("stsc", be32(1) + be32(1) + be32(samples) + be32(1)) +
+			full_box("stco", be32(1) + be32(8)));
+		auto mdia = box("mdia",
+			full_box("hdlr", be32(0) + "vide" + string(13, '\0')) +
+			full_box("mdhd", be32(0) + be32(0) + be32(30000) + be32(3000) + be32(0)) +
+			box("minf", stbl));
+		auto file = mdat + box("moov", box("trak", mdia));
+		auto out = fopen(Mp4Path, "wb");
+		CHECK(out != nullptr);
+		CHECK(fwrite(file.data(), 1, file.size(), out) == file.size());
+		fclose(out);
+	}
+
+	bool rejected()
+	{
+		try
+		{
+			mp4_reader reader(Mp4Path);
+		}
+		catch (const runtime_error&)
+		{
+			return true;
+		}
+		return false;
+	}
+}
+
+//! \brief Sample tables of a minimal file expand to per-sample offsets, sizes and times
+TEST_CASE(mp4_sample_tables)
+{
+	write_mp4(3, 0, 3);
+	{
+		mp4_reader reader(Mp4Path);
+		CHECK(reader.sample_count() == 3 && reader.width() == 640 && reader.height() == 360);
+		CHECK(reader.timescale() == 30000 && reader.keyframes().size() == 3);
+		for (auto i = 0u; i < 3; ++i)
+			CHECK(reader.offset(i) == 8 + 10 * i && reader.size(i) == 10 && reader.decode_time(i) == 1000 * i);
+	}
+	write_mp4(3, 10, 3);
+	{
+		mp4_reader reader(Mp4Path);
+		CHECK(reader.sample_count() == 3 && reader.offset(2) == 28 && reader.size(2) == 10);
+	}
+	remove(Mp4Path);
+}
+
+//! \brief A stsz count that disagrees with stts or cannot fit the file is rejected before anything is sized by it
+TEST_CASE(mp4_rejects_sample_count)
+{
+	write_mp4(4, 0, 3);
+	CHECK(rejected());
+	write_mp4(2, 10, 3);
+	CHECK(rejected());
+	// Both tables agree on a billion samples; the fixed size path must not allocate for them.
+	write_mp4(0x40000000, 1, 0x40000000);
+	CHECK(rejected());
+	remove(Mp4Path);
+}
+
+//! \brief Scan throughput of every sample of a 64 MB file with each readahead hint
+//! \details On Linux the file is dropped from the page cache first, so the hint decides the I/O pattern.
+BENCHMARK(mp4_scan_bench)
+{
+	const uint32_t samples = 2048, sampleSize = 32 * 1024;
+	write_mp4(samples, 0, samples, samples, sampleSize);
+	for (auto access : { file_access::sequential, file_access::random })
+	{
+#ifndef _WIN32
+		auto fd = open(Mp4Path, O_RDONLY);
+		CHECK(fd >= 0);
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+#endif
+		auto start = chrono::steady_clock::now();
+		mp4_reader reader(Mp4Path, access);
+		unsigned int sum = 0;
+		for (auto i = 0u; i < reader.sample_count(); ++i)
+		{
+			auto f = reader.frame(i);
+			for (auto j = 0u; j < f.size; j += 64)
+				sum += f.data[j];
+		}
+		auto ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		CHECK(sum == 'x' * (uint64_t(samples) * sampleSize / 64));
+		printf("  %-10s %.1f ms, %.0f MB/s\n", access == file_access::sequential ? "sequential" : "random",
+			ms, double(samples) * sampleSize / (1024 * 1024) / (ms / 1000));
+	}
+	remove(Mp4Path);
+}
@@ -0,0 +1,87 @@
+﻿// preview_test.cpp
+
+#include <atomic>
+#include <thread>
+#include "check.h"
+#include "../Common/preview_tap.h"
+
+using namespace std;
+
+//! \brief The preview is the rounded box average of the source for every factor
+TEST_CASE(preview_downscale_exact)
+{
+	const unsigned int Width = 480, Height = 272;
+	vector<char> frame(size_t(4) * Width * Height);
+	test_random random(11);
+	for (auto& c : frame)
+		c = static_cast<char>(random.byte());
+	// Saturated corners reach the largest sums
+	for (auto i = 0u; i < 4 * 16 * Width; ++i)
+		frame[i] = static_cast<char>(255);
+	for (auto factor = 1u; factor <= 16; ++factor)
+	{
+		preview_publisher publisher("CommonTestPreview", Width, Height, factor);
+		preview_reader reader("CommonTestPreview");
+		publisher.publish(frame.data(), 0, 0);
+		vector<unsigned char> image;
+		preview_view view;
+		CHECK(reader.read(image, view));
+		CHECK(view.width == Width / factor && view.height == Height / factor);
+		auto area = factor * factor;
+		for (auto y = 0u; y < view.height; ++y)
+		{
+			for (auto x = 0u; x < view.width; ++x)
+			{
+				for (auto c = 0u; c < 4; ++c)
+				{
+					unsigned int sum = 0;
+					for (auto j = 0u; j < factor; ++j)
+					{
+						for (auto i = 0u; i < factor; ++i)
+							sum += static_cast<unsigned char>(frame[(size_t(y * factor + j) * Width + x * factor + i) * 4 + c]);
+					}
+					CHECK(image[(size_t(y) * view.width + x) * 4 + c] == (sum + area / 2) / area);
+				}
+			}
+		}
+	}
+}
+
+//! \brief Copies taken while frames are published are never torn, and read() always returns
+TEST_CASE(preview_read_while_publishing)
+{
+	const unsigned int Width = 64, Height = 32;
+	preview_publisher publisher("CommonTestPreview", Width, Height, 1);
+	preview_reader reader("CommonTestPreview");
+	vector<unsigned char> image;
+	preview_view view;
+	CHECK(!reader.read(image, view));
+	atomic<bool> stop(false);
+	thread capture([&]
+	{
+		vector<char> frame(size_t(4) * Width * Height);
+		for (uint64_t f = 0; !stop; ++f)
+		{
+			memset(frame.data(), static_cast<int>(f & 0xff), frame.size());
+			publisher.publish(frame.data(), f, f * 10);
+		}
+	});
+	unsigned int reads = 0, misses = 0;
+	auto start = chrono::steady_clock::now();
+	while (chrono::steady_clock::now() - start < chrono::milliseconds(200))
+	{
+		if (!reader.read(image, view, 2))
+		{
+			++misses;
+			continue;
+		}
+		++reads;
+		CHECK(view.timestamp == view.frame * 10);
+		for (auto v : image)
+			CHECK(v == (view.frame & 0xff));
+	}
+	stop = true;
+	capture.join();
+	printf("  %u consistent copies, %u reads gave up\n", reads, misses);
+	CHECK(reads > 0);
+}
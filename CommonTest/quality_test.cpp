@@ -0,0 +1,131 @@
+﻿// quality_test.cpp
+
+#include <cmath>
+#include "check.h"
+#include "../Common/quality_metric.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int Width = 320, Height = 240;
+
+	//! \brief Plain SSIM over 8x8 luma windows at step 4, the definition quality_meter implements
+	double reference_ssim(const vector<char>& a, const vector<char>& b)
+	{
+		auto luma = [](const vector<char>& f, unsigned int x, unsigned int y)
+		{
+			auto p = reinterpret_cast<const unsigned char*>(&f[(size_t(y) * Width + x) * 4]);
+			return static_cast<double>((29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8);
+		};
+		const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+		double total = 0.0;
+		unsigned int windows = 0;
+		for (auto y = 0u; y + 8 <= Height; y += 4)
+		{
+			for (auto x = 0u; x + 8 <= Width; x += 4, ++windows)
+			{
+				double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+				for (auto j = 0u; j < 8; ++j)
+				{
+					for (auto i = 0u; i < 8; ++i)
+					{
+						auto va = luma(a, x + i, y + j), vb = luma(b, x + i, y + j);
+						sa += va;
+						sb += vb;
+						saa += va * va;
+						sbb += vb * vb;
+						sab += va * vb;
+					}
+				}
+				auto ma = sa / 64, mb = sb / 64;
+				auto var = (saa + sbb) / 64 - ma * ma - mb * mb;
+				auto cov = sab / 64 - ma * mb;
+				total += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (var + c2));
+			}
+		}
+		return total / windows;
+	}
+
+	//! \brief frame plus uniform noise in [-amplitude, amplitude] on B, G and R, clamped
+	void add_noise(const vector<char>& frame, vector<char>& noisy, test_random& random, int amplitude)
+	{
+		noisy = frame;
+		for (size_t i = 0; i < noisy.size(); ++i)
+		{
+			if ((i & 3) == 3)
+				continue;
+			int v = static_cast<unsigned char>(frame[i]) + static_cast<int>(random.next() % (2 * amplitude + 1)) - amplitude;
+			noisy[i] = static_cast<char>(v < 0 ? 0 : v > 255 ? 255 : v);
+		}
+	}
+}
+
+//! \brief A uniform error of 5 gives PSNR 10 log10(255^2 / 25); identical frames give 100 and SSIM 1
+TEST_CASE(quality_known_error)
+{
+	worker_pool pool;
+	quality_meter meter(Width, Height, pool);
+	vector<char> reference(size_t(4) * Width * Height), source(reference.size());
+	synthetic::fill(reference, 100, 120, 140);
+	synthetic::fill(source, 105, 115, 145);
+	auto r = meter.measure(source.data(), reference.data());
+	CHECK(fabs(r.psnr - 10.0 * log10(255.0 * 255.0 / 25.0)) < 1e-9);
+	test_random random(4);
+	synthetic::blocks(reference, Width, Height, 8, random);
+	r = meter.measure(reference.data(), reference.data());
+	CHECK(r.psnr == 100.0 && fabs(r.ssim - 1.0) < 1e-12);
+	CHECK(meter.results().size() == 2);
+}
+
+//! \brief SSIM matches the plain definition and falls as more noise is added
+TEST_CASE(quality_ssim_noise)
+{
+	worker_pool pool;
+	quality_meter meter(Width, Height, pool);
+	vector<char> reference(size_t(4) * Width * Height), noisy;
+	test_random random(8);
+	synthetic::blocks(reference, Width, Height, 8, random);
+	quality_result last = { 101.0, 2.0 };
+	for (auto amplitude : { 2, 8, 24, 64 })
+	{
+		add_noise(reference, noisy, random, amplitude);
+		auto r = meter.measure(noisy.data(), reference.data());
+		printf("  noise +-%-2d psnr %6.2f ssim %.4f\n", amplitude, r.psnr, r.ssim);
+		CHECK(fabs(r.ssim - reference_ssim(noisy, reference)) < 1e-9);
+		CHECK(r.psnr < last.psnr && r.ssim < last.ssim);
+		last = r;
+	}
+}
+
+//! \brief quality_stage measures frames that have a reference and passes every frame on
+TEST_CASE(quality_stage_passes_frames)
+{
+	struct null_sink
+	{
+		unsigned int count = 0;
+		void write(const char*, uint64_t)	{ ++count; }
+	} sink;
+	worker_pool pool;
+	quality_meter meter(Width, Height, pool);
+	vector<char> frame(size_t(4) * Width * Height);
+	synthetic::fill(frame, 1, 2, 3);
+	quality_stage<null_sink> stage(sink, meter, [&](uint64_t i) { return i % 2 ? nullptr : frame.data(); });
+	for (auto i = 0u; i < 6; ++i)
+		stage.write(frame.data(), 333333);
+	CHECK(sink.count == 6 && meter.results().size() == 3);
+}
+
+//! \brief PSNR and SSIM of a 1080p frame pair
+BENCHMARK(quality_bench)
+{
+	const unsigned int W = 1920, H = 1080;
+	worker_pool pool;
+	quality_meter meter(W, H, pool);
+	vector<char> a(size_t(4) * W * H), b;
+	test_random random(2);
+	synthetic::blocks(a, W, H, 8, random);
+	add_noise(a, b, random, 8);
+	auto ms = measure_ms(20, 5, [&] { meter.measure(a.data(), b.data()); });
+	printf("  %u threads, %ux%u: %.2f ms/frame, %.0f frames/s\n", pool.size(), W, H, ms, 1000.0 / ms);
+}
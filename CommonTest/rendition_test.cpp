@@ -0,0 +1,134 @@
+﻿// rendition_test.cpp
+
+#include <atomic>
+#include <cstring>
+#include "check.h"
+#include "../Common/rendition_ladder.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int Width = 1920, Height = 1080;
+	const unsigned int Sizes[3][2] = { { 1280, 720 }, { 640, 360 }, { 320, 180 } };
+
+	//! \brief Smooth gradients, so pyramid and direct scaling agree closely
+	void make_gradient(vector<char>& frame)
+	{
+		for (auto y = 0u; y < Height; ++y)
+		{
+			for (auto x = 0u; x < Width; ++x)
+			{
+				auto p = &frame[(size_t(y) * Width + x) * 4];
+				p[0] = static_cast<char>(x * 255 / Width);
+				p[1] = static_cast<char>(y * 255 / Height);
+				p[2] = static_cast<char>((x + y) * 255 / (Width + Height));
+				p[3] = static_cast<char>(255);
+			}
+		}
+	}
+
+	fused_convert_desc direct_desc(unsigned int width, unsigned int height)
+	{
+		fused_convert_desc d = { Width, Height, 0, 0, 0, 0, 0, width, height, yuv_layout::nv12, 0, 0, 0, 0 };
+		return d;
+	}
+}
+
+//! \brief Each output matches converting the full frame straight to its size
+TEST_CASE(rendition_ladder_outputs)
+{
+	worker_pool pool;
+	vector<char> source(size_t(4) * Width * Height);
+	make_gradient(source);
+	vector<vector<char>> outputs(3);
+	vector<unsigned int> frames(3, 0);
+	vector<rendition> renditions;
+	// Smallest first, to check the ladder sorts them
+	for (auto i = 3u; i-- > 0; )
+	{
+		renditions.push_back({ Sizes[i][0], Sizes[i][1], [&, i](const char* data, uint64_t duration)
+		{
+			CHECK(duration == 333333);
+			outputs[i].assign(data, data + Sizes[i][0] * Sizes[i][1] * 3 / 2);
+			++frames[i];
+		} });
+	}
+	rendition_ladder ladder(Width, Height, renditions, pool);
+	ladder.write(source.data(), 333333);
+	for (auto i = 0u; i < 3; ++i)
+	{
+		CHECK(frames[i] == 1);
+		fused_converter direct(direct_desc(Sizes[i][0], Sizes[i][1]), pool);
+		vector<char> expected(direct.frame_size());
+		direct.convert(source.data(), expected.data());
+		CHECK(outputs[i].size() == expected.size());
+		auto maxDiff = 0;
+		for (size_t j = 0; j < expected.size(); ++j)
+		{
+			auto d = abs(static_cast<unsigned char>(outputs[i][j]) - static_cast<unsigned char>(expected[j]));
+			maxDiff = d > maxDiff ? d : maxDiff;
+		}
+		printf("  %ux%u max difference %d\n", Sizes[i][0], Sizes[i][1], maxDiff);
+		CHECK(maxDiff <= 3);
+	}
+}
+
+//! \brief Sinks may run their own work on the conversion pool
+TEST_CASE(rendition_ladder_sink_uses_pool)
+{
+	worker_pool pool(2);
+	vector<char> source(size_t(4) * Width * Height);
+	make_gradient(source);
+	atomic<unsigned int> rows(0);
+	vector<rendition> renditions;
+	for (auto i = 0u; i < 3; ++i)
+	{
+		renditions.push_back({ Sizes[i][0], Sizes[i][1], [&, i](const char*, uint64_t)
+		{
+			pool.run(Sizes[i][1], 16, [&](unsigned int begin, unsigned int end) { rows += end - begin; });
+		} });
+	}
+	rendition_ladder ladder(Width, Height, renditions, pool);
+	for (auto f = 0u; f < 10; ++f)
+		ladder.write(source.data(), 333333);
+	CHECK(rows == 10u * (720 + 360 + 180));
+}
+
+//! \brief The ladder against one writer per output, each converting its own copy of the full frame
+BENCHMARK(rendition_ladder_bench)
+{
+	worker_pool pool;
+	vector<char> source(size_t(4) * Width * Height);
+	make_gradient(source);
+	vector<rendition> renditions;
+	for (auto i = 0u; i < 3; ++i)
+		renditions.push_back({ Sizes[i][0], Sizes[i][1], [](const char*, uint64_t) {} });
+	rendition_ladder ladder(Width, Height, renditions, pool);
+	vector<unique_ptr<fused_converter>> converters;
+	vector<vector<char>> copies(3, vector<char>(source.size()));
+	vector<vector<char>> outputs(3);
+	for (auto i = 0u; i < 3; ++i)
+	{
+		converters.emplace_back(new fused_converter(direct_desc(Sizes[i][0], Sizes[i][1]), pool));
+		outputs[i].resize(converters[i]->frame_size());
+	}
+	auto ladderMs = measure_ms(10, 5, [&] { ladder.write(source.data(), 333333); });
+	auto separateMs = measure_ms(10, 5, [&]
+	{
+		for (auto i = 0u; i < 3; ++i)
+		{
+			memcpy(copies[i].data(), source.data(), source.size());
+			converters[i]->convert(copies[i].data(), outputs[i].data());
+		}
+	});
+	// Bytes read plus written per frame, ignoring caches
+	auto full = 4.0 * Width * Height;
+	auto l0 = 4.0 * 1280 * 720, l1 = 4.0 * 640 * 360;
+	auto yuv = 1.5 * (1280 * 720 + 640 * 360 + 320 * 180);
+	auto ladderMB = (full + l0 + l0 + l0 + l1 + l1 + l1 + yuv) / 1e6;
+	auto separateMB = (3 * 2 * full + 3 * full + yuv) / 1e6;
+	printf("  %u threads, %ux%u -> 1280x720, 640x360, 320x180 NV12\n", pool.size(), Width, Height);
+	printf("  ladder    %6.2f ms/frame  %5.1f MB/frame\n", ladderMs, ladderMB);
+	printf("  separate  %6.2f ms/frame  %5.1f MB/frame\n", separateMs, separateMB);
+}
@@ -0,0 +1,170 @@
+﻿// reorder_test.cpp
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include "check.h"
+#include "../Common/frame_reorder_buffer.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int FrameSize = 256;
+
+	//! \brief Sink that checks frames arrive in increasing order and intact
+	struct order_sink
+	{
+		vector<uint64_t> sequences;
+		bool intact = true;
+		void write(const char* data, uint64_t duration)
+		{
+			uint64_t sequence;
+			memcpy(&sequence, data, sizeof(sequence));
+			for (auto i = sizeof(sequence); i < FrameSize; ++i)
+				intact = intact && data[i] == static_cast<char>(sequence + i);
+			intact = intact && duration == sequence * 10;
+			sequences.push_back(sequence);
+		}
+		bool ordered() const
+		{
+			for (size_t i = 1; i < sequences.size(); ++i)
+			{
+				if (sequences[i] <= sequences[i - 1])
+					return false;
+			}
+			return true;
+		}
+	};
+
+	void make_frame(vector<char>& frame, uint64_t sequence)
+	{
+		memcpy(frame.data(), &sequence, sizeof(sequence));
+		for (auto i = sizeof(sequence); i < FrameSize; ++i)
+			frame[i] = static_cast<char>(sequence + i);
+	}
+
+	//! \brief Wait up to seconds for pred; a hang is reported as a failed check instead
+	template<typename Pred>
+	bool wait_for(Pred pred, double seconds)
+	{
+		auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+		while (!pred())
+		{
+			if (chrono::steady_clock::now() > deadline)
+				return false;
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		return true;
+	}
+
+	//! \brief Producers submit sequences [first, first + count) round-robin with jitter, except dropped ones
+	void contend(frame_reorder_buffer<order_sink>& buffer, unsigned int producers, uint64_t first, uint64_t count,
+				const set<uint64_t>& dropped)
+	{
+		vector<thread> threads;
+		for (auto p = 0u; p < producers; ++p)
+		{
+			threads.emplace_back([&, p]
+			{
+				test_random random(p + 1);
+				vector<char> frame(FrameSize);
+				for (auto s = first + p; s < first + count; s += producers)
+				{
+					if (dropped.count(s))
+						continue;
+					make_frame(frame, s);
+					buffer.submit(s, frame.data(), s * 10);
+					if (random.next() % 16 == 0)
+						this_thread::yield();
+				}
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+	}
+}
+
+//! \brief Four producers, 20k frames, nothing dropped: all released in order, none late or missing
+TEST_CASE(reorder_contention)
+{
+	order_sink sink;
+	{
+		frame_reorder_buffer<order_sink> buffer(sink, FrameSize, 8, chrono::milliseconds(500));
+		contend(buffer, 4, 0, 20000, set<uint64_t>());
+		buffer.finish();
+		CHECK(buffer.released() == 20000);
+		CHECK(buffer.late() == 0 && buffer.missing() == 0);
+	}
+	CHECK(sink.sequences.size() == 20000 && sink.sequences.back() == 19999);
+	CHECK(sink.ordered() && sink.intact);
+}
+
+//! \brief A single frame capacity frames ahead: the hole before it is skipped after the timeout
+TEST_CASE(reorder_gap_at_start)
+{
+	order_sink sink;
+	frame_reorder_buffer<order_sink> buffer(sink, FrameSize, 4, chrono::milliseconds(10));
+	vector<char> frame(FrameSize);
+	make_frame(frame, 4);
+	atomic<bool> submitted(false);
+	thread producer([&] { buffer.submit(4, frame.data(), 40); submitted = true; });
+	auto released = wait_for([&] { return buffer.released() == 1; }, 5.0);
+	if (!released)
+	{
+		// Unblock the producer so the failure is reported instead of hanging.
+		for (auto s = 0u; s < 4; ++s)
+		{
+			make_frame(frame, s);
+			buffer.submit(s, frame.data(), s * 10);
+		}
+	}
+	producer.join();
+	buffer.finish();
+	CHECK(released && submitted);
+	CHECK(buffer.missing() == 4 && buffer.late() == 0);
+	CHECK(sink.sequences.size() == 1 && sink.sequences[0] == 4 && sink.intact);
+}
+
+//! \brief A stream that starts later than 0 needs no timeout at all
+TEST_CASE(reorder_first_sequence)
+{
+	order_sink sink;
+	{
+		frame_reorder_buffer<order_sink> buffer(sink, FrameSize, 4, chrono::seconds(60), 1000);
+		vector<char> frame(FrameSize);
+		make_frame(frame, 999);
+		CHECK(!buffer.submit(999, frame.data(), 9990));
+		contend(buffer, 2, 1000, 100, set<uint64_t>());
+		CHECK(wait_for([&] { return buffer.released() == 100; }, 5.0));
+		buffer.finish();
+		CHECK(buffer.late() == 1 && buffer.missing() == 0);
+	}
+	CHECK(sink.sequences.size() == 100 && sink.sequences[0] == 1000);
+	CHECK(sink.ordered() && sink.intact);
+}
+
+//! \brief Four producers with single drops and a run of drops longer than the capacity
+TEST_CASE(reorder_contention_gaps)
+{
+	set<uint64_t> dropped;
+	for (uint64_t s = 500; s < 520; ++s)
+		dropped.insert(s);
+	for (uint64_t s = 1000; s < 5000; s += 997)
+		dropped.insert(s);
+	order_sink sink;
+	{
+		frame_reorder_buffer<order_sink> buffer(sink, FrameSize, 8, chrono::milliseconds(2));
+		thread run([&] { contend(buffer, 4, 0, 5000, dropped); });
+		auto done = wait_for([&] { return buffer.released() + buffer.missing() == 5000; }, 10.0);
+		run.join();
+		buffer.finish();
+		CHECK(done);
+		CHECK(buffer.released() == 5000 - dropped.size());
+		CHECK(buffer.missing() == dropped.size() && buffer.late() == 0);
+	}
+	CHECK(sink.ordered() && sink.intact);
+	for (auto s : sink.sequences)
+		CHECK(dropped.count(s) == 0);
+}
@@ -0,0 +1,213 @@
+﻿// scene_cut_test.cpp
+
+#include <algorithm>
+#include "check.h"
+#include "../Common/complexity_estimator.h"
+#include "../Common/scene_cut_detector.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int Width = 320, Height = 240, Frames = 160;
+	const unsigned int Pan = 1024;	// Extra world width for panning
+
+	//! \brief A wide image that frames are cropped from
+	struct world
+	{
+		vector<char> data;
+		world() : data(size_t(4) * (Width + Pan) * Height) {}
+		//! \brief Scale gray levels into [low, low + range)
+		void remap(unsigned int low, unsigned int range)
+		{
+			for (size_t i = 0; i + 3 < data.size(); i += 4)
+			{
+				auto v = static_cast<char>(low + static_cast<unsigned char>(data[i]) * range / 256);
+				data[i] = data[i + 1] = data[i + 2] = v;
+			}
+		}
+		void crop(vector<char>& frame, unsigned int x, unsigned int percent = 100) const
+		{
+			for (auto y = 0u; y < Height; ++y)
+			{
+				auto src = &data[(size_t(y) * (Width + Pan) + x) * 4];
+				auto dest = &frame[size_t(y) * Width * 4];
+				for (auto i = 0u; i < 4 * Width; ++i)
+					dest[i] = static_cast<char>((i & 3) == 3 ? 255 : static_cast<unsigned char>(src[i]) * percent / 100);
+			}
+		}
+	};
+
+	//! \brief Four scenes with hard cuts at 40, 80 and 120, and in-scene motion and a fade that are not cuts
+	class cut_sequence
+	{
+		world mA, mB, mC, mD;
+	public:
+		cut_sequence()
+		{
+			test_random a(1), c(3), d(9);
+			synthetic::blocks(mA.data, Width + Pan, Height, 16, a);		// Slow pan
+			synthetic::stripes(mB.data, Width + Pan, Height, 32, 0, 40, 220);	// Fast pan
+			synthetic::blocks(mC.data, Width + Pan, Height, 16, c);		// Dark, fading in
+			mC.remap(0, 128);
+			synthetic::blocks(mD.data, Width + Pan, Height, 4, d);		// Light, fine detail
+			mD.remap(128, 128);
+		}
+		static vector<unsigned int> cuts()	{ return { 40, 80, 120 }; }
+		void make(vector<char>& frame, unsigned int i) const
+		{
+			if (i < 40)
+				mA.crop(frame, 2 * i);
+			else if (i < 80)
+				mB.crop(frame, 24 * (i - 40));
+			else if (i < 120)
+				mC.crop(frame, i - 80, 40 + 60 * (i - 80) / 39);
+			else
+				mD.crop(frame, i - 120);
+		}
+	};
+}
+
+//! \brief Exactly the hard cuts fire; fast motion and a fade do not
+TEST_CASE(scene_cut_known_cuts)
+{
+	worker_pool pool;
+	cut_sequence sequence;
+	scene_cut_detector detector(Width, Height, pool);
+	vector<char> frame(size_t(4) * Width * Height);
+	vector<unsigned int> found;
+	double quietHistogram = 0.0, quietSad = 0.0;
+	for (auto i = 0u; i < Frames; ++i)
+	{
+		sequence.make(frame, i);
+		auto r = detector.detect(frame.data());
+		if (r.cut)
+			found.push_back(i);
+		else
+		{
+			quietHistogram = max(quietHistogram, r.histogram);
+			quietSad = max(quietSad, r.sad);
+		}
+	}
+	printf("  cuts at");
+	for (auto f : found)
+		printf(" %u", f);
+	printf(", largest non-cut histogram %.3f, SAD %.1f\n", quietHistogram, quietSad);
+	CHECK(found == cut_sequence::cuts());
+}
+
+//! \brief The chapter list and keyframe requests follow the detected cuts
+TEST_CASE(scene_cut_stage_chapters)
+{
+	struct null_sink
+	{
+		unsigned int count = 0;
+		void write(const char*, uint64_t)	{ ++count; }
+	} sink;
+	worker_pool pool;
+	cut_sequence sequence;
+	scene_cut_detector detector(Width, Height, pool);
+	vector<unsigned int> keyframes;
+	unsigned int written = 0;
+	scene_cut_stage<null_sink> stage(sink, detector, [&] { keyframes.push_back(written); });
+	vector<char> frame(size_t(4) * Width * Height);
+	for (auto i = 0u; i < Frames; ++i, ++written)
+	{
+		sequence.make(frame, i);
+		stage.write(frame.data(), 400000);
+	}
+	CHECK(sink.count == Frames && keyframes == cut_sequence::cuts());
+	CHECK(stage.cuts().size() == 3 && stage.cuts()[0] == 40 * 400000ull && stage.cuts()[2] == 120 * 400000ull);
+}
+
+//! \brief Analyzers on a shared plane give the same results as ones that downsample for themselves
+TEST_CASE(luma_plane_shared)
+{
+	worker_pool pool;
+	cut_sequence sequence;
+	luma_plane luma(Width, Height, pool);
+	scene_cut_detector ownDetector(Width, Height, pool), sharedDetector(luma, pool);
+	complexity_estimator ownEstimator(Width, Height, pool), sharedEstimator(luma, pool);
+	vector<char> frame(size_t(4) * Width * Height);
+	for (auto i = 0u; i < Frames; ++i)
+	{
+		sequence.make(frame, i);
+		luma.build(frame.data());
+		auto a = ownDetector.detect(frame.data());
+		auto b = sharedDetector.detect(frame.data());
+		CHECK(a.histogram == b.histogram && a.sad == b.sad && a.cut == b.cut);
+		auto c = ownEstimator.estimate(frame.data());
+		auto d = sharedEstimator.estimate(frame.data());
+		CHECK(c.temporal == d.temporal && c.spatial == d.spatial && c.score == d.score);
+	}
+	// The plane must have been built for the frame being analyzed
+	vector<char> other(frame);
+	auto threw = false;
+	try {
+		sharedDetector.detect(other.data());
+	}
+	catch (runtime_error&) {
+		threw = true;
+	}
+	CHECK(threw);
+}
+
+//! \brief Each small pixel is the rounded BT.601 luma mean of its 4x4 block
+TEST_CASE(luma_plane_values)
+{
+	worker_pool pool;
+	vector<char> frame(size_t(4) * Width * Height);
+	test_random random(5);
+	for (auto& c : frame)
+		c = static_cast<char>(random.byte());
+	luma_plane luma(Width, Height, pool);
+	luma.build(frame.data());
+	CHECK(luma.width() == Width / 4 && luma.height() == Height / 4 && luma.source() == frame.data());
+	for (auto y = 0u; y < luma.height(); ++y)
+	{
+		for (auto x = 0u; x < luma.width(); ++x)
+		{
+			unsigned int sum = 0;
+			for (auto j = 0u; j < 4; ++j)
+			{
+				for (auto i = 0u; i < 4; ++i)
+				{
+					auto p = reinterpret_cast<const unsigned char*>(&frame[((4 * y + j) * Width + 4 * x + i) * 4]);
+					sum += 29 * p[0] + 150 * p[1] + 77 * p[2];
+				}
+			}
+			CHECK(luma.row(y)[x] == (sum + 2048) >> 12);
+		}
+	}
+}
+
+//! \brief Complexity plus scene cuts per frame, each downsampling for itself against one shared plane
+BENCHMARK(luma_plane_bench)
+{
+	const unsigned int W = 1920, H = 1080;
+	worker_pool pool;
+	vector<char> frame(size_t(4) * W * H);
+	test_random random(3);
+	synthetic::blocks(frame, W, H, 8, random);
+	scene_cut_detector ownDetector(W, H, pool);
+	complexity_estimator ownEstimator(W, H, pool);
+	luma_plane luma(W, H, pool);
+	scene_cut_detector sharedDetector(luma, pool);
+	complexity_estimator sharedEstimator(luma, pool);
+	auto detectMs = measure_ms(50, 5, [&] { ownDetector.detect(frame.data()); });
+	auto separateMs = measure_ms(50, 5, [&]
+	{
+		ownEstimator.estimate(frame.data());
+		ownDetector.detect(frame.data());
+	});
+	auto sharedMs = measure_ms(50, 5, [&]
+	{
+		luma.build(frame.data());
+		sharedEstimator.estimate(frame.data());
+		sharedDetector.detect(frame.data());
+	});
+	printf("  %u threads, %ux%u BGRA\n", pool.size(), W, H);
+	printf("  scene cuts alone      %6.3f ms/frame  %6.0f frames/s\n", detectMs, 1000.0 / detectMs);
+	printf("  separate planes       %6.3f ms/frame\n", separateMs);
+	printf("  shared plane          %6.3f ms/frame\n", sharedMs);
+}
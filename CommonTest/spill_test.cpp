@@ -0,0 +1,359 @@
+﻿// spill_test.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+#include <csignal>
+#include <sys/wait.h>
+#endif
+#include "check.h"
+#include "../Common/spill_file.h"
+
+using namespace std;
+
+namespace
+{
+	const char* SpillPath = "CommonTest_spill.tmp";
+	const char* CopyPath = "CommonTest_spill_copy.tmp";
+
+	//! \brief Static blocks with a box moving right, so delta frames compress
+	class moving_box
+	{
+		unsigned int mWidth;
+		unsigned int mHeight;
+		vector<char> mBackground;
+	public:
+		moving_box(unsigned int width, unsigned int height)
+			: mWidth(width), mHeight(height), mBackground(size_t(4) * width * height)
+		{
+			test_random random(7);
+			synthetic::blocks(mBackground, width, height, 8, random);
+		}
+		void make(vector<char>& frame, unsigned int f) const
+		{
+			frame = mBackground;
+			auto size = mHeight / 4;
+			auto x0 = f * 8 % (mWidth - size);
+			for (auto y = size; y < 2 * size; ++y)
+			{
+				for (auto x = x0; x < x0 + size; ++x)
+				{
+					auto p = &frame[(size_t(y) * mWidth + x) * 4];
+					p[0] = static_cast<char>(f);
+					p[1] = static_cast<char>(255 - f);
+					p[2] = static_cast<char>(x ^ y);
+				}
+			}
+		}
+	};
+
+	vector<char> read_file(const char* path)
+	{
+		vector<char> data;
+		auto in = fopen(path, "rb");
+		CHECK(in != nullptr);
+		char buffer[65536];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+			data.insert(data.end(), buffer, buffer + n);
+		fclose(in);
+		return data;
+	}
+
+	void write_file(const char* path, const vector<char>& data)
+	{
+		auto out = fopen(path, "wb");
+		CHECK(out != nullptr);
+		if (!data.empty())
+			CHECK(fwrite(data.data(), 1, data.size(), out) == data.size());
+		fclose(out);
+	}
+
+	//! \brief Every frame of the spill file up to count matches the generator
+	void check_frames(spill_reader& reader, const moving_box& source, uint64_t count)
+	{
+		vector<char> expected;
+		for (uint64_t i = 0; i < count; ++i)
+		{
+			source.make(expected, static_cast<unsigned int>(i));
+			auto frame = reader.frame(i);
+			CHECK(frame != nullptr && memcmp(frame, expected.data(), expected.size()) == 0);
+			CHECK(reader.timestamp(i) == i * 333333 && reader.duration(i) == 333333);
+		}
+	}
+
+	struct counting_sink
+	{
+		uint64_t count = 0;
+		void write(const char*, uint64_t)	{ ++count; }
+	};
+}
+
+//! \brief required_capacity holds exactly the frames asked for, including the index
+TEST_CASE(spill_required_capacity)
+{
+	const unsigned int sizes[] = { 1, 4 * 640 * 360, 4 * 320 * 180 + 3 };
+	const unsigned int counts[] = { 1, 210, 57 };
+	for (auto i = 0u; i < 3; ++i)
+	{
+		vector<char> frame(sizes[i], 1);
+		{
+			spill_writer writer(SpillPath, sizes[i], spill_writer::required_capacity(counts[i], sizes[i]));
+			for (auto f = 0u; f < counts[i]; ++f)
+				CHECK(writer.write(frame.data(), 333333));
+			// Tiny files are rounded up to the minimum capacity, which has room to spare.
+			if (sizes[i] >= spill_header::Alignment)
+				CHECK(!writer.write(frame.data(), 333333));
+		}
+		spill_reader reader(SpillPath);
+		CHECK(reader.count() == counts[i] && reader.closed());
+	}
+	remove(SpillPath);
+}
+
+//! \brief Raw and compressed frames read back unchanged
+TEST_CASE(spill_roundtrip)
+{
+	const unsigned int Width = 256, Height = 64, Frames = 40;
+	moving_box source(Width, Height);
+	worker_pool pool(2);
+	vector<char> frame;
+	for (auto compressed = 0; compressed < 2; ++compressed)
+	{
+		uint64_t stored;
+		{
+			spill_writer writer(SpillPath, 4 * Width * Height, spill_writer::required_capacity(Frames, 4 * Width * Height),
+								compressed ? &pool : nullptr, 16);
+			for (auto f = 0u; f < Frames; ++f)
+			{
+				source.make(frame, f);
+				CHECK(writer.write(frame.data(), 333333));
+			}
+			stored = writer.bytes_stored();
+		}
+		printf("  %s: %llu bytes stored for %u frames of %u bytes\n", compressed ? "compressed" : "raw",
+			static_cast<unsigned long long>(stored), Frames, 4 * Width * Height);
+		spill_reader reader(SpillPath);
+		CHECK(reader.count() == Frames && reader.closed());
+		check_frames(reader, source, Frames);
+		counting_sink sink;
+		CHECK(reader.drain(sink) == Frames && sink.count == Frames);
+	}
+	remove(SpillPath);
+}
+
+//! \brief A file that was never closed, as left by a crash, drains up to the first damage
+//! \details The file is copied while the writer still has it open, which is what the disk
+//!          holds if the process dies at that point; copies are then torn in two places.
+TEST_CASE(spill_crash_recovery)
+{
+	const unsigned int Width = 256, Height = 64, Frames = 20;
+	moving_box source(Width, Height);
+	worker_pool pool(2);
+	vector<char> frame, image;
+	{
+		spill_writer writer(SpillPath, 4 * Width * Height, spill_writer::required_capacity(64, 4 * Width * Height), &pool, 8);
+		for (auto f = 0u; f < Frames; ++f)
+		{
+			source.make(frame, f);
+			CHECK(writer.write(frame.data(), 333333));
+			if (f == 9)
+				writer.sync();
+		}
+		image = read_file(SpillPath);
+	}
+	auto header = reinterpret_cast<const spill_header*>(image.data());
+	CHECK(header->closed == 0);
+	{
+		write_file(CopyPath, image);
+		spill_reader reader(CopyPath);
+		CHECK(reader.count() == Frames && !reader.closed());
+		check_frames(reader, source, Frames);
+	}
+	auto entry = [&](unsigned int i)
+	{
+		return reinterpret_cast<spill_entry*>(&image[header->indexOffset + i * sizeof(spill_entry)]);
+	};
+	{
+		// A torn frame: the index is intact, the data checksum is not
+		auto damaged = image;
+		damaged[entry(13)->offset + entry(13)->size / 2] ^= 0x55;
+		write_file(CopyPath, damaged);
+		spill_reader reader(CopyPath);
+		CHECK(reader.count() == Frames);
+		check_frames(reader, source, 13);
+		CHECK(reader.frame(13) == nullptr);
+		counting_sink sink;
+		CHECK(reader.drain(sink) == 13);
+	}
+	{
+		// A torn index entry ends the index
+		auto damaged = image;
+		reinterpret_cast<spill_entry*>(&damaged[header->indexOffset + 15 * sizeof(spill_entry)])->timestamp ^= 1;
+		write_file(CopyPath, damaged);
+		spill_reader reader(CopyPath);
+		CHECK(reader.count() == 15);
+		counting_sink sink;
+		CHECK(reader.drain(sink) == 15);
+	}
+	remove(CopyPath);
+	remove(SpillPath);
+}
+
+//! \brief Compressed frames whose payload disagrees with the frame size are rejected, not decoded
+//! \details The entries are resealed after each change, so only the payload checks can catch them.
+TEST_CASE(spill_malformed_frame)
+{
+	const unsigned int Width = 256, Height = 64, Frames = 4, FrameSize = 4 * Width * Height + 2;
+	moving_box source(Width, Height);
+	worker_pool pool(2);
+	vector<char> frame, image;
+	{
+		spill_writer writer(SpillPath, FrameSize, spill_writer::required_capacity(Frames, FrameSize), &pool, 4);
+		for (auto f = 0u; f < Frames; ++f)
+		{
+			source.make(frame, f);
+			frame.resize(FrameSize, 'z');
+			CHECK(writer.write(frame.data(), 333333));
+		}
+	}
+	image = read_file(SpillPath);
+	auto header = reinterpret_cast<const spill_header*>(image.data());
+	auto entry = [&](vector<char>& file, unsigned int i)
+	{
+		return reinterpret_cast<spill_entry*>(&file[header->indexOffset + i * sizeof(spill_entry)]);
+	};
+	auto reseal = [](vector<char>& file, spill_entry* e)
+	{
+		e->checksum = spill_checksum(spill_sum(reinterpret_cast<const unsigned char*>(&file[e->offset]), e->size), e->size);
+		e->check = e->compute_check();
+	};
+	auto i = 0u;
+	while (i < Frames && !(entry(image, i)->flags & spill_entry::Compressed))
+		++i;
+	CHECK(i < Frames);
+	{
+		spill_reader reader(SpillPath);
+		CHECK(reader.count() == Frames && reader.frame(i) != nullptr && memcmp(reader.frame(i) + FrameSize - 2, "zz", 2) == 0);
+	}
+	{
+		// No tiles: nothing would cover the frame's words
+		auto damaged = image;
+		auto e = entry(damaged, i);
+		*reinterpret_cast<uint32_t*>(&damaged[e->offset]) = 0;
+		reseal(damaged, e);
+		write_file(CopyPath, damaged);
+		spill_reader reader(CopyPath);
+		CHECK(reader.count() == Frames && reader.frame(i) == nullptr);
+	}
+	{
+		// The tail bytes cut off: the payload ends before them
+		auto damaged = image;
+		auto e = entry(damaged, i);
+		e->size -= 2;
+		reseal(damaged, e);
+		write_file(CopyPath, damaged);
+		spill_reader reader(CopyPath);
+		CHECK(reader.count() == Frames && reader.frame(i) == nullptr);
+	}
+	remove(CopyPath);
+	remove(SpillPath);
+}
+
+#ifndef _WIN32
+//! \brief Failing to open a spill file releases the descriptor it got so far
+TEST_CASE(spill_failed_open_releases)
+{
+	write_file(SpillPath, vector<char>());
+	auto probe = [] { auto fd = dup(0); close(fd); return fd; };
+	auto before = probe();
+	for (auto i = 0; i < 10; ++i)
+	{
+		auto failed = false;
+		try {
+			spill_reader reader(SpillPath);
+		}
+		catch (runtime_error&) {
+			failed = true;
+		}
+		CHECK(failed);
+	}
+	// Leaked descriptors would take the lowest free numbers.
+	CHECK(probe() == before);
+	remove(SpillPath);
+}
+
+//! \brief A writer process killed mid-capture leaves a file that drains in full
+TEST_CASE(spill_killed_writer)
+{
+	const unsigned int Width = 256, Height = 64, Frames = 30;
+	moving_box source(Width, Height);
+	auto child = fork();
+	CHECK(child >= 0);
+	if (child == 0)
+	{
+		worker_pool pool(2);
+		spill_writer writer(SpillPath, 4 * Width * Height, spill_writer::required_capacity(64, 4 * Width * Height), &pool, 8);
+		vector<char> frame;
+		for (auto f = 0u; f < Frames; ++f)
+		{
+			source.make(frame, f);
+			writer.write(frame.data(), 333333);
+			if (f == 19)
+				writer.sync();
+		}
+		raise(SIGKILL);
+	}
+	int status = 0;
+	CHECK(waitpid(child, &status, 0) == child && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+	{
+		spill_reader reader(SpillPath);
+		CHECK(!reader.closed());
+		// Synced frames survive anything; the rest survive a process crash through the page cache.
+		CHECK(reader.count() == Frames);
+		check_frames(reader, source, Frames);
+	}
+	remove(SpillPath);
+}
+#endif
+
+//! \brief Capture and drain rates for 1080p frames, raw and compressed
+BENCHMARK(spill_throughput)
+{
+	const unsigned int Width = 1920, Height = 1080, Frames = 60;
+	const auto frameSize = 4u * Width * Height;
+	moving_box source(Width, Height);
+	vector<vector<char>> frames(8);
+	for (auto f = 0u; f < frames.size(); ++f)
+		source.make(frames[f], f);
+	worker_pool pool;
+	using clock_type = chrono::steady_clock;
+	for (auto compressed = 0; compressed < 2; ++compressed)
+	{
+		uint64_t stored;
+		auto start = clock_type::now();
+		{
+			spill_writer writer(SpillPath, frameSize, spill_writer::required_capacity(Frames, frameSize),
+								compressed ? &pool : nullptr);
+			for (auto f = 0u; f < Frames; ++f)
+				CHECK(writer.write(frames[f % frames.size()].data(), 333333));
+			stored = writer.bytes_stored();
+		}
+		auto writeMs = chrono::duration<double, milli>(clock_type::now() - start).count();
+		start = clock_type::now();
+		counting_sink sink;
+		{
+			spill_reader reader(SpillPath);
+			CHECK(reader.drain(sink) == Frames);
+		}
+		auto drainMs = chrono::duration<double, milli>(clock_type::now() - start).count();
+		auto mb = double(frameSize) * Frames / 1e6;
+		printf("  %-10s capture %6.2f ms/frame %7.1f MB/s, drain %6.2f ms/frame %7.1f MB/s, %5.1f%% stored\n",
+			compressed ? "compressed" : "raw", writeMs / Frames, mb / writeMs * 1e3, drainMs / Frames,
+			mb / drainMs * 1e3, 100.0 * stored / (double(frameSize) * Frames));
+	}
+	printf("  %u threads, %ux%u, %u frames, including close and its sync\n", pool.size(), Width, Height, Frames);
+	remove(SpillPath);
+}
@@ -0,0 +1,224 @@
+﻿// telemetry_test.cpp
+
+#include <thread>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include "check.h"
+#include "../Common/frame_reorder_buffer.h"
+#include "../Common/temporal_accumulator.h"
+#include "../Common/writer_telemetry.h"
+
+using namespace std;
+
+namespace
+{
+	uint64_t total(const uint64_t* counts)
+	{
+		uint64_t sum = 0;
+		for (auto i = 0u; i < telemetry_histogram::Buckets; ++i)
+			sum += counts[i];
+		return sum;
+	}
+
+	struct null_sink
+	{
+		unsigned int count = 0;
+		void write(const char*, uint64_t)	{ ++count; }
+	};
+}
+
+//! \brief Each bucket's lower bound is within one sub-bucket (12.5%) below the value
+TEST_CASE(telemetry_histogram_buckets)
+{
+	for (uint64_t ns = 1; ns < (1ull << 40); ns = ns * 3 / 2 + 1)
+	{
+		auto b = telemetry_histogram::bucket_of(ns);
+		auto low = telemetry_histogram::value_of(b);
+		CHECK(b < telemetry_histogram::Buckets);
+		CHECK(low <= ns && ns - low <= ns / 8);
+		CHECK(b + 1 == telemetry_histogram::Buckets || telemetry_histogram::value_of(b + 1) > ns);
+	}
+}
+
+//! \brief One thread switching between two instances keeps one slot in each
+TEST_CASE(telemetry_alternating_instances)
+{
+	auto a = new writer_telemetry("CommonTestTelemetryA");
+	auto b = new writer_telemetry("CommonTestTelemetryB");
+	for (auto i = 0u; i < 100; ++i)
+	{
+		a->add_submitted();
+		b->add_submitted(2);
+	}
+	auto s = new telemetry_snapshot;
+	telemetry_reader ra("CommonTestTelemetryA"), rb("CommonTestTelemetryB");
+	ra.read(*s);
+	CHECK(s->submitted == 100);
+	rb.read(*s);
+	CHECK(s->submitted == 200);
+	delete s;
+	delete b;
+	delete a;
+}
+
+//! \brief Counters and histograms from several threads add up in the reader
+TEST_CASE(telemetry_threads_aggregate)
+{
+	writer_telemetry telemetry("CommonTestTelemetry");
+	vector<thread> threads;
+	for (auto t = 0u; t < 4; ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			for (auto i = 0u; i < 10000; ++i)
+			{
+				telemetry.add_written();
+				telemetry.add_bytes(100);
+				telemetry.record_write(1000 * (t + 1));
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	telemetry.set_queue_depth(3);
+	auto s = new telemetry_snapshot;
+	telemetry_reader reader("CommonTestTelemetry");
+	reader.read(*s);
+	CHECK(s->written == 40000 && s->bytesIn == 4000000 && s->queueDepth == 3);
+	CHECK(total(s->writeLatency) == 40000 && total(s->sinkLatency) == 0);
+	CHECK(telemetry_snapshot::percentile(s->writeLatency, 10.0) <= 1000);
+	CHECK(telemetry_snapshot::percentile(s->writeLatency, 99.0) > 3500);
+	delete s;
+}
+
+//! \brief Threads beyond the slot count share the overflow slot instead of failing
+TEST_CASE(telemetry_slot_overflow)
+{
+	writer_telemetry telemetry("CommonTestTelemetry");
+	const unsigned int Threads = 3 * telemetry_segment::MaxSlots;
+	vector<thread> threads;
+	for (auto t = 0u; t < Threads; ++t)
+	{
+		threads.emplace_back([&]
+		{
+			for (auto i = 0u; i < 1000; ++i)
+			{
+				telemetry.add_written();
+				telemetry.record_write(1000);
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	auto s = new telemetry_snapshot;
+	telemetry_reader reader("CommonTestTelemetry");
+	reader.read(*s);
+	CHECK(s->written == Threads * 1000 && total(s->writeLatency) == Threads * 1000);
+	delete s;
+}
+
+//! \brief A second publisher under a name in use is rejected and leaves the first one intact
+TEST_CASE(telemetry_duplicate_name)
+{
+	{
+		writer_telemetry telemetry("CommonTestTelemetry");
+		telemetry.add_submitted(5);
+		auto rejected = false;
+		try
+		{
+			writer_telemetry duplicate("CommonTestTelemetry");
+		}
+		catch (const runtime_error&)
+		{
+			rejected = true;
+		}
+		CHECK(rejected);
+		auto s = new telemetry_snapshot;
+		telemetry_reader reader("CommonTestTelemetry");
+		reader.read(*s);
+		CHECK(s->submitted == 5);
+		delete s;
+	}
+	writer_telemetry again("CommonTestTelemetry");
+	again.add_submitted();
+}
+
+#ifndef _WIN32
+//! \brief A segment left behind by a recorder that died without cleaning up is taken over
+TEST_CASE(telemetry_stale_segment)
+{
+	auto child = fork();
+	if (child == 0)
+	{
+		new writer_telemetry("CommonTestTelemetry");
+		_exit(0);
+	}
+	CHECK(child > 0);
+	int status = 0;
+	CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status));
+	writer_telemetry telemetry("CommonTestTelemetry");
+	telemetry.add_submitted();
+}
+#endif
+
+//! \brief frame_reorder_buffer reports late and skipped frames as dropped; accumulation reports merged sub-frames
+TEST_CASE(telemetry_stage_wiring)
+{
+	writer_telemetry telemetry("CommonTestTelemetry");
+	null_sink sink;
+	{
+		frame_reorder_buffer<null_sink> buffer(sink, 16, 4, chrono::milliseconds(5));
+		buffer.set_telemetry(&telemetry);
+		char frame[16] = {};
+		buffer.submit(0, frame, 1);
+		buffer.submit(2, frame, 1);		// 1 is skipped after the timeout
+		while (buffer.released() < 2)
+			this_thread::sleep_for(chrono::milliseconds(1));
+		buffer.submit(1, frame, 1);		// Late
+		buffer.finish();
+	}
+	worker_pool pool(1);
+	temporal_accumulator accumulator(16, 4, temporal_accumulator::box(4), pool);
+	temporal_accumulation_stage<null_sink> blur(sink, accumulator);
+	blur.set_telemetry(&telemetry);
+	vector<char> frame(4 * 16 * 4);
+	for (auto i = 0u; i < 8; ++i)
+		blur.write(frame.data(), 1);
+	auto s = new telemetry_snapshot;
+	telemetry_reader reader("CommonTestTelemetry");
+	reader.read(*s);
+	CHECK(s->dropped == 2 && s->queueDepth == 0);
+	CHECK(s->merged == 6 && sink.count == 4);
+	delete s;
+}
+
+//! \brief Cost of the hooks movie_writer::write calls per frame, without the two clock reads
+//! \details Expect well under 100 ns per frame in an optimized build: a few relaxed load/store
+//!          pairs on the thread's own cache lines.
+BENCHMARK(telemetry_overhead)
+{
+	writer_telemetry telemetry("CommonTestTelemetry");
+	const unsigned int Frames = 1000000;
+	uint64_t ns = 1000;
+	auto hooks = measure_ms(1, 5, [&]
+	{
+		for (auto i = 0u; i < Frames; ++i)
+		{
+			telemetry.add_submitted();
+			telemetry.record_sink(ns);
+			telemetry.record_write(ns + 50);
+			telemetry.add_written();
+			telemetry.add_bytes(4 * 640 * 480);
+			ns = ns * 33 % 1000003;
+		}
+	}) * 1e6 / Frames;
+	volatile uint64_t sink = 0;
+	auto clock = measure_ms(1, 5, [&]
+	{
+		for (auto i = 0u; i < Frames; ++i)
+			sink = sink + writer_telemetry::now();
+	}) * 1e6 / Frames;
+	printf("  %.1f ns per frame for the counters and histograms, %.1f ns per clock read\n", hooks, clock);
+}
@@ -0,0 +1,108 @@
+﻿// temporal_test.cpp
+
+#include <functional>
+#include "check.h"
+#include "../Common/temporal_accumulator.h"
+
+using namespace std;
+
+namespace
+{
+	const unsigned int Width = 64, Height = 32;
+
+	struct frame_sink
+	{
+		vector<char> frame;
+		uint64_t duration = 0;
+		unsigned int count = 0;
+		void write(const char* data, uint64_t d)
+		{
+			frame.assign(data, data + 4 * Width * Height);
+			duration = d;
+			++count;
+		}
+	};
+
+	bool throws(function<void()> func)
+	{
+		try {
+			func();
+		}
+		catch (runtime_error&) {
+			return true;
+		}
+		return false;
+	}
+}
+
+//! \brief Equal weights give the rounded mean of the sub-frames
+TEST_CASE(temporal_box_average)
+{
+	worker_pool pool(2);
+	temporal_accumulator accumulator(Width, Height, temporal_accumulator::box(4), pool);
+	vector<char> frame(4 * Width * Height);
+	const char* result = nullptr;
+	for (auto i = 0u; i < 4; ++i)
+	{
+		CHECK(result == nullptr && accumulator.needed());
+		synthetic::fill(frame, static_cast<unsigned char>(10 * (i + 1)), 200, static_cast<unsigned char>(i));
+		result = accumulator.add(frame.data());
+	}
+	CHECK(result != nullptr);
+	for (size_t i = 0; i < frame.size(); i += 4)
+	{
+		CHECK(static_cast<unsigned char>(result[i]) == 25 && static_cast<unsigned char>(result[i + 1]) == 200);
+		CHECK(static_cast<unsigned char>(result[i + 2]) == 2 && static_cast<unsigned char>(result[i + 3]) == 255);
+	}
+}
+
+//! \brief Under a 180 degree shutter the closed half is not read and may be nullptr
+TEST_CASE(temporal_shutter_skips_closed)
+{
+	worker_pool pool(2);
+	temporal_accumulator accumulator(Width, Height, temporal_accumulator::shutter(8, 180.0), pool);
+	CHECK(accumulator.subframes() == 8 && accumulator.weighted_subframes() == 4);
+	frame_sink sink;
+	temporal_accumulation_stage<frame_sink> stage(sink, accumulator);
+	writer_telemetry telemetry("CommonTestTemporal");
+	stage.set_telemetry(&telemetry);
+	vector<char> frame(4 * Width * Height);
+	for (auto i = 0u; i < 8; ++i)
+	{
+		CHECK(stage.needed() == (i < 4));
+		synthetic::fill(frame, static_cast<unsigned char>(40 * i), 0, 0);
+		stage.write(stage.needed() ? frame.data() : nullptr, 1000 + i);
+	}
+	CHECK(sink.count == 1 && sink.duration == 8 * 1000 + 28);
+	// (0 + 40 + 80 + 120) / 4
+	CHECK(static_cast<unsigned char>(sink.frame[0]) == 60);
+	auto s = new telemetry_snapshot;
+	telemetry_reader reader("CommonTestTemporal");
+	reader.read(*s);
+	CHECK(s->merged == 3);
+	delete s;
+	// A weighted sub-frame must not be missing
+	CHECK(accumulator.needed() && throws([&] { accumulator.add(nullptr); }));
+}
+
+//! \brief Weights that would quantize to 0 are rejected instead of silently dropped
+TEST_CASE(temporal_rejects_lost_subframes)
+{
+	worker_pool pool(1);
+	CHECK(!throws([&] { temporal_accumulator(Width, Height, temporal_accumulator::box(256), pool); }));
+	CHECK(throws([&] { temporal_accumulator(Width, Height, temporal_accumulator::box(257), pool); }));
+	CHECK(throws([&] { temporal_accumulator(Width, Height, temporal_accumulator::shutter(300, 90.0), pool); }));
+	CHECK(throws([&] { temporal_accumulator(Width, Height, vector<double>{ 1000.0, 1.0 }, pool); }));
+	CHECK(throws([&] { temporal_accumulator(Width, Height, vector<double>{ 0.0, 0.0 }, pool); }));
+	CHECK(!throws([&] { temporal_accumulator(Width, Height, vector<double>{ 100.0, 1.0, 0.0 }, pool); }));
+}
+
+//! \brief Sub-frame durations add up to exactly one second
+TEST_CASE(temporal_clock_durations)
+{
+	fixed_timestep_clock clock(30, 7);
+	uint64_t total = 0;
+	for (auto i = 0u; i < 30 * 7; ++i, clock.advance())
+		total += clock.subframe_duration();
+	CHECK(total == 10000000 && clock.frame() == 30 && clock.time() == 1.0);
+}
@@ -22,6 +22,14 @@ using namespace DirectX;
 #include <mfidl.h>
 #include <mfreadwrite.h>
 #include <Mferror.h>
+#include <codecapi.h>
+#include "../Common/complexity_estimator.h"
+#include "../Common/fused_convert.h"
+#include "../Common/luma_plane.h"
+#include "../Common/preview_tap.h"
+#include "../Common/scene_cut_detector.h"
+#include "../Common/temporal_accumulator.h"
+#include "../Common/writer_telemetry.h"
 
 #pragma comment(lib, "Shlwapi.lib")
 #pragma comment(lib, "Mfplat.lib")
@@ -94,11 +102,34 @@ class movie_writer
 
 	com_ptr<IMFMediaBuffer> mBuffer;
 	UINT64 mTotalTime = 0;
+	writer_telemetry* mTelemetry = nullptr;
+	unsigned int mFrameCount = 0;
+	bool mForceKeyframe = false;
+
+	//! \brief Set an ICodecAPI property of the encoder; fails when the encoder does not support it
+	HRESULT try_set_codec_value(const GUID& api, ULONG value)
+	{
+		com_ptr<ICodecAPI> codec;
+		auto hr = mSinkWriter->GetServiceForStream(mStreamIndex, GUID_NULL, __uuidof(ICodecAPI), reinterpret_cast<LPVOID*>(&codec.get()));
+		if (FAILED(hr))
+			return hr;
+		VARIANT var;
+		VariantInit(&var);
+		var.vt = VT_UI4;
+		var.ulVal = value;
+		return codec->SetValue(&api, &var);
+	}
+	void set_codec_value(const GUID& api, ULONG value)
+	{
+		CHK(try_set_codec_value(api, value));
+	}
 public:
 	movie_writer(const TCHAR* path,
 				unsigned int width,
 				unsigned int height,
-				unsigned int frameRate)
+				unsigned int frameRate,
+				unsigned int bitrate = 1 * 1024 * 1024,
+				const GUID& inputFormat = MFVideoFormat_RGB32)
 	{
 		CHK(CoInitialize(nullptr));
 		CHK(MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET));
@@ -111,7 +142,7 @@ public:
 		CHK(MFCreateMediaType(&mOutputType.get()));
 		CHK(mOutputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
 		CHK(mOutputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
-		CHK(mOutputType->SetUINT32(MF_MT_AVG_BITRATE, 1 * 1024 * 1024));
+		CHK(mOutputType->SetUINT32(MF_MT_AVG_BITRATE, bitrate));
 		CHK(mOutputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
 		CHK(MFSetAttributeSize(mOutputType.get(), MF_MT_FRAME_SIZE, width, height));
 		CHK(MFSetAttributeRatio(mOutputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
@@ -120,22 +151,37 @@ public:
 		mOutputType.release();
 		CHK(MFCreateMediaType(&mInputType.get()));
 		CHK(mInputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
-		CHK(mInputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_RGB32));
+		CHK(mInputType->SetGUID(MF_MT_SUBTYPE, inputFormat));
 		CHK(mInputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
 		CHK(MFSetAttributeSize(mInputType.get(), MF_MT_FRAME_SIZE, width, height));
 		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
 		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
 		CHK(mSinkWriter->SetInputMediaType(mStreamIndex, mInputType.get(), nullptr));
 		mInputType.release();
-		mFrameSize = 4 * width * height;
+		// NV12 and I420 (e.g. from fused_converter) are 12 bits per pixel.
+		if (inputFormat == MFVideoFormat_NV12 || inputFormat == MFVideoFormat_I420)
+			mFrameSize = width * height * 3 / 2;
+		else
+			mFrameSize = 4 * width * height;
 		CHK(MFCreateMemoryBuffer(mFrameSize, &mBuffer.get()));
 		CHK(mSinkWriter->BeginWriting());
 	}
 	~movie_writer()
 	{
 	}
+	//! \brief Publish counters and latencies of write() (nullptr to stop)
+	void set_telemetry(writer_telemetry* telemetry)
+	{
+		mTelemetry = telemetry;
+	}
 	void write(const char* data, UINT64 duration)
 	{
+		UINT64 start = 0;
+		if (mTelemetry)
+		{
+			start = writer_telemetry::now();
+			mTelemetry->add_submitted();
+		}
 		mBuffer.release();
 		CHK(MFCreateMemoryBuffer(mFrameSize, &mBuffer.get()));
 		BYTE* destPtr;
@@ -161,7 +207,41 @@ public:
 		CHK(sample->SetSampleTime(mTotalTime));
 		CHK(sample->SetSampleDuration(duration));
 		mTotalTime += duration;
+		if (mForceKeyframe)
+		{
+			// The encoder applies this to the next input it processes. A synchronous software
+			// encoder has consumed every earlier sample, so that is this one. An asynchronous
+			// hardware MFT may still hold queued input, and the keyframe can then come early.
+			// Forcing is a hint: an encoder without ForceKeyFrame keeps its own GOP rather than failing the write.
+			try_set_codec_value(CODECAPI_AVEncVideoForceKeyFrame, 1);
+			mForceKeyframe = false;
+		}
+		UINT64 sinkStart = mTelemetry ? writer_telemetry::now() : 0;
 		CHK(mSinkWriter->WriteSample(mStreamIndex, sample.get()));
+		if (mTelemetry)
+		{
+			auto end = writer_telemetry::now();
+			mTelemetry->record_sink(end - sinkStart);
+			mTelemetry->record_write(end - start);
+			mTelemetry->add_written();
+			mTelemetry->add_bytes(mFrameSize);
+			if ((++mFrameCount & 15) == 0)
+			{
+				MF_SINK_WRITER_STATISTICS stats = { sizeof(stats) };
+				if (SUCCEEDED(mSinkWriter->GetStatistics(mStreamIndex, &stats)))
+					mTelemetry->set_bytes_out(stats.qwByteCountProcessed);
+			}
+		}
+	}
+	//! \brief Change the encoder bitrate from the next frame
+	void set_bitrate(unsigned int bitrate)
+	{
+		set_codec_value(CODECAPI_AVEncCommonMeanBitRate, bitrate);
+	}
+	//! \brief Request a keyframe at the next written frame; exact with a synchronous encoder (see write())
+	void force_keyframe()
+	{
+		mForceKeyframe = true;
 	}
 	void finalize()
 	{
@@ -226,7 +306,7 @@ HRESULT InitWindow( HINSTANCE hInstance, int nCmdShow );
 HRESULT InitDevice();
 void CleanupDevice();
 LRESULT CALLBACK    WndProc( HWND, UINT, WPARAM, LPARAM );
-void Render();
+void Render( float t );
 
 
 //--------------------------------------------------------------------------------------
@@ -250,10 +330,39 @@ int WINAPI wWinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdL
     // Main message loop
     MSG msg = {0};
 	{
-		timeBeginPeriod(1);
-		DWORD prevTime = GetTickCount();
-
-		movie_writer mw(L"d3d11movie.mp4", 640, 480, 30);
+		// Step 8 sub-frames per output frame on a fixed timestep and average them with a
+		// 180 degree shutter, so the same movie comes out no matter how fast rendering is.
+		// Only the 4 sub-frames the open shutter sees are rendered and read back.
+		const unsigned int frameRate = 30;
+		const unsigned int subframes = 8;
+		fixed_timestep_clock clock(frameRate, subframes);
+
+		worker_pool pool;
+		auto budget = bitrate_controller::budget_for(640, 480, frameRate);
+		movie_writer mw(L"d3d11movie.mp4", 640, 480, frameRate, budget.maxBitrate, MFVideoFormat_NV12);
+		// Timecode in the top-left corner, stamped while converting to NV12 in the same pass
+		fused_convert_desc desc = { 640, 480, 0, 0, 0, 0, 0, 640, 480, yuv_layout::nv12, 8, 8, 2, 192 };
+		fused_converter converter(desc, pool);
+		fused_convert_stage<movie_writer> convert(mw, converter, true, frameRate);
+		// Complexity and scene cuts share one downsampled luma plane per frame.
+		luma_plane luma(640, 480, pool);
+		complexity_estimator estimator(luma, pool);
+		bitrate_controller controller(budget);
+		complexity_stage<fused_convert_stage<movie_writer>> stage(convert, estimator, controller,
+			[&](unsigned int bitrate) { mw.set_bitrate(bitrate); });
+		scene_cut_detector detector(luma, pool);
+		scene_cut_stage<complexity_stage<fused_convert_stage<movie_writer>>> cuts(stage, detector,
+			[&]() { mw.force_keyframe(); }, "d3d11movie_chapters.txt");
+		// Every 3rd frame at half size, for PreviewViewer
+		preview_publisher preview("GraphicsRecordPreview", 640, 480, 2);
+		luma_plane_stage<scene_cut_stage<complexity_stage<fused_convert_stage<movie_writer>>>> analyze(cuts, luma);
+		preview_tap_stage<luma_plane_stage<scene_cut_stage<complexity_stage<fused_convert_stage<movie_writer>>>>> tap(analyze, preview, 3);
+		temporal_accumulator accumulator(640, 480, temporal_accumulator::shutter(subframes, 180.0), pool);
+		temporal_accumulation_stage<preview_tap_stage<luma_plane_stage<scene_cut_stage<complexity_stage<fused_convert_stage<movie_writer>>>>>> blur(tap, accumulator);
+		// Live counters and latencies for WriterMonitor
+		writer_telemetry telemetry;
+		mw.set_telemetry(&telemetry);
+		blur.set_telemetry(&telemetry);
 		while( WM_QUIT != msg.message )
 		{
 			if( PeekMessage( &msg, NULL, 0, 0, PM_REMOVE ) )
@@ -263,25 +372,25 @@ int WINAPI wWinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdL
 			}
 			else
 			{
-				Render();
-
-				DWORD currentTime = GetTickCount();
-				DWORD step = currentTime - prevTime;
-				if (step > 33)
+				if (blur.needed())
 				{
-					if (step > 1000)
-						step = 1000; // Avoid very long frame
+					Render( static_cast<float>( clock.time() ) );
+
 					g_pImmediateContext->CopyResource(g_StagingBackBuffer, g_DisplayBackBuffer);
 					D3D11_MAPPED_SUBRESOURCE res;
 					CHK(g_pImmediateContext->Map(g_StagingBackBuffer, 0, D3D11_MAP_READ, 0, &res));
-					mw.write((char*)res.pData, 10000 * step); // FIXME: Consider "pitch"
+					blur.write((char*)res.pData, clock.subframe_duration()); // FIXME: Consider "pitch"
 					g_pImmediateContext->Unmap(g_StagingBackBuffer, 0);
-					prevTime = currentTime;
 				}
+				else
+				{
+					// Closed shutter: the time still passes, but nothing is drawn.
+					blur.write(nullptr, clock.subframe_duration());
+				}
+				clock.advance();
 			}
 		}
 		mw.finalize();
-		timeEndPeriod(1);
 	}
 	MFShutdown();
 
@@ -680,23 +789,8 @@ LRESULT CALLBACK WndProc( HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam
 //--------------------------------------------------------------------------------------
 // Render a frame
 //--------------------------------------------------------------------------------------
-void Render()
+void Render( float t )
 {
-    // Update our time
-    static float t = 0.0f;
-    if( g_driverType == D3D_DRIVER_TYPE_REFERENCE )
-    {
-        t += ( float )XM_PI * 0.0125f;
-    }
-    else
-    {
-        static DWORD dwTimeStart = 0;
-        DWORD dwTimeCur = GetTickCount();
-        if( dwTimeStart == 0 )
-            dwTimeStart = dwTimeCur;
-        t = ( dwTimeCur - dwTimeStart ) / 1000.0f;
-    }
-
     // 1st Cube: Rotate around the origin
 	g_World1 = XMMatrixRotationY( t );
 
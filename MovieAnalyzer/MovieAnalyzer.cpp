@@ -0,0 +1,301 @@
+﻿// MovieAnalyzer.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../Common/mp4_reader.h"
+#include "../Common/worker_pool.h"
+
+using namespace std;
+
+//! \brief Per-frame statistics
+struct frame_stat
+{
+	uint32_t size;
+	uint64_t decodeTime;
+	uint64_t presentationTime;
+	bool keyframe;
+	char sliceType;		// 'I', 'P', 'B', or '?' when no slice was found
+	uint8_t nalCount;
+};
+
+//! \brief Exp-Golomb reader over the head of a NAL unit, skipping emulation prevention bytes
+class bit_reader
+{
+	const unsigned char* mData;
+	uint32_t mSize;
+	uint32_t mByte = 0;
+	uint32_t mBit = 0;
+	uint32_t mZeros = 0;
+public:
+	bit_reader(const unsigned char* data, uint32_t size)
+		: mData(data), mSize(size)
+	{
+	}
+	int bit()
+	{
+		if (mByte >= mSize)
+			return -1;
+		if (mBit == 0)
+		{
+			if (mZeros >= 2 && mData[mByte] == 3)
+			{
+				mZeros = 0;
+				if (++mByte >= mSize)
+					return -1;
+			}
+			mZeros = mData[mByte] == 0 ? mZeros + 1 : 0;
+		}
+		int b = (mData[mByte] >> (7 - mBit)) & 1;
+		if (++mBit == 8)
+		{
+			mBit = 0;
+			++mByte;
+		}
+		return b;
+	}
+	//! \return -1 on truncated data
+	long long ue()
+	{
+		int zeros = 0;
+		for (;;)
+		{
+			auto b = bit();
+			if (b < 0 || zeros > 31)
+				return -1;
+			if (b)
+				break;
+			++zeros;
+		}
+		long long value = 1;
+		for (auto i = 0; i < zeros; ++i)
+		{
+			auto b = bit();
+			if (b < 0)
+				return -1;
+			value = (value << 1) | b;
+		}
+		return value - 1;
+	}
+};
+
+//! \brief Walk the NAL headers of one sample
+static void scan_frame(const mp4_frame& f, uint32_t lengthSize, frame_stat& s)
+{
+	static const char sliceTypes[] = { 'P', 'B', 'I', 'P', 'I' };	// P, B, I, SP, SI
+	s.size = f.size;
+	s.decodeTime = f.decodeTime;
+	s.presentationTime = f.presentationTime;
+	s.keyframe = f.keyframe;
+	s.sliceType = '?';
+	s.nalCount = 0;
+	uint32_t pos = 0;
+	while (pos + lengthSize <= f.size)
+	{
+		uint32_t length = 0;
+		for (auto i = 0u; i < lengthSize; ++i)
+			length = (length << 8) | f.data[pos + i];
+		pos += lengthSize;
+		if (length == 0 || length > f.size - pos)
+			break;
+		if (s.nalCount < 255)
+			++s.nalCount;
+		auto type = f.data[pos] & 0x1f;
+		if (s.sliceType == '?' && (type == 1 || type == 5))
+		{
+			// Only first_mb_in_slice and slice_type are needed; a few bytes are enough.
+			bit_reader br(f.data + pos + 1, length - 1 < 16 ? length - 1 : 16);
+			br.ue();
+			auto sliceType = br.ue();
+			if (sliceType >= 0)
+				s.sliceType = sliceTypes[sliceType % 5];
+		}
+		pos += length;
+	}
+}
+
+struct summary
+{
+	double seconds;
+	uint64_t bytes;
+	double averageBitrate;
+	double maxWindowBitrate;
+	double minWindowBitrate;
+	unsigned int frames[3];		// I, P, B
+	unsigned int gopCount;
+	unsigned int gopMin;
+	unsigned int gopMax;
+	double gopAverage;
+	double frameInterval;		// Mean decode time delta in ms
+	double jitterStdDev;		// ms
+	double jitterMax;			// Max |delta - mean| in ms
+};
+
+static int usage()
+{
+	printf("Usage: MovieAnalyzer <movie.mp4> [-csv frames.csv] [-json summary.json] [-window seconds]\n");
+	return 1;
+}
+
+int main(int argc, char**argv)
+{
+	if (argc < 2)
+		return usage();
+	const char* csvPath = nullptr;
+	const char* jsonPath = nullptr;
+	double window = 1.0;
+	for (auto i = 2; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-csv") == 0)
+			csvPath = argv[i + 1];
+		else if (strcmp(argv[i], "-json") == 0)
+			jsonPath = argv[i + 1];
+		else if (strcmp(argv[i], "-window") == 0)
+		{
+			// The window divides the bitrate, so 0 or garbage would print inf into the JSON.
+			char* end;
+			window = strtod(argv[i + 1], &end);
+			if (end == argv[i + 1] || *end || !(window >= 0.001 && window <= 86400.0))
+			{
+				fprintf(stderr, "-window must be a number of seconds from 0.001 to 86400.\n");
+				return usage();
+			}
+		}
+	}
+	try {
+		mp4_reader reader(argv[1]);
+		auto count = reader.sample_count();
+		auto timescale = double(reader.timescale());
+		vector<frame_stat> stats(count);
+
+		// Samples are independent, so chunks of the sample table are scanned in parallel.
+		// Only the first bytes of each NAL are touched, not the slice data.
+		worker_pool pool;
+		auto lengthSize = reader.nal_length_size();
+		pool.run(count, 1024, [&](unsigned int begin, unsigned int end)
+		{
+			for (auto i = begin; i < end; ++i)
+				scan_frame(reader.frame(i), lengthSize, stats[i]);
+		});
+
+		summary sum;
+		memset(&sum, 0, sizeof(sum));
+		vector<double> instant(count), windowed(count);
+		for (auto i = 0u; i < count; ++i)
+		{
+			sum.bytes += stats[i].size;
+			auto duration = i + 1 < count ? stats[i + 1].decodeTime - stats[i].decodeTime
+										: (reader.duration() > stats[i].decodeTime ? reader.duration() - stats[i].decodeTime : 0);
+			instant[i] = duration ? stats[i].size * 8.0 * timescale / duration : 0.0;
+			switch (stats[i].sliceType)
+			{
+			case 'I': ++sum.frames[0]; break;
+			case 'P': ++sum.frames[1]; break;
+			case 'B': ++sum.frames[2]; break;
+			}
+		}
+		sum.seconds = reader.duration() / timescale;
+		sum.averageBitrate = sum.seconds > 0.0 ? sum.bytes * 8.0 / sum.seconds : 0.0;
+
+		// Trailing window bitrate with two pointers
+		auto windowTicks = static_cast<uint64_t>(window * timescale);
+		uint64_t windowBytes = 0;
+		sum.minWindowBitrate = count ? 1e300 : 0.0;
+		for (uint32_t head = 0, tail = 0; head < count; ++head)
+		{
+			windowBytes += stats[head].size;
+			while (stats[head].decodeTime - stats[tail].decodeTime >= windowTicks && tail < head)
+				windowBytes -= stats[tail++].size;
+			windowed[head] = windowBytes * 8.0 / window;
+			// Windows that are not full yet are not counted as minimum.
+			if (stats[head].decodeTime >= windowTicks)
+				sum.minWindowBitrate = windowed[head] < sum.minWindowBitrate ? windowed[head] : sum.minWindowBitrate;
+			sum.maxWindowBitrate = windowed[head] > sum.maxWindowBitrate ? windowed[head] : sum.maxWindowBitrate;
+		}
+		if (sum.minWindowBitrate > 1e299)
+			sum.minWindowBitrate = 0.0;
+
+		auto& keys = reader.keyframes();
+		sum.gopCount = static_cast<unsigned int>(keys.size());
+		sum.gopMin = ~0u;
+		for (size_t k = 0; k < keys.size(); ++k)
+		{
+			auto length = (k + 1 < keys.size() ? keys[k + 1] : count) - keys[k];
+			sum.gopMin = length < sum.gopMin ? length : sum.gopMin;
+			sum.gopMax = length > sum.gopMax ? length : sum.gopMax;
+		}
+		if (keys.empty())
+			sum.gopMin = 0;
+		else
+			sum.gopAverage = double(count - keys[0]) / keys.size();
+
+		if (count > 1)
+		{
+			double mean = double(stats[count - 1].decodeTime - stats[0].decodeTime) / (count - 1);
+			double square = 0.0;
+			for (auto i = 1u; i < count; ++i)
+			{
+				double d = double(stats[i].decodeTime - stats[i - 1].decodeTime) - mean;
+				square += d * d;
+				sum.jitterMax = fabs(d) > sum.jitterMax ? fabs(d) : sum.jitterMax;
+			}
+			sum.frameInterval = mean * 1000.0 / timescale;
+			sum.jitterStdDev = sqrt(square / (count - 1)) * 1000.0 / timescale;
+			sum.jitterMax *= 1000.0 / timescale;
+		}
+
+		if (csvPath)
+		{
+			auto csv = fopen(csvPath, "w");
+			if (!csv)
+				throw runtime_error("Cannot open CSV output.");
+			fprintf(csv, "frame,dts,pts,bytes,type,keyframe,nals,bitrate,window_bitrate\n");
+			for (auto i = 0u; i < count; ++i)
+			{
+				auto& s = stats[i];
+				fprintf(csv, "%u,%.6f,%.6f,%u,%c,%d,%u,%.0f,%.0f\n", i, s.decodeTime / timescale, s.presentationTime / timescale,
+					s.size, s.sliceType, s.keyframe ? 1 : 0, s.nalCount, instant[i], windowed[i]);
+			}
+			fclose(csv);
+		}
+
+		string gop;
+		for (size_t k = 0; k < keys.size(); ++k)
+			gop += (k ? "," : "") + to_string((k + 1 < keys.size() ? keys[k + 1] : count) - keys[k]);
+		if (jsonPath)
+		{
+			auto json = fopen(jsonPath, "w");
+			if (!json)
+				throw runtime_error("Cannot open JSON output.");
+			fprintf(json, "{\n");
+			fprintf(json, "  \"width\": %u, \"height\": %u,\n", reader.width(), reader.height());
+			fprintf(json, "  \"frames\": %u, \"seconds\": %.6f, \"bytes\": %llu,\n", count, sum.seconds, static_cast<unsigned long long>(sum.bytes));
+			fprintf(json, "  \"bitrate\": { \"average\": %.0f, \"window_seconds\": %g, \"window_min\": %.0f, \"window_max\": %.0f },\n",
+				sum.averageBitrate, window, sum.minWindowBitrate, sum.maxWindowBitrate);
+			fprintf(json, "  \"frame_types\": { \"I\": %u, \"P\": %u, \"B\": %u },\n", sum.frames[0], sum.frames[1], sum.frames[2]);
+			fprintf(json, "  \"gop\": { \"count\": %u, \"min\": %u, \"max\": %u, \"average\": %.2f, \"lengths\": [%s] },\n",
+				sum.gopCount, sum.gopMin, sum.gopMax, sum.gopAverage, gop.c_str());
+			fprintf(json, "  \"timestamps\": { \"interval_ms\": %.4f, \"jitter_stddev_ms\": %.4f, \"jitter_max_ms\": %.4f }\n",
+				sum.frameInterval, sum.jitterStdDev, sum.jitterMax);
+			fprintf(json, "}\n");
+			fclose(json);
+		}
+
+		printf("%ux%u, %u frames, %.3f sec, %llu bytes\n", reader.width(), reader.height(), count, sum.seconds,
+			static_cast<unsigned long long>(sum.bytes));
+		printf("bitrate: average %.0f bps, %gs window %.0f - %.0f bps\n", sum.averageBitrate, window, sum.minWindowBitrate, sum.maxWindowBitrate);
+		printf("frames: I %u, P %u, B %u\n", sum.frames[0], sum.frames[1], sum.frames[2]);
+		printf("gop: %u, length %u - %u (average %.2f): %s\n", sum.gopCount, sum.gopMin, sum.gopMax, sum.gopAverage, gop.c_str());
+		printf("timestamps: interval %.4f ms, jitter stddev %.4f ms, max %.4f ms\n", sum.frameInterval, sum.jitterStdDev, sum.jitterMax);
+	}
+	catch (exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
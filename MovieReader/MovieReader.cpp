@@ -0,0 +1,166 @@
+﻿// MovieReader.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../Common/mp4_reader.h"
+
+using namespace std;
+
+//! \brief Write length-prefixed NAL units as an Annex-B byte stream
+static void write_annexb(FILE* out, const unsigned char* data, uint32_t size, uint32_t lengthSize)
+{
+	static const unsigned char startCode[] = { 0, 0, 0, 1 };
+	uint32_t pos = 0;
+	while (pos + lengthSize <= size)
+	{
+		uint32_t length = 0;
+		for (auto i = 0u; i < lengthSize; ++i)
+			length = (length << 8) | data[pos + i];
+		pos += lengthSize;
+		if (length > size - pos)
+			throw runtime_error("Broken NAL length.");
+		fwrite(startCode, 1, 4, out);
+		fwrite(data + pos, 1, length, out);
+		pos += length;
+	}
+}
+
+//! \brief Write SPS and PPS from avcC as an Annex-B byte stream
+static void write_parameter_sets(FILE* out, const unsigned char* config, uint32_t size)
+{
+	static const unsigned char startCode[] = { 0, 0, 0, 1 };
+	uint32_t pos = 5;
+	for (auto set = 0; set < 2; ++set)
+	{
+		if (pos >= size)
+			throw runtime_error("Broken avcC.");
+		auto count = set == 0 ? config[pos] & 0x1f : config[pos];
+		++pos;
+		for (auto i = 0; i < count; ++i)
+		{
+			if (pos + 2 > size)
+				throw runtime_error("Broken avcC.");
+			uint32_t length = (config[pos] << 8) | config[pos + 1];
+			pos += 2;
+			if (length > size - pos)
+				throw runtime_error("Broken avcC.");
+			fwrite(startCode, 1, 4, out);
+			fwrite(config + pos, 1, length, out);
+			pos += length;
+		}
+	}
+}
+
+static void require(bool condition, const string& message)
+{
+	if (!condition)
+		throw runtime_error(message);
+}
+
+//! \brief Check the sample count, the keyframe list and that every sample and lookup is consistent
+static void self_check(const mp4_reader& reader, uint32_t samples, const vector<uint32_t>& keyframes)
+{
+	require(reader.sample_count() == samples,
+		"Expected " + to_string(samples) + " samples, found " + to_string(reader.sample_count()) + ".");
+	require(reader.keyframes() == keyframes, "Keyframes differ from the expected list.");
+	for (auto i = 0u; i < samples; ++i)
+	{
+		auto f = reader.frame(i);
+		auto at = "Sample " + to_string(i) + ": ";
+		require(reader.offset(i) + f.size <= reader.file_size(), at + "data is past the end of the file.");
+		require(i == 0 || f.decodeTime > reader.decode_time(i - 1), at + "decode time does not increase.");
+		require(reader.sample_at(f.decodeTime) == i, at + "time lookup returns another sample.");
+		// The first NAL unit type the encoder writes for an IDR picture is 5; other pictures have none.
+		auto idr = false;
+		uint32_t pos = 0;
+		while (pos + reader.nal_length_size() <= f.size)
+		{
+			uint32_t length = 0;
+			for (auto b = 0u; b < reader.nal_length_size(); ++b)
+				length = (length << 8) | f.data[pos + b];
+			pos += reader.nal_length_size();
+			require(length > 0 && length <= f.size - pos, at + "broken NAL length.");
+			idr = idr || (f.data[pos] & 0x1f) == 5;
+			pos += length;
+		}
+		require(pos == f.size, at + "NAL units do not fill the sample.");
+		require(idr == f.keyframe, at + (f.keyframe ? "keyframe has no IDR picture." : "IDR picture is not marked as a keyframe."));
+		uint32_t expected = 0;
+		for (auto k : keyframes)
+			expected = k <= i ? k : expected;
+		require(reader.keyframe_before(i) == expected && reader.seek(f.decodeTime) == expected, at + "wrong keyframe for seeking.");
+	}
+}
+
+int main(int argc, char**argv)
+{
+	if (argc < 2 || (strcmp(argv[1], "-check") == 0 && argc < 4))
+	{
+		printf("Usage: MovieReader <movie.mp4> [frame [out.h264]]\n");
+		printf("       MovieReader -check <movie.mp4> samples [keyframe...]\n");
+		return 1;
+	}
+	try {
+		if (strcmp(argv[1], "-check") == 0)
+		{
+			mp4_reader reader(argv[2]);
+			vector<uint32_t> keyframes;
+			for (auto i = 4; i < argc; ++i)
+				keyframes.push_back(static_cast<uint32_t>(strtoul(argv[i], nullptr, 10)));
+			self_check(reader, static_cast<uint32_t>(strtoul(argv[3], nullptr, 10)), keyframes);
+			printf("%s: ok\n", argv[2]);
+			return 0;
+		}
+
+		// Listing the tables and extracting one GOP touch only a few samples.
+		mp4_reader reader(argv[1], file_access::random);
+		if (argc < 3)
+		{
+			printf("%ux%u, %u samples, %.3f sec, %u keyframes\n",
+				reader.width(), reader.height(), reader.sample_count(),
+				double(reader.duration()) / reader.timescale(),
+				static_cast<unsigned int>(reader.keyframes().size()));
+			printf("keyframes:");
+			for (auto k : reader.keyframes())
+				printf(" %u", k);
+			printf("\n");
+			return 0;
+		}
+
+		auto index = static_cast<uint32_t>(strtoul(argv[2], nullptr, 10));
+		if (index >= reader.sample_count())
+			throw runtime_error("Frame is out of range.");
+		auto frame = reader.frame(index);
+		auto start = reader.keyframe_before(index);
+		printf("frame %u: offset %llu, %u bytes, time %.4f sec%s, decode from keyframe %u\n",
+			index, static_cast<unsigned long long>(reader.offset(index)), frame.size,
+			double(frame.presentationTime) / reader.timescale(), frame.keyframe ? " (keyframe)" : "", start);
+		if (argc < 4)
+			return 0;
+
+		// Everything needed to decode the frame: parameter sets, then keyframe..frame.
+		auto out = fopen(argv[3], "wb");
+		if (!out)
+			throw runtime_error("Cannot open output.");
+		uint32_t configSize;
+		auto config = reader.avc_config(configSize);
+		if (config)
+			write_parameter_sets(out, config, configSize);
+		for (auto i = start; i <= index; ++i)
+		{
+			auto f = reader.frame(i);
+			write_annexb(out, f.data, f.size, reader.nal_length_size());
+		}
+		fclose(out);
+	}
+	catch (exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,84 @@
+﻿// PreviewViewer.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include "../Common/preview_tap.h"
+
+using namespace std;
+
+static void put16(FILE* out, uint32_t v)
+{
+	fputc(v & 0xff, out);
+	fputc((v >> 8) & 0xff, out);
+}
+
+static void put32(FILE* out, uint32_t v)
+{
+	put16(out, v & 0xffff);
+	put16(out, v >> 16);
+}
+
+//! \brief Write a top-down 32-bit BMP
+static void write_bmp(const char* path, const unsigned char* data, unsigned int width, unsigned int height)
+{
+	auto out = fopen(path, "wb");
+	if (!out)
+		throw runtime_error("Cannot open output file.");
+	auto imageSize = 4u * width * height;
+	fputc('B', out);
+	fputc('M', out);
+	put32(out, 14 + 40 + imageSize);
+	put32(out, 0);
+	put32(out, 14 + 40);
+	put32(out, 40);
+	put32(out, width);
+	put32(out, static_cast<uint32_t>(-static_cast<int32_t>(height)));
+	put16(out, 1);
+	put16(out, 32);
+	put32(out, 0);		// BI_RGB
+	put32(out, imageSize);
+	put32(out, 2835);	// 72 dpi
+	put32(out, 2835);
+	put32(out, 0);
+	put32(out, 0);
+	fwrite(data, 1, imageSize, out);
+	fclose(out);
+}
+
+int main(int argc, char**argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: PreviewViewer name output.bmp [interval ms] [count]\n");
+		return 1;
+	}
+	auto interval = argc > 3 ? atoi(argv[3]) : 200;
+	auto count = argc > 4 ? atoi(argv[4]) : 0;
+	try {
+		preview_reader reader(argv[1]);
+		vector<unsigned char> image;
+		uint64_t last = 0;
+		for (auto i = 0; count == 0 || i < count; )
+		{
+			this_thread::sleep_for(chrono::milliseconds(interval));
+			preview_view view;
+			if (reader.published() == last || !reader.read(image, view))
+				continue;
+			write_bmp(argv[2], view.data, view.width, view.height);
+			printf("frame %llu at %.3f s, %ux%u, %llu published\n",
+				static_cast<unsigned long long>(view.frame), view.timestamp / 1e7,
+				view.width, view.height, static_cast<unsigned long long>(view.published));
+			last = view.published;
+			++i;
+		}
+	}
+	catch (exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
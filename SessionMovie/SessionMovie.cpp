@@ -0,0 +1,574 @@
+﻿// SessionMovie.cpp
+
+#include <Windows.h>
+#include <tchar.h>
+#include <intrin.h>
+#include <stdexcept>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <Shlwapi.h>
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mfreadwrite.h>
+#include <Mferror.h>
+#include <codecapi.h>
+#include "../Common/writer_telemetry.h"
+
+#pragma comment(lib, "Shlwapi.lib")
+#pragma comment(lib, "Mfplat.lib")
+#pragma comment(lib, "Mfreadwrite.lib")
+#pragma comment(lib, "Mfuuid.lib")
+
+using namespace std;
+
+//! \brief COM smart pointer
+template<typename T>
+class com_ptr
+{
+	static_assert(is_base_of<IUnknown, T>::value, "T is not a COM.");
+	using this_type = com_ptr<T>;
+	T* mPtr = nullptr;
+public:
+	com_ptr()					{}
+	com_ptr(T* p)				{ mPtr = p; }
+	~com_ptr()					{ release(); }
+	void release()
+	{
+		if(mPtr) {
+			auto t = mPtr;
+			mPtr = nullptr;
+			t->Release();
+		}
+	}
+	T*& get()					{ return mPtr; }
+	T* operator->() const		{ return mPtr; }
+	this_type& operator=(T* p)
+	{
+		release();
+		mPtr = p;
+		return *this;
+	 }
+	this_type& operator=(this_type&) = delete;
+};
+
+void CHK(HRESULT hr)
+{
+	if(FAILED(hr))
+		throw runtime_error("");
+}
+
+template<typename T>
+void CHK(T* p)
+{
+	if(FAILED(hr))
+		throw runtime_error("HRESULT failed.");
+}
+
+template<typename T>
+void CHK(com_ptr<T>& p)
+{
+	if(p.get() == nullptr)
+		throw runtime_error("Nullptr.");
+}
+
+//! \brief Movie writer
+class movie_writer
+{
+	com_ptr<IStream> mComStream;
+	com_ptr<IMFByteStream> mOutputStream;
+	com_ptr<IMFAttributes> mOutputAttr;
+	com_ptr<IMFSinkWriter> mSinkWriter;
+	DWORD mStreamIndex;
+	com_ptr<IMFMediaType> mOutputType;
+	com_ptr<IMFMediaType> mInputType;
+	unsigned int mFrameSize;
+
+	com_ptr<IMFMediaBuffer> mBuffer;
+	UINT64 mTotalTime = 0;
+	writer_telemetry* mTelemetry = nullptr;
+	unsigned int mFrameCount = 0;
+	bool mForceKeyframe = false;
+
+	//! \brief Set an ICodecAPI property of the encoder; fails when the encoder does not support it
+	HRESULT try_set_codec_value(const GUID& api, ULONG value)
+	{
+		com_ptr<ICodecAPI> codec;
+		auto hr = mSinkWriter->GetServiceForStream(mStreamIndex, GUID_NULL, __uuidof(ICodecAPI), reinterpret_cast<LPVOID*>(&codec.get()));
+		if (FAILED(hr))
+			return hr;
+		VARIANT var;
+		VariantInit(&var);
+		var.vt = VT_UI4;
+		var.ulVal = value;
+		return codec->SetValue(&api, &var);
+	}
+	void set_codec_value(const GUID& api, ULONG value)
+	{
+		CHK(try_set_codec_value(api, value));
+	}
+public:
+	movie_writer(const TCHAR* path,
+				unsigned int width,
+				unsigned int height,
+				unsigned int frameRate,
+				unsigned int bitrate = 1 * 1024 * 1024,
+				const GUID& inputFormat = MFVideoFormat_RGB32)
+	{
+		CHK(CoInitialize(nullptr));
+		CHK(MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET));
+		//CHK(mComStream = SHCreateMemStream(nullptr, 0));
+		//CHK(MFCreateMFByteStreamOnStream(mComStream.get(), &mOutputStream.get()));
+		CHK(MFCreateAttributes(&mOutputAttr.get(), 10));
+		CHK(mOutputAttr->SetUINT32(MF_READWRITE_ENABLE_HARDWARE_TRANSFORMS, TRUE));
+		CHK(mOutputAttr->SetGUID(MF_TRANSCODE_CONTAINERTYPE, MFTranscodeContainerType_MPEG4));
+		CHK(MFCreateSinkWriterFromURL(path, nullptr, mOutputAttr.get(), &mSinkWriter.get()));
+		CHK(MFCreateMediaType(&mOutputType.get()));
+		CHK(mOutputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
+		CHK(mOutputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
+		CHK(mOutputType->SetUINT32(MF_MT_AVG_BITRATE, bitrate));
+		CHK(mOutputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
+		CHK(MFSetAttributeSize(mOutputType.get(), MF_MT_FRAME_SIZE, width, height));
+		CHK(MFSetAttributeRatio(mOutputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
+		CHK(MFSetAttributeRatio(mOutputType.get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
+		CHK(mSinkWriter->AddStream(mOutputType.get(), &mStreamIndex));
+		mOutputType.release();
+		CHK(MFCreateMediaType(&mInputType.get()));
+		CHK(mInputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
+		CHK(mInputType->SetGUID(MF_MT_SUBTYPE, inputFormat));
+		CHK(mInputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
+		CHK(MFSetAttributeSize(mInputType.get(), MF_MT_FRAME_SIZE, width, height));
+		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
+		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
+		CHK(mSinkWriter->SetInputMediaType(mStreamIndex, mInputType.get(), nullptr));
+		mInputType.release();
+		// NV12 and I420 (e.g. from fused_converter) are 12 bits per pixel.
+		if (inputFormat == MFVideoFormat_NV12 || inputFormat == MFVideoFormat_I420)
+			mFrameSize = width * height * 3 / 2;
+		else
+			mFrameSize = 4 * width * height;
+		CHK(MFCreateMemoryBuffer(mFrameSize, &mBuffer.get()));
+		CHK(mSinkWriter->BeginWriting());
+	}
+	~movie_writer()
+	{
+	}
+	//! \brief Publish counters and latencies of write() (nullptr to stop)
+	void set_telemetry(writer_telemetry* telemetry)
+	{
+		mTelemetry = telemetry;
+	}
+	void write(const char* data, UINT64 duration)
+	{
+		UINT64 start = 0;
+		if (mTelemetry)
+		{
+			start = writer_telemetry::now();
+			mTelemetry->add_submitted();
+		}
+		mBuffer.release();
+		CHK(MFCreateMemoryBuffer(mFrameSize, &mBuffer.get()));
+		BYTE* destPtr;
+		CHK(mBuffer->Lock(&destPtr, nullptr, nullptr));
+		if (reinterpret_cast<INT_PTR>(destPtr) % 16 != 0)
+			throw runtime_error("Alignment error.");
+#if 0
+		for(auto i = 0u; i < mFrameSize; i += 16)
+		{
+			auto d = _mm_lddqu_si128(reinterpret_cast<const __m128i*>(data + i));
+			_mm_stream_si128(reinterpret_cast<__m128i*>(destPtr + i), d);
+		}
+		_mm_mfence();
+#else
+		memcpy(destPtr, data, mFrameSize);
+#endif
+		CHK(mBuffer->Unlock());
+		CHK(mBuffer->SetCurrentLength(mFrameSize));
+		
+		com_ptr<IMFSample> sample;
+		CHK(MFCreateSample(&sample.get()));
+		CHK(sample->AddBuffer(mBuffer.get()));
+		CHK(sample->SetSampleTime(mTotalTime));
+		CHK(sample->SetSampleDuration(duration));
+		mTotalTime += duration;
+		if (mForceKeyframe)
+		{
+			// The encoder applies this to the next input it processes. A synchronous software
+			// encoder has consumed every earlier sample, so that is this one. An asynchronous
+			// hardware MFT may still hold queued input, and the keyframe can then come early.
+			// Forcing is a hint: an encoder without ForceKeyFrame keeps its own GOP rather than failing the write.
+			try_set_codec_value(CODECAPI_AVEncVideoForceKeyFrame, 1);
+			mForceKeyframe = false;
+		}
+		UINT64 sinkStart = mTelemetry ? writer_telemetry::now() : 0;
+		CHK(mSinkWriter->WriteSample(mStreamIndex, sample.get()));
+		if (mTelemetry)
+		{
+			auto end = writer_telemetry::now();
+			mTelemetry->record_sink(end - sinkStart);
+			mTelemetry->record_write(end - start);
+			mTelemetry->add_written();
+			mTelemetry->add_bytes(mFrameSize);
+			if ((++mFrameCount & 15) == 0)
+			{
+				MF_SINK_WRITER_STATISTICS stats = { sizeof(stats) };
+				if (SUCCEEDED(mSinkWriter->GetStatistics(mStreamIndex, &stats)))
+					mTelemetry->set_bytes_out(stats.qwByteCountProcessed);
+			}
+		}
+	}
+	//! \brief Change the encoder bitrate from the next frame
+	void set_bitrate(unsigned int bitrate)
+	{
+		set_codec_value(CODECAPI_AVEncCommonMeanBitRate, bitrate);
+	}
+	//! \brief Request a keyframe at the next written frame; exact with a synchronous encoder (see write())
+	void force_keyframe()
+	{
+		mForceKeyframe = true;
+	}
+	void finalize()
+	{
+		CHK(mSinkWriter->Flush(mStreamIndex));
+		CHK(mSinkWriter->Finalize());
+		mTotalTime = 0;
+	}
+};
+
+//! \brief Recorder session that keeps Media Foundation warm across recordings
+//! \details Startup, media types and a sample pool are created once. Writers for the next
+//!          clip are created and begun on a background thread by prepare(), and finished
+//!          clips are finalized there too, so start() and finish() only swap pointers.
+//!          Pending prepares run before pending finalizes, and start() waits only for them.
+class recorder_session
+{
+	using string_type = basic_string<TCHAR>;
+
+	com_ptr<IMFAttributes> mOutputAttr;
+	com_ptr<IMFMediaType> mOutputType;
+	com_ptr<IMFMediaType> mInputType;
+	com_ptr<IMFVideoSampleAllocatorEx> mAllocator;
+	unsigned int mFrameSize;
+
+	com_ptr<IMFSinkWriter> mWriter;
+	UINT64 mTotalTime = 0;
+
+	// Background thread state, guarded by mMutex
+	thread mWorker;
+	mutex mMutex;
+	condition_variable mWake;
+	condition_variable mIdle;
+	deque<function<void()>> mPrepareTasks;
+	deque<function<void()>> mTasks;
+	unsigned int mPreparing = 0;	// prepare() calls not yet done
+	bool mBusy = false;
+	bool mQuit = false;
+	IMFSinkWriter* mPrepared = nullptr;
+	string_type mPreparedPath;
+	exception_ptr mError;
+
+	IMFSinkWriter* create_writer(const string_type& path)
+	{
+		com_ptr<IMFSinkWriter> writer;
+		DWORD streamIndex;
+		CHK(MFCreateSinkWriterFromURL(path.c_str(), nullptr, mOutputAttr.get(), &writer.get()));
+		CHK(writer->AddStream(mOutputType.get(), &streamIndex));
+		CHK(writer->SetInputMediaType(streamIndex, mInputType.get(), nullptr));
+		CHK(writer->BeginWriting());
+		auto p = writer.get();
+		writer.get() = nullptr;
+		return p;
+	}
+	void post(function<void()> task)
+	{
+		{
+			lock_guard<mutex> lock(mMutex);
+			mTasks.push_back(move(task));
+		}
+		mWake.notify_one();
+	}
+	void rethrow_error(unique_lock<mutex>& lock)
+	{
+		if (mError)
+		{
+			auto e = mError;
+			mError = nullptr;
+			lock.unlock();
+			rethrow_exception(e);
+		}
+	}
+	void wait_idle()
+	{
+		unique_lock<mutex> lock(mMutex);
+		mIdle.wait(lock, [&] { return mPrepareTasks.empty() && mTasks.empty() && !mBusy; });
+		rethrow_error(lock);
+	}
+	void loop()
+	{
+		CHK(CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+		for (;;)
+		{
+			function<void()> task;
+			{
+				unique_lock<mutex> lock(mMutex);
+				mWake.wait(lock, [&] { return mQuit || !mPrepareTasks.empty() || !mTasks.empty(); });
+				auto& tasks = mPrepareTasks.empty() ? mTasks : mPrepareTasks;
+				if (tasks.empty())
+					break;
+				task = move(tasks.front());
+				tasks.pop_front();
+				mBusy = true;
+			}
+			try {
+				task();
+			}
+			catch (...) {
+				lock_guard<mutex> lock(mMutex);
+				mError = current_exception();
+			}
+			{
+				lock_guard<mutex> lock(mMutex);
+				mBusy = false;
+			}
+			mIdle.notify_all();
+		}
+		CoUninitialize();
+	}
+public:
+	//! \param poolSize Number of pooled samples. Frames beyond it use a temporary buffer.
+	recorder_session(unsigned int width,
+				unsigned int height,
+				unsigned int frameRate,
+				unsigned int bitrate = 1 * 1024 * 1024,
+				unsigned int poolSize = 8)
+	{
+		CHK(CoInitialize(nullptr));
+		CHK(MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET));
+		CHK(MFCreateAttributes(&mOutputAttr.get(), 10));
+		CHK(mOutputAttr->SetUINT32(MF_READWRITE_ENABLE_HARDWARE_TRANSFORMS, TRUE));
+		CHK(mOutputAttr->SetGUID(MF_TRANSCODE_CONTAINERTYPE, MFTranscodeContainerType_MPEG4));
+		CHK(MFCreateMediaType(&mOutputType.get()));
+		CHK(mOutputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
+		CHK(mOutputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
+		CHK(mOutputType->SetUINT32(MF_MT_AVG_BITRATE, bitrate));
+		CHK(mOutputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
+		CHK(MFSetAttributeSize(mOutputType.get(), MF_MT_FRAME_SIZE, width, height));
+		CHK(MFSetAttributeRatio(mOutputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
+		CHK(MFSetAttributeRatio(mOutputType.get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
+		CHK(MFCreateMediaType(&mInputType.get()));
+		CHK(mInputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
+		CHK(mInputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_RGB32));
+		CHK(mInputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
+		CHK(MFSetAttributeSize(mInputType.get(), MF_MT_FRAME_SIZE, width, height));
+		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
+		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
+		mFrameSize = 4 * width * height;
+		// Samples go back to the pool when the encoder releases them, across clips.
+		com_ptr<IMFAttributes> allocAttr;
+		CHK(MFCreateAttributes(&allocAttr.get(), 1));
+		CHK(MFCreateVideoSampleAllocatorEx(__uuidof(IMFVideoSampleAllocatorEx), reinterpret_cast<void**>(&mAllocator.get())));
+		CHK(mAllocator->InitializeSampleAllocatorEx(poolSize, poolSize, allocAttr.get(), mInputType.get()));
+		mWorker = thread([this] { loop(); });
+	}
+	~recorder_session()
+	{
+		try {
+			if (mWriter.get())
+				finish();
+			wait_idle();
+		}
+		catch (...) {
+		}
+		{
+			lock_guard<mutex> lock(mMutex);
+			mQuit = true;
+		}
+		mWake.notify_one();
+		mWorker.join();
+		if (mPrepared)
+			mPrepared->Release();
+		// Everything created on Media Foundation goes before it shuts down.
+		mWriter.release();
+		mAllocator.release();
+		mInputType.release();
+		mOutputType.release();
+		mOutputAttr.release();
+		MFShutdown();
+		CoUninitialize();
+	}
+
+	//! \brief Create and begin the writer for the next clip in the background
+	void prepare(const TCHAR* path)
+	{
+		string_type p(path);
+		{
+			lock_guard<mutex> lock(mMutex);
+			++mPreparing;
+			mPrepareTasks.push_back([this, p]
+			{
+				IMFSinkWriter* writer = nullptr;
+				exception_ptr error;
+				try {
+					writer = create_writer(p);
+				}
+				catch (...) {
+					error = current_exception();
+				}
+				{
+					lock_guard<mutex> lock(mMutex);
+					if (writer)
+					{
+						if (mPrepared)
+							mPrepared->Release();
+						mPrepared = writer;
+						mPreparedPath = p;
+					}
+					if (error)
+						mError = error;
+					--mPreparing;
+				}
+				mIdle.notify_all();
+			});
+		}
+		mWake.notify_one();
+	}
+	//! \brief Start writing a clip. Uses the prepared writer if its path matches.
+	//! \note Waits for pending prepare() calls only, not for finalizing earlier clips.
+	void start(const TCHAR* path)
+	{
+		if (mWriter.get())
+			throw runtime_error("Clip is already started.");
+		{
+			unique_lock<mutex> lock(mMutex);
+			mIdle.wait(lock, [&] { return mPreparing == 0; });
+			rethrow_error(lock);
+			if (mPrepared && mPreparedPath == path)
+			{
+				mWriter = mPrepared;
+				mPrepared = nullptr;
+			}
+		}
+		if (!mWriter.get())
+			mWriter = create_writer(path);
+		mTotalTime = 0;
+	}
+	void write(const char* data, UINT64 duration)
+	{
+		com_ptr<IMFSample> sample;
+		com_ptr<IMFMediaBuffer> buffer;
+		auto hr = mAllocator->AllocateSample(&sample.get());
+		if (hr == MF_E_SAMPLEALLOCATOR_EMPTY)
+		{
+			CHK(MFCreateSample(&sample.get()));
+			CHK(MFCreateMemoryBuffer(mFrameSize, &buffer.get()));
+			CHK(sample->AddBuffer(buffer.get()));
+		}
+		else
+		{
+			CHK(hr);
+			CHK(sample->GetBufferByIndex(0, &buffer.get()));
+		}
+		BYTE* destPtr;
+		CHK(buffer->Lock(&destPtr, nullptr, nullptr));
+		memcpy(destPtr, data, mFrameSize);
+		CHK(buffer->Unlock());
+		CHK(buffer->SetCurrentLength(mFrameSize));
+		CHK(sample->SetSampleTime(mTotalTime));
+		CHK(sample->SetSampleDuration(duration));
+		mTotalTime += duration;
+		CHK(mWriter->WriteSample(0, sample.get()));
+	}
+	//! \brief End the clip. Finalizing runs in the background.
+	void finish()
+	{
+		auto writer = mWriter.get();
+		if (!writer)
+			return;
+		mWriter.get() = nullptr;
+		post([writer]
+		{
+			com_ptr<IMFSinkWriter> w(writer);
+			CHK(w->Flush(0));
+			CHK(w->Finalize());
+		});
+	}
+	//! \brief Wait until all background finalization is done
+	void flush()
+	{
+		wait_idle();
+	}
+};
+
+//! \brief Print startup latency of separate writers vs. a session
+int main(int argc, char**argv)
+{
+	const unsigned int width = 640, height = 360, frameRate = 30;
+	const unsigned int clips = argc > 1 ? atoi(argv[1]) : 20;
+	const unsigned int frames = 30;
+	using clock_type = chrono::high_resolution_clock;
+	auto us = [](clock_type::duration d) { return chrono::duration_cast<chrono::microseconds>(d).count(); };
+
+	char* data = new char[4 * width * height];
+	memset(data, 0x80, 4 * width * height);
+	auto name = [](unsigned int i)
+	{
+		TCHAR path[64];
+		_stprintf_s(path, _T("clip%03u.mp4"), i);
+		return basic_string<TCHAR>(path);
+	};
+
+	{
+		long long firstFrame = 0, gap = 0;
+		auto last = clock_type::now();
+		for (auto i = 0u; i < clips; ++i)
+		{
+			auto t0 = clock_type::now();
+			movie_writer mw(name(i).c_str(), width, height, frameRate);
+			mw.write(data, 333333);
+			auto t1 = clock_type::now();
+			firstFrame += us(t1 - t0);
+			if (i > 0)
+				gap += us(t1 - last);
+			for (auto f = 1u; f < frames; ++f)
+				mw.write(data, 333333);
+			last = clock_type::now();
+			mw.finalize();
+		}
+		printf("movie_writer:     first frame %lld us, clip gap %lld us\n",
+			firstFrame / clips, clips > 1 ? gap / (clips - 1) : 0);
+	}
+	{
+		recorder_session session(width, height, frameRate);
+		long long firstFrame = 0, gap = 0;
+		auto last = clock_type::now();
+		session.prepare(name(0).c_str());
+		session.flush();
+		for (auto i = 0u; i < clips; ++i)
+		{
+			auto t0 = clock_type::now();
+			session.start(name(i).c_str());
+			session.write(data, 333333);
+			auto t1 = clock_type::now();
+			firstFrame += us(t1 - t0);
+			if (i > 0)
+				gap += us(t1 - last);
+			if (i + 1 < clips)
+				session.prepare(name(i + 1).c_str());
+			for (auto f = 1u; f < frames; ++f)
+				session.write(data, 333333);
+			last = clock_type::now();
+			session.finish();
+		}
+		session.flush();
+		printf("recorder_session: first frame %lld us, clip gap %lld us\n",
+			firstFrame / clips, clips > 1 ? gap / (clips - 1) : 0);
+	}
+	delete[] data;
+	return 0;
+}
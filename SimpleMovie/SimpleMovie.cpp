@@ -3,12 +3,18 @@
 #include <Windows.h>
 #include <tchar.h>
 #include <intrin.h>
+#include <memory>
 #include <stdexcept>
 #include <Shlwapi.h>
 #include <mfapi.h>
 #include <mfidl.h>
 #include <mfreadwrite.h>
 #include <Mferror.h>
+#include <codecapi.h>
+#include "../Common/quality_metric.h"
+#include "../Common/rendition_ladder.h"
+#include "../Common/spill_file.h"
+#include "../Common/writer_telemetry.h"
 
 #pragma comment(lib, "Shlwapi.lib")
 #pragma comment(lib, "Mfplat.lib")
@@ -81,11 +87,34 @@ class movie_writer
 
 	com_ptr<IMFMediaBuffer> mBuffer;
 	UINT64 mTotalTime = 0;
+	writer_telemetry* mTelemetry = nullptr;
+	unsigned int mFrameCount = 0;
+	bool mForceKeyframe = false;
+
+	//! \brief Set an ICodecAPI property of the encoder; fails when the encoder does not support it
+	HRESULT try_set_codec_value(const GUID& api, ULONG value)
+	{
+		com_ptr<ICodecAPI> codec;
+		auto hr = mSinkWriter->GetServiceForStream(mStreamIndex, GUID_NULL, __uuidof(ICodecAPI), reinterpret_cast<LPVOID*>(&codec.get()));
+		if (FAILED(hr))
+			return hr;
+		VARIANT var;
+		VariantInit(&var);
+		var.vt = VT_UI4;
+		var.ulVal = value;
+		return codec->SetValue(&api, &var);
+	}
+	void set_codec_value(const GUID& api, ULONG value)
+	{
+		CHK(try_set_codec_value(api, value));
+	}
 public:
 	movie_writer(const TCHAR* path,
 				unsigned int width,
 				unsigned int height,
-				unsigned int frameRate)
+				unsigned int frameRate,
+				unsigned int bitrate = 1 * 1024 * 1024,
+				const GUID& inputFormat = MFVideoFormat_RGB32)
 	{
 		CHK(CoInitialize(nullptr));
 		CHK(MFStartup(MF_VERSION, MFSTARTUP_NOSOCKET));
@@ -98,7 +127,7 @@ public:
 		CHK(MFCreateMediaType(&mOutputType.get()));
 		CHK(mOutputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
 		CHK(mOutputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
-		CHK(mOutputType->SetUINT32(MF_MT_AVG_BITRATE, 1 * 1024 * 1024));
+		CHK(mOutputType->SetUINT32(MF_MT_AVG_BITRATE, bitrate));
 		CHK(mOutputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
 		CHK(MFSetAttributeSize(mOutputType.get(), MF_MT_FRAME_SIZE, width, height));
 		CHK(MFSetAttributeRatio(mOutputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
@@ -107,22 +136,37 @@ public:
 		mOutputType.release();
 		CHK(MFCreateMediaType(&mInputType.get()));
 		CHK(mInputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
-		CHK(mInputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_RGB32));
+		CHK(mInputType->SetGUID(MF_MT_SUBTYPE, inputFormat));
 		CHK(mInputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
 		CHK(MFSetAttributeSize(mInputType.get(), MF_MT_FRAME_SIZE, width, height));
 		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_FRAME_RATE, frameRate, 1));
 		CHK(MFSetAttributeRatio(mInputType.get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1));
 		CHK(mSinkWriter->SetInputMediaType(mStreamIndex, mInputType.get(), nullptr));
 		mInputType.release();
-		mFrameSize = 4 * width * height;
+		// NV12 and I420 (e.g. from fused_converter) are 12 bits per pixel.
+		if (inputFormat == MFVideoFormat_NV12 || inputFormat == MFVideoFormat_I420)
+			mFrameSize = width * height * 3 / 2;
+		else
+			mFrameSize = 4 * width * height;
 		CHK(MFCreateMemoryBuffer(mFrameSize, &mBuffer.get()));
 		CHK(mSinkWriter->BeginWriting());
 	}
 	~movie_writer()
 	{
 	}
+	//! \brief Publish counters and latencies of write() (nullptr to stop)
+	void set_telemetry(writer_telemetry* telemetry)
+	{
+		mTelemetry = telemetry;
+	}
 	void write(const char* data, UINT64 duration)
 	{
+		UINT64 start = 0;
+		if (mTelemetry)
+		{
+			start = writer_telemetry::now();
+			mTelemetry->add_submitted();
+		}
 		mBuffer.release();
 		CHK(MFCreateMemoryBuffer(mFrameSize, &mBuffer.get()));
 		BYTE* destPtr;
@@ -148,7 +192,41 @@ public:
 		CHK(sample->SetSampleTime(mTotalTime));
 		CHK(sample->SetSampleDuration(duration));
 		mTotalTime += duration;
+		if (mForceKeyframe)
+		{
+			// The encoder applies this to the next input it processes. A synchronous software
+			// encoder has consumed every earlier sample, so that is this one. An asynchronous
+			// hardware MFT may still hold queued input, and the keyframe can then come early.
+			// Forcing is a hint: an encoder without ForceKeyFrame keeps its own GOP rather than failing the write.
+			try_set_codec_value(CODECAPI_AVEncVideoForceKeyFrame, 1);
+			mForceKeyframe = false;
+		}
+		UINT64 sinkStart = mTelemetry ? writer_telemetry::now() : 0;
 		CHK(mSinkWriter->WriteSample(mStreamIndex, sample.get()));
+		if (mTelemetry)
+		{
+			auto end = writer_telemetry::now();
+			mTelemetry->record_sink(end - sinkStart);
+			mTelemetry->record_write(end - start);
+			mTelemetry->add_written();
+			mTelemetry->add_bytes(mFrameSize);
+			if ((++mFrameCount & 15) == 0)
+			{
+				MF_SINK_WRITER_STATISTICS stats = { sizeof(stats) };
+				if (SUCCEEDED(mSinkWriter->GetStatistics(mStreamIndex, &stats)))
+					mTelemetry->set_bytes_out(stats.qwByteCountProcessed);
+			}
+		}
+	}
+	//! \brief Change the encoder bitrate from the next frame
+	void set_bitrate(unsigned int bitrate)
+	{
+		set_codec_value(CODECAPI_AVEncCommonMeanBitRate, bitrate);
+	}
+	//! \brief Request a keyframe at the next written frame; exact with a synchronous encoder (see write())
+	void force_keyframe()
+	{
+		mForceKeyframe = true;
 	}
 	void finalize()
 	{
@@ -161,8 +239,50 @@ public:
 int main(int argc, char**argv)
 {
 	{
-		movie_writer mw(_T("hoge.mp4"), 640, 360, 30);
-		char* data = new char[4 * 640 * 360];
+		// With "-spill file", frames are captured into a spill file first and encoded afterwards.
+		auto spillPath = argc > 2 && strcmp(argv[1], "-spill") == 0 ? argv[2] : nullptr;
+		// With "-ladder", a 320x180 copy is written to hoge_180.mp4 alongside hoge.mp4.
+		auto ladder = argc > 1 && strcmp(argv[1], "-ladder") == 0;
+		// With "-reference file", each frame is compared with the same frame of a spill file written earlier with "-spill".
+		auto referencePath = argc > 2 && strcmp(argv[1], "-reference") == 0 ? argv[2] : nullptr;
+		const auto frameSize = 4u * 640 * 360;
+		unique_ptr<spill_writer> spill;
+		unique_ptr<movie_writer> mw;
+		unique_ptr<movie_writer> mw180;
+		unique_ptr<worker_pool> pool;
+		unique_ptr<rendition_ladder> renditions;
+		unique_ptr<spill_reader> reference;
+		unique_ptr<quality_meter> meter;
+		unique_ptr<quality_stage<movie_writer>> quality;
+		if (spillPath)
+		{
+			spill.reset(new spill_writer(spillPath, frameSize, spill_writer::required_capacity(7 * 30, frameSize)));
+		}
+		else if (ladder)
+		{
+			mw.reset(new movie_writer(_T("hoge.mp4"), 640, 360, 30, 1 * 1024 * 1024, MFVideoFormat_NV12));
+			mw180.reset(new movie_writer(_T("hoge_180.mp4"), 320, 180, 30, 256 * 1024, MFVideoFormat_NV12));
+			pool.reset(new worker_pool);
+			renditions.reset(new rendition_ladder(640, 360, {
+				{ 640, 360, [&](const char* frame, uint64_t duration) { mw->write(frame, duration); } },
+				{ 320, 180, [&](const char* frame, uint64_t duration) { mw180->write(frame, duration); } },
+			}, *pool));
+		}
+		else if (referencePath)
+		{
+			mw.reset(new movie_writer(_T("hoge.mp4"), 640, 360, 30));
+			reference.reset(new spill_reader(referencePath));
+			if (reference->frame_size() != frameSize)
+				throw runtime_error("Reference frame size mismatch.");
+			pool.reset(new worker_pool);
+			meter.reset(new quality_meter(640, 360, *pool, "hoge_quality.csv"));
+			quality.reset(new quality_stage<movie_writer>(*mw, *meter, [&](uint64_t i) { return reference->frame(i); }));
+		}
+		else
+		{
+			mw.reset(new movie_writer(_T("hoge.mp4"), 640, 360, 30));
+		}
+		char* data = new char[frameSize];
 		for (auto i = 0u; i < 7 * 30; ++i)
 		{
 			unsigned int pixel = (i * 5) % 256;
@@ -172,10 +292,34 @@ int main(int argc, char**argv)
 			{
 				*(reinterpret_cast<unsigned int*>(data) + c) = pixel;
 			}
-			mw.write(data, 333333);
+			if (spill)
+			{
+				if (!spill->write(data, 333333))
+					throw runtime_error("Spill file is full.");
+			}
+			else if (renditions)
+				renditions->write(data, 333333);
+			else if (quality)
+				quality->write(data, 333333);
+			else
+				mw->write(data, 333333);
 		}
 		delete[] data;
-		mw.finalize();
+		if (spill)
+		{
+			spill->close();
+			spill_reader reader(spillPath);
+			mw.reset(new movie_writer(_T("hoge.mp4"), 640, 360, 30));
+			reader.drain(*mw);
+		}
+		mw->finalize();
+		if (meter)
+		{
+			meter->summary(stdout);
+			meter->finalize();
+		}
+		if (mw180)
+			mw180->finalize();
 	}
 	CHK(MFShutdown());
 	return 0;
@@ -0,0 +1,73 @@
+﻿// WriterMonitor.cpp
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include "../Common/writer_telemetry.h"
+
+using namespace std;
+
+//! \brief Highest non-empty bucket
+static uint64_t max_latency(const uint64_t* counts)
+{
+	for (auto i = telemetry_histogram::Buckets; i > 0; --i)
+	{
+		if (counts[i - 1])
+			return telemetry_histogram::value_of(i - 1);
+	}
+	return 0;
+}
+
+static void print_latency(const char* name, const uint64_t* counts)
+{
+	printf("  %-6s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n", name,
+		telemetry_snapshot::percentile(counts, 50.0) / 1000.0,
+		telemetry_snapshot::percentile(counts, 99.0) / 1000.0,
+		telemetry_snapshot::percentile(counts, 99.9) / 1000.0,
+		max_latency(counts) / 1000.0);
+}
+
+int main(int argc, char**argv)
+{
+	const char* name = argc > 1 ? argv[1] : "GraphicsRecordTelemetry";
+	auto interval = argc > 2 ? atoi(argv[2]) : 1000;
+	auto count = argc > 3 ? atoi(argv[3]) : 0;
+	try {
+		telemetry_reader reader(name);
+		// The snapshot holds two histograms; keep it off the stack.
+		auto previous = new telemetry_snapshot;
+		auto current = new telemetry_snapshot;
+		reader.read(*previous);
+		for (auto i = 0; count == 0 || i < count; ++i)
+		{
+			this_thread::sleep_for(chrono::milliseconds(interval));
+			reader.read(*current);
+			auto seconds = (current->time - previous->time) / 1e9;
+			printf("%.1f s: submitted %llu, written %llu (%.1f fps), dropped %llu, merged %llu, queue %llu\n",
+				current->time / 1e9,
+				static_cast<unsigned long long>(current->submitted),
+				static_cast<unsigned long long>(current->written),
+				seconds > 0.0 ? (current->written - previous->written) / seconds : 0.0,
+				static_cast<unsigned long long>(current->dropped),
+				static_cast<unsigned long long>(current->merged),
+				static_cast<unsigned long long>(current->queueDepth));
+			printf("  bytes in %.1f MB (%.1f MB/s), out %.1f MB\n",
+				current->bytesIn / 1e6,
+				seconds > 0.0 ? (current->bytesIn - previous->bytesIn) / seconds / 1e6 : 0.0,
+				current->bytesOut / 1e6);
+			print_latency("write", current->writeLatency);
+			print_latency("sink", current->sinkLatency);
+			swap(previous, current);
+		}
+		delete previous;
+		delete current;
+	}
+	catch (exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}